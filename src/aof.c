@@ -32,6 +32,7 @@
 #include "rio.h"
 #ifdef USE_PB
 #include "libpmemobj.h"
+#include "libpmem.h"
 #include "pmem.h"
 #include "sds.h"
 #endif
@@ -204,18 +205,254 @@ ssize_t aofRewriteBufferWrite(int fd) {
 /* Starts a background task that performs fsync() against the specified
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
+#ifdef USE_PB
+    /* The PB records appended so far are durable once the fsync is done. */
+    if (server.persistent) {
+        bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,
+            (void*)(uintptr_t)pmemPBWatermark(),
+            (void*)(uintptr_t)server.aof_fd_gen);
+        return;
+    }
+#endif
     bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,NULL);
 }
 
+#ifdef USE_PMDK
+/* ----------------------------------------------------------------------------
+ * DAX AOF writer
+ *
+ * With aof-dax the AOF file is memory mapped with libpmem and extended in
+ * advance, aof-dax-prealloc bytes at a time: the commands are appended with
+ * memcpy() and cache line flushes, and are persistent as soon as they are
+ * written, with no write(2) or fsync(2). The file keeps the standard AOF
+ * format, followed by zeros up to its allocated size. Its logical size is
+ * persisted after every write in a small header file, named after the AOF
+ * with a ".dax" suffix, that only exists while the file is mapped: the
+ * file is truncated to its logical size when it is unmapped, on shutdown,
+ * when the AOF is disabled and when a rewritten AOF replaces it, or at the
+ * next startup after a crash. Off DAX, on tmpfs for instance, the data and
+ * the header are msync()ed instead.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_DAX_MAGIC 0x5841444641ULL   /* "AFDAX" */
+#define AOF_DAX_HEADER_SIZE 4096
+
+typedef struct aofDaxHeader {
+    uint64_t magic;     /* AOF_DAX_MAGIC once the header is valid. */
+    uint64_t ino;       /* Inode of the AOF file. */
+    uint64_t end;       /* Logical size of the AOF file. */
+} aofDaxHeader;
+
+static struct {
+    char *base;             /* Mapping of the AOF file, NULL if not mapped. */
+    size_t mapped;          /* Allocated (and mapped) size of the file. */
+    size_t end;             /* Logical size of the file. */
+    int is_pmem;
+    aofDaxHeader *hdr;
+    int hdr_is_pmem;
+} aofDax;
+
+static sds aofDaxHeaderName(void) {
+    return sdscatprintf(sdsempty(),"%s.dax",server.aof_filename);
+}
+
+static void aofDaxPersist(void *addr, size_t len, int is_pmem) {
+    if (is_pmem)
+        pmem_persist(addr,len);
+    else
+        pmem_msync(addr,len);
+}
+
+/* Map the file to 'size' bytes, extending it if needed. */
+static int aofDaxMap(size_t size) {
+    size_t mapped;
+    int is_pmem;
+    char *base = pmem_map_file(server.aof_filename,size,PMEM_FILE_CREATE,
+                               0644,&mapped,&is_pmem);
+
+    if (base == NULL) return C_ERR;
+    aofDax.base = base;
+    aofDax.mapped = mapped;
+    aofDax.is_pmem = is_pmem;
+    return C_OK;
+}
+
+int aofDaxActive(void) {
+    return aofDax.base != NULL;
+}
+
+size_t aofDaxSize(void) {
+    return aofDax.end;
+}
+
+/* Map the AOF file, which server.aof_fd refers to, if aof-dax is enabled.
+ * The header is written before the file is extended, so that a crash never
+ * leaves zeros at the end of the file with no header to trim them. */
+void aofDaxOpen(void) {
+    struct redis_stat sb;
+    sds hdrname;
+    size_t hdrlen;
+
+    if (!server.aof_dax || aofDax.hdr || server.aof_fd == -1) return;
+    if (redis_fstat(server.aof_fd,&sb) == -1) {
+        serverLog(LL_WARNING,"Can't map the AOF file: fstat: %s",
+            strerror(errno));
+        return;
+    }
+
+    hdrname = aofDaxHeaderName();
+    aofDax.hdr = pmem_map_file(hdrname,AOF_DAX_HEADER_SIZE,PMEM_FILE_CREATE,
+                               0644,&hdrlen,&aofDax.hdr_is_pmem);
+    if (aofDax.hdr == NULL) {
+        serverLog(LL_WARNING,"Can't map the AOF header file %s: %s",
+            hdrname, strerror(errno));
+        sdsfree(hdrname);
+        return;
+    }
+    aofDax.hdr->magic = 0;
+    aofDaxPersist(aofDax.hdr,sizeof(*aofDax.hdr),aofDax.hdr_is_pmem);
+    aofDax.hdr->ino = sb.st_ino;
+    aofDax.hdr->end = sb.st_size;
+    aofDaxPersist(aofDax.hdr,sizeof(*aofDax.hdr),aofDax.hdr_is_pmem);
+    aofDax.hdr->magic = AOF_DAX_MAGIC;
+    aofDaxPersist(aofDax.hdr,sizeof(*aofDax.hdr),aofDax.hdr_is_pmem);
+
+    aofDax.end = sb.st_size;
+    if (aofDaxMap(sb.st_size+server.aof_dax_prealloc) == C_ERR) {
+        serverLog(LL_WARNING,"Can't map the AOF file: %s, writing it with "
+            "write(2)", strerror(errno));
+        pmem_unmap(aofDax.hdr,AOF_DAX_HEADER_SIZE);
+        aofDax.hdr = NULL;
+        unlink(hdrname);
+        sdsfree(hdrname);
+        return;
+    }
+    sdsfree(hdrname);
+    serverLog(LL_NOTICE,"AOF file mapped for direct access (%s)",
+        aofDax.is_pmem ? "DAX" : "not DAX, msync() used");
+}
+
+/* Unmap the AOF file and truncate it to its logical size, so that it can
+ * be read and written like any AOF file again. */
+void aofDaxClose(void) {
+    sds hdrname;
+
+    if (aofDax.hdr == NULL) return;
+    if (aofDax.base) {
+        pmem_unmap(aofDax.base,aofDax.mapped);
+        aofDax.base = NULL;
+    }
+    if (ftruncate(server.aof_fd,aofDax.end) == -1 ||
+        aof_fsync(server.aof_fd) == -1)
+    {
+        /* The header is kept: the file is truncated at the next startup. */
+        serverLog(LL_WARNING,"Can't truncate the AOF file to %zu bytes: %s",
+            aofDax.end, strerror(errno));
+        pmem_unmap(aofDax.hdr,AOF_DAX_HEADER_SIZE);
+        aofDax.hdr = NULL;
+        return;
+    }
+    pmem_unmap(aofDax.hdr,AOF_DAX_HEADER_SIZE);
+    aofDax.hdr = NULL;
+    hdrname = aofDaxHeaderName();
+    unlink(hdrname);
+    sdsfree(hdrname);
+}
+
+/* Append to the mapped AOF file, extending it when it is full. Like
+ * writev(2) the number of bytes written is returned, or -1 with errno
+ * set: nothing is written then. */
+ssize_t aofDaxWrite(const struct iovec *iov, int iovcnt) {
+    size_t len = 0, pos;
+    int j;
+
+    for (j = 0; j < iovcnt; j++) len += iov[j].iov_len;
+    if (aofDax.end + len > aofDax.mapped) {
+        size_t size = aofDax.end + len + server.aof_dax_prealloc;
+        size_t oldsize = aofDax.mapped;
+
+        pmem_unmap(aofDax.base,aofDax.mapped);
+        if (aofDaxMap(size) == C_ERR) {
+            int saved_errno = errno;
+
+            /* Keep on writing what fits in the current size, if the file
+             * can be mapped again at least. */
+            if (aofDaxMap(oldsize) == C_ERR) {
+                serverLog(LL_WARNING,"Can't map the AOF file again: %s, "
+                    "writing it with write(2)", strerror(errno));
+                aofDax.base = NULL;
+                aofDaxClose();
+            }
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    pos = aofDax.end;
+    for (j = 0; j < iovcnt; j++) {
+        if (aofDax.is_pmem)
+            pmem_memcpy_nodrain(aofDax.base+pos,iov[j].iov_base,iov[j].iov_len);
+        else
+            memcpy(aofDax.base+pos,iov[j].iov_base,iov[j].iov_len);
+        pos += iov[j].iov_len;
+    }
+    if (aofDax.is_pmem)
+        pmem_drain();
+    else
+        pmem_msync(aofDax.base+aofDax.end,len);
+
+    aofDax.end = pos;
+    aofDax.hdr->end = pos;
+    aofDaxPersist(&aofDax.hdr->end,sizeof(aofDax.hdr->end),aofDax.hdr_is_pmem);
+    return len;
+}
+
+/* Called at startup, before the AOF is loaded: if the server stopped with
+ * the AOF file mapped, truncate it to the logical size in the header. */
+void aofDaxRecover(void) {
+    sds hdrname = aofDaxHeaderName();
+    aofDaxHeader hdr;
+    struct redis_stat sb;
+    int fd = open(hdrname,O_RDONLY);
+
+    if (fd == -1) {
+        sdsfree(hdrname);
+        return;
+    }
+    if (read(fd,&hdr,sizeof(hdr)) == sizeof(hdr) &&
+        hdr.magic == AOF_DAX_MAGIC &&
+        redis_stat(server.aof_filename,&sb) == 0 &&
+        (uint64_t)sb.st_ino == hdr.ino && (uint64_t)sb.st_size > hdr.end)
+    {
+        serverLog(LL_NOTICE,"Truncating the preallocated AOF file to its "
+            "logical size of %llu bytes", (unsigned long long)hdr.end);
+        if (truncate(server.aof_filename,hdr.end) == -1) {
+            serverLog(LL_WARNING,"Can't truncate the AOF file: %s",
+                strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+    unlink(hdrname);
+    sdsfree(hdrname);
+}
+#endif
+
 /* Called when the user switches from "appendonly yes" to "appendonly no"
  * at runtime using the CONFIG command. */
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
     flushAppendOnlyFile(1);
     aof_fsync(server.aof_fd);
+#ifdef USE_PMDK
+    aofDaxClose();
+#endif
     close(server.aof_fd);
 
     server.aof_fd = -1;
+#ifdef USE_PB
+    __atomic_add_fetch(&server.aof_fd_gen,1,__ATOMIC_RELEASE);
+#endif
     server.aof_selected_db = -1;
     server.aof_state = AOF_OFF;
     /* rewrite operation in progress? kill it, wait child exit */
@@ -291,10 +528,15 @@ int startAppendOnly(void) {
 #define AOF_WRITE_LOG_ERROR_RATE 30 /* Seconds between errors logging. */
 void flushAppendOnlyFile(int force) {
     ssize_t nwritten;
+    size_t pending = sdslen(server.aof_buf);
     int sync_in_progress = 0;
     mstime_t latency;
 
-    if (sdslen(server.aof_buf) == 0) return;
+#ifdef USE_PB
+    /* In drain mode the commands are written straight from the PB. */
+    if (server.persistent) pending += server.pb_drain_pending;
+#endif
+    if (pending == 0) return;
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
         sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
@@ -327,6 +569,18 @@ void flushAppendOnlyFile(int force) {
      * or alike */
 
     latencyStartMonitor(latency);
+#ifdef USE_PB
+    if (server.persistent)
+        nwritten = pmemPBWriteAOF(server.aof_fd);
+    else
+#endif
+#ifdef USE_PMDK
+    if (aofDaxActive()) {
+        struct iovec iov = { server.aof_buf, sdslen(server.aof_buf) };
+
+        nwritten = aofDaxWrite(&iov,1);
+    } else
+#endif
     nwritten = write(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
     latencyEndMonitor(latency);
     /* We want to capture different events for delayed writes:
@@ -346,7 +600,7 @@ void flushAppendOnlyFile(int force) {
     /* We performed the write so reset the postponed flush sentinel to zero. */
     server.aof_flush_postponed_start = 0;
 
-    if (nwritten != (signed)sdslen(server.aof_buf)) {
+    if (nwritten != (signed)pending) {
         static time_t last_write_error_log = 0;
         int can_log = 0;
 
@@ -369,7 +623,7 @@ void flushAppendOnlyFile(int force) {
                                        "the AOF file: (nwritten=%lld, "
                                        "expected=%lld)",
                                        (long long)nwritten,
-                                       (long long)sdslen(server.aof_buf));
+                                       (long long)pending);
             }
 
             if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
@@ -405,6 +659,11 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+#ifdef USE_PB
+                if (server.persistent)
+                    pmemPBConsumeAOF(nwritten);
+                else
+#endif
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -419,6 +678,9 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+#ifdef USE_PB
+    if (server.persistent) pmemPBConsumeAOF(nwritten);
+#endif
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -429,6 +691,18 @@ void flushAppendOnlyFile(int force) {
         server.aof_buf = sdsempty();
     }
 
+#ifdef USE_PMDK
+    /* Written through the mapping: there is nothing to fsync. */
+    if (aofDaxActive()) {
+#ifdef USE_PB
+        if (server.persistent) pmemPBSetDurable(pmemPBWatermark());
+        server.pb_fsync_asap = 0;
+#endif
+        server.aof_last_fsync = server.unixtime;
+        return;
+    }
+#endif
+
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
     if (server.aof_no_fsync_on_rewrite &&
@@ -443,9 +717,21 @@ void flushAppendOnlyFile(int force) {
         aof_fsync(server.aof_fd); /* Let's try to get this data on the disk */
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-fsync-always",latency);
+#ifdef USE_PB
+        if (server.persistent) pmemPBSetDurable(pmemPBWatermark());
+#endif
         server.aof_last_fsync = server.unixtime;
     } else if ((server.aof_fsync == AOF_FSYNC_EVERYSEC &&
-                server.unixtime > server.aof_last_fsync + server.aof_flush_timer)) {
+#ifdef USE_PB
+                server.unixtime > server.aof_last_fsync + server.aof_flush_timer) ||
+               server.pb_fsync_asap) {
+        /* See pmemPBRequestFsync(). */
+        server.pb_fsync_asap = 0;
+        if (server.aof_fsync != AOF_FSYNC_EVERYSEC)
+            sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
+#else
+                server.unixtime > server.aof_last_fsync)) {
+#endif
         if (!sync_in_progress) aof_background_fsync(server.aof_fd);
         server.aof_last_fsync = server.unixtime;
     }
@@ -516,6 +802,14 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
     sds buf = sdsempty();
     robj *tmpargv[3];
+#ifdef USE_PB
+    int shard = -1;
+
+    if (server.persistent) {
+        shard = pmemPBShard(cmd, dictid, argv, argc);
+        pmemSplitPBBatch(shard, cmd->proc == multiCommand);
+    }
+#endif
 
     /* The DB this command was targeting is not the same as the last command
      * we appended. To issue a SELECT command is needed. */
@@ -550,7 +844,11 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
      * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+    if (server.aof_state == AOF_ON
+#ifdef USE_PB
+        && !pmemPBDrainsAOF()
+#endif
+       )
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
 
     /* If a background append only file rewriting is in progress we want to
@@ -561,12 +859,13 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
 
 #ifdef USE_PB
-    void* reference;
-    TX_BEGIN(server.pm_pool) {
-        pmemAddToPBList(sdsdupPM(buf, &reference));
-    } TX_ONABORT {
-        serverLog(LL_PB, "PB ERROR: add command to PB list failed");
-    } TX_END
+    /* A MULTI/EXEC block, a transaction or the effects of a script, is
+     * persisted in the PB as a single record. */
+    if (server.persistent) {
+        if (cmd->proc == multiCommand) pmemBeginPBUnit();
+        pmemLogCommand(buf, sdslen(buf), dictid, shard);
+        if (cmd->proc == execCommand) pmemEndPBUnit();
+    }
 #endif
 
     sdsfree(buf);
@@ -631,6 +930,7 @@ int loadAppendOnlyFile(char *filename) {
     int old_aof_state = server.aof_state;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of the latest well-formed command loaded. */
+    off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
 
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
         server.aof_current_size = 0;
@@ -709,8 +1009,17 @@ int loadAppendOnlyFile(char *filename) {
             exit(1);
         }
 
-        /* Run the command in the context of a fake client */
-        cmd->proc(fakeClient);
+        if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
+
+        /* Run the command in the context of a fake client. The commands of
+         * a MULTI/EXEC block are queued, so that a block cut short by a
+         * crash is not applied at all. */
+        fakeClient->cmd = fakeClient->lastcmd = cmd;
+        if (fakeClient->flags & CLIENT_MULTI && cmd->proc != execCommand) {
+            queueMultiCommand(fakeClient);
+        } else {
+            cmd->proc(fakeClient);
+        }
 
         /* The fake client should not have a reply */
         serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
@@ -724,7 +1033,8 @@ int loadAppendOnlyFile(char *filename) {
     }
 
     /* This point can only be reached when EOF is reached without errors.
-     * If the client is in the middle of a MULTI/EXEC, log error and quit. */
+     * If the client is in the middle of a MULTI/EXEC, handle it as an
+     * unexpected EOF. */
     if (fakeClient->flags & CLIENT_MULTI) goto uxeof;
 
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
@@ -744,6 +1054,12 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
+    /* Truncate the AOF before an incomplete MULTI/EXEC block, whose queued
+     * commands were not applied: the PB, if any, has the whole block. */
+    if (fakeClient && fakeClient->flags & CLIENT_MULTI) {
+        serverLog(LL_WARNING,"Revert incomplete MULTI/EXEC transaction in AOF file");
+        valid_up_to = valid_before_multi;
+    }
     if (server.aof_load_truncated) {
         serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
@@ -779,134 +1095,614 @@ fmterr: /* Format error. */
 }
 
 #ifdef USE_PB
-#define PB_LOG_BUFFER_DELIMITER "\n"
 #define PB_RECONSTRUCT_CODE_OK 0
 #define PB_RECONSTRUCT_CODE_FMTERR 1
-#define PB_RECONSTRUCT_CODE_READERR 1
-int parsePersistentBufferLine(struct client *fakeClient, const char *log_str) {
-    int argc, j;
-    unsigned long len;
+#define PB_RECONSTRUCT_CODE_READERR 2
+#define PB_RECONSTRUCT_CODE_CHECKSUMERR 3
+
+/* Parse a "<type><number>\r\n" RESP header at *p without reading past
+ * 'end'. On success *p is moved after the header. */
+static int pbParseHeader(const char **p, const char *end, char type,
+                         long long *value)
+{
+    const char *nl;
+
+    if (*p >= end) return PB_RECONSTRUCT_CODE_READERR;
+    if (**p != type) return PB_RECONSTRUCT_CODE_FMTERR;
+    nl = memchr(*p, '\r', end - *p);
+    if (nl == NULL || nl+1 >= end) return PB_RECONSTRUCT_CODE_READERR;
+    if (nl[1] != '\n' || !string2ll(*p+1, nl-(*p+1), value))
+        return PB_RECONSTRUCT_CODE_FMTERR;
+    *p = nl+2;
+    return PB_RECONSTRUCT_CODE_OK;
+}
+
+/* A command parsed out of a record, ready to be executed. */
+typedef struct pbParsedCommand {
+    int argc;
     robj **argv;
-    sds argsds;
-    char buf[strlen(log_str) + 1];
-    struct redisCommand *cmd;
+    struct redisCommand *cmd;   /* NULL when the command is unknown. */
+    const char *start;          /* The command itself in a RESP record. */
+    size_t aof_len;             /* Size of the command in the AOF format. */
+    int replay;                 /* Not in the AOF yet: log and execute it. */
+} pbParsedCommand;
+
+/* Read the next command of an AOF formatted record. The payload is parsed
+ * in place, straight out of the pool: arguments are copied only once, into
+ * their (embedded when small enough) string objects. */
+static int pbReadCommand(pbParsedCommand *pc, const char **p, const char *end) {
+    long long argc, len;
+    int j, errcode;
+
+    pc->argc = 0;
+    pc->argv = NULL;
+    if ((errcode = pbParseHeader(p, end, '*', &argc)) != PB_RECONSTRUCT_CODE_OK)
+        return errcode;
+    if (argc < 1 || argc > INT_MAX) return PB_RECONSTRUCT_CODE_FMTERR;
+
+    pc->argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        errcode = pbParseHeader(p, end, '$', &len);
+        if (errcode == PB_RECONSTRUCT_CODE_OK && len < 0)
+            errcode = PB_RECONSTRUCT_CODE_FMTERR;
+        if (errcode == PB_RECONSTRUCT_CODE_OK && end - *p < len + 2)
+            errcode = PB_RECONSTRUCT_CODE_READERR;
+        if (errcode != PB_RECONSTRUCT_CODE_OK) return errcode;
+        pc->argv[j] = createStringObject(*p, len);
+        pc->argc = j+1;
+        *p += len + 2; /* Skip the final CRLF. */
+    }
+    return PB_RECONSTRUCT_CODE_OK;
+}
 
-    char *token;
-    char *save_ptr;
+/* Read the next command of a binary record (see pmem.h). 'pc->aof_len' is
+ * set to the size of the command in the AOF format. */
+static int pbReadBinaryCommand(pbParsedCommand *pc, const char **p,
+                               const char *end)
+{
+    uint64_t argc, cmdref, tag, value;
+    struct redisCommand *cmd = NULL;
+    char buf[LONG_STR_SIZE];
+    size_t len;
+    int j;
 
-    memcpy(buf, log_str, strlen(log_str));
-    token = strtok_r(buf, PB_LOG_BUFFER_DELIMITER, &save_ptr);
+    pc->argc = 0;
+    pc->argv = NULL;
+    if (!pbVarintDecode(p, end, &argc) || !pbVarintDecode(p, end, &cmdref))
+        return PB_RECONSTRUCT_CODE_READERR;
+    if (argc < 1 || argc > INT_MAX) return PB_RECONSTRUCT_CODE_FMTERR;
+    if (cmdref && (cmd = pbCommandByIndex(cmdref-1)) == NULL)
+        return PB_RECONSTRUCT_CODE_FMTERR;
+
+    pc->argv = zmalloc(sizeof(robj*)*argc);
+    pc->aof_len = 1+digits10(argc)+2;
+    for (j = 0; j < (int)argc; j++) {
+        robj *o;
+
+        if (j == 0 && cmd) {
+            o = createStringObject(cmd->name, strlen(cmd->name));
+        } else {
+            if (!pbVarintDecode(p, end, &tag)) return PB_RECONSTRUCT_CODE_READERR;
+            if (tag == PB_BINARY_ARG_INT) {
+                if (!pbVarintDecode(p, end, &value))
+                    return PB_RECONSTRUCT_CODE_READERR;
+                value = (value >> 1) ^ -(value & 1);
+                o = createStringObject(buf,
+                    ll2string(buf, sizeof(buf), (long long)value));
+            } else {
+                if ((uint64_t)(end - *p) < tag-1) return PB_RECONSTRUCT_CODE_READERR;
+                o = createStringObject(*p, tag-1);
+                *p += tag-1;
+            }
+        }
+        pc->argv[j] = o;
+        pc->argc = j+1;
+        len = sdslen(o->ptr);
+        pc->aof_len += 1+digits10(len)+2+len+2;
+    }
+    return PB_RECONSTRUCT_CODE_OK;
+}
 
-    while (token != NULL) {
-        if (token[0] != '*') return PB_RECONSTRUCT_CODE_FMTERR;
-        if (token[1] == '\0') return PB_RECONSTRUCT_CODE_READERR;
-        argc = atoi(token + 1);
-        if (argc < 1) return PB_RECONSTRUCT_CODE_FMTERR;
+/* ----------------------- PB reconstruction pipeline -----------------------
+ * Parsing the records into argument vectors and looking up the commands
+ * costs about as much as executing them. So the records are grouped in
+ * jobs that pb-load-threads worker threads parse, while the main thread
+ * executes the jobs parsed already, in order. With no worker threads the
+ * main thread parses every job right before executing it.
+ * ------------------------------------------------------------------------- */
 
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
+#define PB_LOAD_JOB_RECORDS 256         /* Max records of a job. */
+#define PB_LOAD_JOB_BYTES (64*1024)     /* Max payload bytes of a job. */
+#define PB_LOAD_QUEUE_LEN 64            /* Jobs queued or being parsed. */
+
+typedef struct pbParseJob {
+    pb_log_record *rec[PB_LOAD_JOB_RECORDS];
+    size_t loaded[PB_LOAD_JOB_RECORDS]; /* Bytes of the record in the AOF. */
+    int reccmds[PB_LOAD_JOB_RECORDS];   /* Commands parsed in the record. */
+    int numrecs;
+    size_t bytes;                       /* Payload bytes of the records. */
+    pbParsedCommand *cmds;
+    int numcmds, alloccmds;
+    char *raw;                          /* Payloads of the LZF records. */
+    size_t rawalloc;
+    int errcode;                        /* PB_RECONSTRUCT_CODE_* */
+    int errrec;                         /* Record where parsing failed. */
+    long long parse_us;                 /* CPU time spent parsing the job. */
+    int done;                           /* Parsed, protected by the lock. */
+} pbParseJob;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;            /* A job was queued, or stop. */
+    pthread_cond_t done_cond;           /* A job was parsed. */
+    pbParseJob jobs[PB_LOAD_QUEUE_LEN];
+    long long queued;                   /* Jobs queued so far. */
+    long long claimed;                  /* Jobs taken by the workers. */
+    long long executed;                 /* Jobs executed by the main thread. */
+    long long parse_us;                 /* CPU time spent parsing the jobs. */
+    int stop;
+    pthread_t threads[PB_LOAD_MAX_THREADS];
+    int numthreads;
+} pbLoader;
+
+/* CPU time used by the calling thread, in microseconds. */
+static long long pbThreadCPUTime(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1) return 0;
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
 
-        for (j = 0; j < argc; j++) {
-            if ((token = strtok_r(NULL, PB_LOG_BUFFER_DELIMITER, &save_ptr)) == NULL) {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                return PB_RECONSTRUCT_CODE_READERR;
+/* Parse the records of a job. Called by the worker threads: only the
+ * records and the command table, which don't change during the loading,
+ * are accessed. */
+static void pbParseJobRecords(pbParseJob *job) {
+    long long start = pbThreadCPUTime();
+    size_t rawlen = 0;
+    char *raw;
+    int r;
+
+    job->numcmds = 0;
+    job->errcode = PB_RECONSTRUCT_CODE_OK;
+
+    /* The commands point into the payloads until they are executed, so the
+     * LZF records are decompressed in a buffer kept with the job. */
+    for (r = 0; r < job->numrecs; r++)
+        if (job->rec[r]->flags & PB_RECORD_LZF) rawlen += job->rec[r]->raw_len;
+    if (rawlen > job->rawalloc) {
+        zfree(job->raw);
+        job->raw = zmalloc(rawlen);
+        job->rawalloc = rawlen;
+    }
+    raw = job->raw;
+
+    for (r = 0; r < job->numrecs; r++) {
+        pb_log_record *rec = job->rec[r];
+        const char *p = rec->payload, *end = rec->payload + rec->len;
+        int binary = rec->flags & PB_RECORD_BINARY;
+        size_t aof_pos = 0;
+
+        job->reccmds[r] = 0;
+        if (rec->flags & (PB_RECORD_BINARY|PB_RECORD_LZF) &&
+            crc64(0,(unsigned char*)rec->payload,rec->len) != rec->checksum)
+        {
+            job->errcode = PB_RECONSTRUCT_CODE_CHECKSUMERR;
+            break;
+        }
+        if (rec->flags & PB_RECORD_LZF) {
+            if (pmemPBDecompress(rec, raw) == C_ERR) {
+                job->errcode = PB_RECONSTRUCT_CODE_FMTERR;
+                break;
             }
-            if (token[0] != '$') return PB_RECONSTRUCT_CODE_FMTERR;
-            len = strtol(token + 1, NULL, 10);
-            if (len && (token = strtok_r(NULL, PB_LOG_BUFFER_DELIMITER, &save_ptr)) == NULL) {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                return PB_RECONSTRUCT_CODE_FMTERR;
+            p = raw;
+            end = raw + rec->raw_len;
+            raw += rec->raw_len;
+        }
+        while (p < end) {
+            pbParsedCommand *pc;
+            const char *cmdstart = p;
+
+            if (job->numcmds == job->alloccmds) {
+                job->alloccmds = job->alloccmds ? job->alloccmds*2 : 256;
+                job->cmds = zrealloc(job->cmds,
+                                     sizeof(pbParsedCommand)*job->alloccmds);
             }
-            argsds = sdsnewlen(token, len);
-            argv[j] = createObject(OBJ_STRING, argsds);
+            pc = job->cmds + job->numcmds;
+            if (binary) {
+                job->errcode = pbReadBinaryCommand(pc, &p, end);
+            } else {
+                job->errcode = pbReadCommand(pc, &p, end);
+                pc->aof_len = p - cmdstart;
+            }
+            if (job->errcode != PB_RECONSTRUCT_CODE_OK) {
+                int j;
+
+                for (j = 0; j < pc->argc; j++) decrRefCount(pc->argv[j]);
+                zfree(pc->argv);
+                break;
+            }
+            pc->cmd = lookupCommand(pc->argv[0]->ptr);
+            pc->start = cmdstart;
+            pc->replay = aof_pos >= job->loaded[r];
+            aof_pos += pc->aof_len;
+            job->numcmds++;
+            job->reccmds[r]++;
         }
+        if (job->errcode != PB_RECONSTRUCT_CODE_OK) break;
+    }
+    job->errrec = r;
+    job->parse_us = pbThreadCPUTime()-start;
+}
 
-        /* Command lookup */
-        cmd = lookupCommand(argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)argv[0]->ptr);
-            exit(1);
+static void *pbLoaderThread(void *arg) {
+    sigset_t sigset;
+    UNUSED(arg);
+
+    /* Like the bio threads, leave SIGALRM to the main thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&pbLoader.lock);
+    while (1) {
+        pbParseJob *job;
+
+        while (pbLoader.claimed == pbLoader.queued && !pbLoader.stop)
+            pthread_cond_wait(&pbLoader.job_cond, &pbLoader.lock);
+        if (pbLoader.claimed == pbLoader.queued) break;
+        job = &pbLoader.jobs[pbLoader.claimed++ % PB_LOAD_QUEUE_LEN];
+        pthread_mutex_unlock(&pbLoader.lock);
+
+        pbParseJobRecords(job);
+
+        pthread_mutex_lock(&pbLoader.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pbLoader.done_cond);
+    }
+    pthread_mutex_unlock(&pbLoader.lock);
+    return NULL;
+}
+
+static void pbLoaderStart(int numthreads) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    size_t stacksize;
+    int j;
+
+    /* Leave a CPU to the main thread. */
+    if (ncpus > 0 && numthreads > ncpus-1) numthreads = ncpus-1;
+
+    memset(&pbLoader, 0, sizeof(pbLoader));
+    pthread_mutex_init(&pbLoader.lock, NULL);
+    pthread_cond_init(&pbLoader.job_cond, NULL);
+    pthread_cond_init(&pbLoader.done_cond, NULL);
+
+    /* A lookup in a dict being rehashed moves entries around. */
+    while (dictIsRehashing(server.commands)) dictRehash(server.commands, 100);
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1;
+    while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&pbLoader.threads[j],&attr,pbLoaderThread,NULL) != 0) {
+            serverLog(LL_WARNING, "Can't create a PB load thread, %d threads "
+                "will parse the persistent buffer.", j);
+            break;
         }
+    }
+    pbLoader.numthreads = j;
+    pthread_attr_destroy(&attr);
+}
 
-        /* Run the command in the context of a fake client */
-        cmd->proc(fakeClient);
+/* Stop the worker threads and release the jobs. The commands parsed and
+ * not executed, after an error, are freed as well. */
+static void pbLoaderStop(void) {
+    long long n;
+    int j;
 
-        /* The fake client should not have a reply */
-        serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
-        /* The fake client should never get blocked */
-        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+    pthread_mutex_lock(&pbLoader.lock);
+    pbLoader.stop = 1;
+    pthread_cond_broadcast(&pbLoader.job_cond);
+    pthread_mutex_unlock(&pbLoader.lock);
+    for (j = 0; j < pbLoader.numthreads; j++)
+        pthread_join(pbLoader.threads[j], NULL);
+
+    for (n = pbLoader.executed; n < pbLoader.claimed; n++) {
+        pbParseJob *job = &pbLoader.jobs[n % PB_LOAD_QUEUE_LEN];
+        int c, a;
+
+        for (c = 0; c < job->numcmds; c++) {
+            for (a = 0; a < job->cmds[c].argc; a++)
+                decrRefCount(job->cmds[c].argv[a]);
+            zfree(job->cmds[c].argv);
+        }
+    }
+    for (j = 0; j < PB_LOAD_QUEUE_LEN; j++) {
+        zfree(pbLoader.jobs[j].cmds);
+        zfree(pbLoader.jobs[j].raw);
+    }
+    pthread_mutex_destroy(&pbLoader.lock);
+    pthread_cond_destroy(&pbLoader.job_cond);
+    pthread_cond_destroy(&pbLoader.done_cond);
+}
 
-        /* Write unfinished append only file log */
-        feedAppendOnlyFile(cmd, fakeClient->db->id, argv, argc);
+/* Execute the commands of the oldest job, parsing it first if there are no
+ * worker threads. The first 'loaded' bytes of a record, counted in the AOF
+ * format, are already in the AOF: only their SELECTs are executed, to find
+ * out the DB of the commands that follow. The other commands are appended
+ * to the AOF buffer and executed. On a parse error the code is returned and
+ * '*errrec' is set to the damaged record. */
+static int pbExecuteJob(client *fakeClient, pb_log_record **errrec) {
+    pbParseJob *job = &pbLoader.jobs[pbLoader.executed % PB_LOAD_QUEUE_LEN];
+    pbParsedCommand *pc;
+    int r, j;
+
+    if (pbLoader.numthreads == 0) {
+        pbParseJobRecords(job);
+        pbLoader.claimed++;
+    } else {
+        pthread_mutex_lock(&pbLoader.lock);
+        while (!job->done) pthread_cond_wait(&pbLoader.done_cond, &pbLoader.lock);
+        pthread_mutex_unlock(&pbLoader.lock);
+    }
+    pbLoader.parse_us += job->parse_us;
+
+    pc = job->cmds;
+    for (r = 0; r < job->errrec; r++) {
+        pb_log_record *rec = job->rec[r];
+
+        selectDb(fakeClient, rec->dictid);
+        for (j = 0; j < job->reccmds[r]; j++, pc++) {
+            fakeClient->argc = pc->argc;
+            fakeClient->argv = pc->argv;
+            pc->argc = 0;
+            pc->argv = NULL;
+
+            if (!pc->cmd) {
+                serverLog(LL_WARNING,"Unknown command '%s' reading the persistent buffer",
+                    (char*)fakeClient->argv[0]->ptr);
+                exit(1);
+            }
 
-        /* Clean up. Command code may have changed argv/argc so we use the
-            * argv/argc of the client instead of the local variables. */
-        freeFakeClientArgv(fakeClient);
+            if (pc->replay) {
+                /* SELECT is emitted by feedAppendOnlyFileRaw() when needed. */
+                if (pc->cmd->proc != selectCommand && server.aof_state != AOF_OFF) {
+                    if (rec->flags & PB_RECORD_BINARY) {
+                        sds buf = catAppendOnlyGenericCommand(sdsempty(),
+                            fakeClient->argc, fakeClient->argv);
+
+                        feedAppendOnlyFileRaw(fakeClient->db->id, buf, sdslen(buf));
+                        sdsfree(buf);
+                    } else {
+                        feedAppendOnlyFileRaw(fakeClient->db->id, pc->start,
+                                              pc->aof_len);
+                    }
+                }
+                /* Run the command in the context of a fake client */
+                pc->cmd->proc(fakeClient);
+            } else if (pc->cmd->proc == selectCommand) {
+                pc->cmd->proc(fakeClient);
+            }
+
+            /* The fake client should not have a reply */
+            serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
+            /* The fake client should never get blocked */
+            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
 
-        /* There is a case that multiple logs in same persistent buffer node. */
-        token = strtok_r(NULL, PB_LOG_BUFFER_DELIMITER, &save_ptr);
+            /* Clean up. Command code may have changed argv/argc so we use the
+             * argv/argc of the client instead of the local variables. */
+            freeFakeClientArgv(fakeClient);
+        }
+        PB_FAULT(PB_FAULT_REPLAY);
+    }
+    if (job->errcode != PB_RECONSTRUCT_CODE_OK) {
+        *errrec = job->rec[job->errrec];
+        return job->errcode;
     }
+    job->numcmds = 0;
+    pbLoader.executed++;
     return PB_RECONSTRUCT_CODE_OK;
 }
 
-/* Reply the append log persistent buffer. */
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyPersistentBuffer() {
-    struct client *fakeClient;
-    void *pmem_base_addr = (void *) server.pm_pool->addr;
-    TOID(struct persistent_aof_log) head;
-    head.oid = getCurrentHead();
+/* Hand a job over to the worker threads. */
+static void pbQueueJob(void) {
+    pbParseJob *job = &pbLoader.jobs[pbLoader.queued % PB_LOAD_QUEUE_LEN];
+
+    if (pbLoader.numthreads == 0) {
+        pbLoader.queued++;
+        return;
+    }
+    pthread_mutex_lock(&pbLoader.lock);
+    job->done = 0;
+    pbLoader.queued++;
+    pthread_cond_signal(&pbLoader.job_cond);
+    pthread_mutex_unlock(&pbLoader.lock);
+}
+
+/* Append a replayed command to the AOF buffer as it is: it is already in
+ * the AOF format. */
+void feedAppendOnlyFileRaw(int dictid, const char *buf, size_t len) {
+    sds sel = NULL;
+
+    if (dictid != server.aof_selected_db) {
+        char seldb[64];
 
-    if (TOID_IS_NULL(head)) {
+        snprintf(seldb,sizeof(seldb),"%d",dictid);
+        sel = sdscatprintf(sdsempty(),"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+            (unsigned long)strlen(seldb),seldb);
+        server.aof_selected_db = dictid;
+    }
+    if (server.aof_state == AOF_ON) {
+        if (sel) server.aof_buf = sdscatsds(server.aof_buf,sel);
+        server.aof_buf = sdscatlen(server.aof_buf,buf,len);
+    }
+    if (server.aof_child_pid != -1) {
+        if (sel) aofRewriteBufferAppend((unsigned char*)sel,sdslen(sel));
+        aofRewriteBufferAppend((unsigned char*)buf,len);
+    }
+    sdsfree(sel);
+}
+
+/* Replay the append log persistent buffer, oldest record first. The
+ * records numbered before 'from' are already in the dataset (loaded from
+ * the AOF or a checkpoint) and are skipped. So are the commands already in
+ * the AOF that was just loaded: either the whole record is known to be
+ * there, or its AOF offset tells how much of it was written before the
+ * crash. The replayed commands are appended to the AOF buffer. On success
+ * C_OK is returned. */
+int loadAppendOnlyPersistentBuffer(uint64_t from) {
+    struct client *fakeClient;
+    pbIterator it;
+    pb_log_record *rec, *errrec = NULL;
+    pbParseJob *job = NULL;
+    uint64_t last_seq = 0;
+    uint64_t durable = server.pb_root->pb_durable;
+    int aof_loaded = server.aof_state == AOF_ON;
+    int errcode;
+    long long records = 0, skipped = 0, bytes = 0, start = ustime(), elapsed;
+    long long cpu_start = pbThreadCPUTime();
+
+    if (pmemPBRecordCount() == 0) {
         serverLog(LL_PB, "[PB] Nothing to reconstruct.");
         return C_OK;
     }
 
     serverLog(LL_PB, "[PB] Starts to reconstruct persistent buffer.");
 
+    /* The records the dataset depends on must all be there. */
+    if (from && from < durable) durable = from;
+
     fakeClient = createFakeClient();
-    while(!TOID_IS_NULL(head)) {
-        struct persistent_aof_log *log_obj = (persistent_aof_log *)(
-            head.oid.off + (uint64_t) pmem_base_addr
-        );
-        void *log_str = (void *)(log_obj->cmd_oid.off + (uint64_t) pmem_base_addr);
-
-        if (log_str == NULL) {
-            goto pbreaderr;
+    pbLoaderStart(server.pb_load_threads);
+    pmemPBIterInit(&it, PB_BUFFER_ALL);
+    while ((rec = pmemPBIterNext(&it)) != NULL) {
+        size_t loaded = 0;
+
+        /* Records are numbered in commit order, across all the pools: a
+         * number going backward, or missing after the durable watermark
+         * (before it the pools are reclaimed independently), means a
+         * damaged log and replaying it would corrupt the dataset. */
+        if (rec->seq <= last_seq ||
+            (rec->seq >= durable &&
+             rec->seq != (last_seq >= durable ? last_seq+1 : durable)))
+            goto pbordererr;
+        last_seq = rec->seq;
+
+        if (rec->seq < from ||
+            (aof_loaded && rec->aof_off &&
+             rec->aof_off <= (uint64_t)server.aof_current_size))
+        {
+            skipped++;
+            continue;
         }
 
-        parsePersistentBufferLine(fakeClient, log_str);
-        // TODO(totorody): Handle a error code from parsing works.
-        /*
-        if (errcode == PB_RECONSTRUCT_CODE_FMTERR) {
-            goto pbfmterr;
-        } else if (errcode == PB_RECONSTRUCT_CODE_READERR) {
-            goto pbreaderr;
+        if (rec->flags & PB_RECORD_BINARY &&
+            server.pb_root->pb_cmdtab_sig != server.pb_cmdtab_sig)
+            goto pbcmdtaberr;
+
+        /* The AOF may end in the middle of the record, on a command
+         * boundary since truncated commands are discarded by the AOF
+         * loader. */
+        if (aof_loaded && rec->aof_off &&
+            rec->aof_off - rec->aof_len < (uint64_t)server.aof_current_size)
+            loaded = server.aof_current_size - (rec->aof_off - rec->aof_len);
+
+        /* Add the record to the job being filled, making room for a new
+         * job by executing the oldest one if the queue is full. */
+        if (job == NULL) {
+            if (pbLoader.queued - pbLoader.executed == PB_LOAD_QUEUE_LEN &&
+                (errcode = pbExecuteJob(fakeClient, &errrec)) !=
+                PB_RECONSTRUCT_CODE_OK)
+                goto pbparseerr;
+            job = &pbLoader.jobs[pbLoader.queued % PB_LOAD_QUEUE_LEN];
+            job->numrecs = 0;
+            job->bytes = 0;
         }
-        */
-
-        head = D_RO(head)->next;
+        job->rec[job->numrecs] = rec;
+        job->loaded[job->numrecs++] = loaded;
+        job->bytes += rec->flags & PB_RECORD_LZF ? rec->raw_len : rec->len;
+        if (job->numrecs == PB_LOAD_JOB_RECORDS ||
+            job->bytes >= PB_LOAD_JOB_BYTES)
+        {
+            pbQueueJob();
+            job = NULL;
+        }
+        records++;
+        bytes += rec->len;
+    }
+    if (job) pbQueueJob();
+    while (pbLoader.executed < pbLoader.queued) {
+        if ((errcode = pbExecuteJob(fakeClient, &errrec)) !=
+            PB_RECONSTRUCT_CODE_OK)
+            goto pbparseerr;
     }
 
     /* DB loaded, cleanup and return C_OK to the caller. */
+    pbLoaderStop();
     freeFakeClient(fakeClient);
-    serverLog(LL_PB, "[PB] Ends reconstruction persistent buffer successfully.");
+    elapsed = ustime()-start;
+    if (elapsed == 0) elapsed = 1;
+    serverLog(LL_NOTICE, "Persistent buffer replayed: "
+        "%lld records, %lld bytes in %.3f seconds (%.0f records/s, %.2f MB/s), "
+        "%lld records already loaded.",
+        records, bytes, (double)elapsed/1000000,
+        (double)records*1000000/elapsed,
+        (double)bytes/elapsed, /* bytes/usec == MB/s */
+        skipped);
+    /* The CPU time of the main thread and of the workers over the wall
+     * time: an estimate of the parallelism achieved, not a speedup measured
+     * against a replay on the main thread alone, which would also avoid the
+     * cost of handing the jobs over. */
+    if (pbLoader.numthreads)
+        serverLog(LL_NOTICE, "Persistent buffer parsed by %d threads: "
+            "%.2f parse CPU / wall time (estimated parallelism).",
+            pbLoader.numthreads,
+            (double)(pbThreadCPUTime()-cpu_start+pbLoader.parse_us)/elapsed);
     return C_OK;
 
-pbreaderr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
+pbparseerr: /* A record can't be parsed. */
+    rec = errrec;
+    if (errcode == PB_RECONSTRUCT_CODE_CHECKSUMERR) goto pbchecksumerr;
+    if (errcode == PB_RECONSTRUCT_CODE_READERR) goto pbreaderr;
+    goto pbfmterr;
+
+pbordererr: /* Sequence numbers going backward or missing. */
+    pbLoaderStop();
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-    serverLog(LL_PB, "Unrecoverable error reading the append only file.");
-    return C_OK;
+    serverLog(LL_WARNING, "Persistent buffer record %llu found after record %llu.",
+        (unsigned long long) rec->seq, (unsigned long long) last_seq);
+    return C_ERR;
+
+pbcmdtaberr: /* Binary record written with another command table. */
+    pbLoaderStop();
+    if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
+    serverLog(LL_WARNING, "The persistent buffer record %llu was written by a "
+        "Redis version with a different command table.",
+        (unsigned long long) rec->seq);
+    return C_ERR;
+
+pbchecksumerr: /* Binary or LZF record damaged. */
+    pbLoaderStop();
+    if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
+    serverLog(LL_WARNING, "Checksum mismatch in the persistent buffer record %llu.",
+        (unsigned long long) rec->seq);
+    return C_ERR;
+
+pbreaderr: /* Read error: a record ends in the middle of a command. */
+    pbLoaderStop();
+    if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
+    serverLog(LL_WARNING, "Unrecoverable error reading the persistent buffer record %llu.",
+        (unsigned long long) rec->seq);
+    return C_ERR;
 
 pbfmterr: /* Format error. */
+    pbLoaderStop();
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-    serverLog(LL_PB, "Bad file format reading the append only file: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>");
-    return C_OK;
+    serverLog(LL_WARNING, "Bad format reading the persistent buffer record %llu.",
+        (unsigned long long) rec->seq);
+    return C_ERR;
 }
 #endif
 
@@ -1488,6 +2284,13 @@ void aofUpdateCurrentSize(void) {
     struct redis_stat sb;
     mstime_t latency;
 
+#ifdef USE_PMDK
+    /* A mapped file is preallocated. */
+    if (aofDaxActive()) {
+        server.aof_current_size = aofDaxSize();
+        return;
+    }
+#endif
     latencyStartMonitor(latency);
     if (redis_fstat(server.aof_fd,&sb) == -1) {
         serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
@@ -1596,8 +2399,27 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             close(newfd);
         } else {
             /* AOF enabled, replace the old fd with the new one. */
+#ifdef USE_PMDK
+            aofDaxClose();
+#endif
             oldfd = server.aof_fd;
             server.aof_fd = newfd;
+#ifdef USE_PB
+            /* The records appended so far are all in the new file, that
+             * the PB can rely on only once it is durable: the child fsynced
+             * it already, so this is about the diff written above. */
+            if (server.persistent) {
+                __atomic_add_fetch(&server.aof_fd_gen,1,__ATOMIC_RELEASE);
+                latencyStartMonitor(latency);
+                if (aof_fsync(newfd) == -1)
+                    serverLog(LL_WARNING,"Error fsyncing the rewritten AOF, "
+                        "the PB records it covers may be lost on power "
+                        "failure: %s", strerror(errno));
+                pmemPBRewriteDone();
+                latencyEndMonitor(latency);
+                latencyAddSampleIfNeeded("aof-rewrite-pb-fsync",latency);
+            } else
+#endif
             if (server.aof_fsync == AOF_FSYNC_ALWAYS)
                 aof_fsync(newfd);
             else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
@@ -1605,6 +2427,9 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
             aofUpdateCurrentSize();
             server.aof_rewrite_base_size = server.aof_current_size;
+#ifdef USE_PMDK
+            aofDaxOpen();
+#endif
 
             /* Clear regular AOF buffer since its contents was just written to
              * the new AOF from the background rewrite buffer. */
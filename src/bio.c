@@ -88,10 +88,6 @@ struct bio_job {
 
 void *bioProcessBackgroundJobs(void *arg);
 
-/* Make sure we have enough stack to perform all the things we do in the
- * main thread. */
-#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
-
 /* Initialize the background system, spawning the thread. */
 void bioInit(void) {
     pthread_attr_t attr;
@@ -186,15 +182,23 @@ void *bioProcessBackgroundJobs(void *arg) {
         if (type == BIO_CLOSE_FILE) {
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
-            aof_fsync((long)job->arg1);
 #ifdef USE_PB
+            long long start = ustime();
+            int retval = aof_fsync((long)job->arg1);
+
             serverLog(LL_PB, "PB: aof fsync processed");
-            TX_BEGIN(server.pm_pool) {
-                pmemSwitchDoubleBuffer();
-                pmemClearPBList(getAnotherHead());
-            } TX_ONABORT {
-                serverLog(LL_PB, "PB ERROR: clear buffer failed");
-            } TX_END
+            /* A job queued for an AOF file replaced since then, by a
+             * rewrite, says nothing about the current file. */
+            if (server.persistent && job->arg2 != NULL && retval == 0 &&
+                (uintptr_t)job->arg3 ==
+                __atomic_load_n(&server.aof_fd_gen, __ATOMIC_ACQUIRE))
+            {
+                pmemPBSetDurable((uint64_t)(uintptr_t)job->arg2);
+                __atomic_store_n(&server.stat_pb_last_clear_usec,
+                                 ustime()-start, __ATOMIC_RELAXED);
+            }
+#else
+            aof_fsync((long)job->arg1);
 #endif
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
@@ -122,6 +122,15 @@ void processUnblockedClients(void) {
          * client is not blocked before to proceed, but things may change and
          * the code is conceptually more correct this way. */
         if (!(c->flags & CLIENT_BLOCKED)) {
+#ifdef USE_PB
+            /* A write throttled by pb-max-memory is still to be executed. */
+            if (c->argc) {
+                server.current_client = c;
+                if (processCommand(c) == C_OK) resetClient(c);
+                server.current_client = NULL;
+                if (c->flags & CLIENT_BLOCKED) continue;
+            }
+#endif
             if (c->querybuf && sdslen(c->querybuf) > 0) {
                 processInputBuffer(c);
             }
@@ -136,6 +145,10 @@ void unblockClient(client *c) {
         unblockClientWaitingData(c);
     } else if (c->btype == BLOCKED_WAIT) {
         unblockClientWaitingReplicas(c);
+#ifdef USE_PB
+    } else if (c->btype == BLOCKED_PB) {
+        unblockClientThrottledByPB(c);
+#endif
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
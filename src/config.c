@@ -30,6 +30,9 @@
 
 #include "server.h"
 #include "cluster.h"
+#ifdef USE_PB
+#include "pmem_latency.h"
+#endif
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -92,6 +95,28 @@ configEnum aof_fsync_enum[] = {
     {NULL, 0}
 };
 
+#ifdef USE_PB
+configEnum pb_record_encoding_enum[] = {
+    {"resp", PB_ENCODING_RESP},
+    {"binary", PB_ENCODING_BINARY},
+    {NULL, 0}
+};
+
+configEnum pb_stripe_policy_enum[] = {
+    {"round-robin", PB_STRIPE_ROUND_ROBIN},
+    {"numa-local", PB_STRIPE_NUMA_LOCAL},
+    {"shard", PB_STRIPE_SHARD},
+    {NULL, 0}
+};
+
+configEnum pb_max_memory_policy_enum[] = {
+    {"fsync", PB_MAXMEMORY_FSYNC},
+    {"throttle", PB_MAXMEMORY_THROTTLE},
+    {"reject", PB_MAXMEMORY_REJECT},
+    {NULL, 0}
+};
+#endif
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -392,7 +417,32 @@ void loadServerConfigFromString(char *config) {
             server.hz = atoi(argv[1]);
             if (server.hz < CONFIG_MIN_HZ) server.hz = CONFIG_MIN_HZ;
             if (server.hz > CONFIG_MAX_HZ) server.hz = CONFIG_MAX_HZ;
-#ifdef USE_PMDK
+#ifdef USE_PB
+        } else if (!strcasecmp(argv[0],"pmfile") && argc >= 3 && argc % 2 &&
+                   argc <= 1+PB_MAX_STRIPES*2) {
+            int j;
+
+            /* The persistent buffer is striped across the pools. */
+            server.pb_stripes = 0;
+            for (j = 1; j < argc; j += 2) {
+                pbStripe *s = &server.pb_stripe[server.pb_stripes++];
+                long long size = memtoll(argv[j+1],NULL);
+
+                if (size == 0) {
+                    if (access(argv[j], F_OK) != 0) {
+                        err = "If pmfile size == 0 pmfile must exist prior to "
+                            "server start"; goto loaderr;
+                    }
+                } else if (size < CONFIG_MIN_PM_FILE_SIZE) {
+                    err = "Invalid pmfile size"; goto loaderr;
+                }
+                zfree(s->path);
+                s->path = zstrdup(argv[j]);
+                s->size = size;
+            }
+            server.pm_file_path = server.pb_stripe[0].path;
+            server.pm_file_size = server.pb_stripe[0].size;
+#elif defined(USE_PMDK)
         } else if (!strcasecmp(argv[0],"pmfile") && (argc == 3)) {
             server.pm_file_path = zstrdup(argv[1]);
             long long size = memtoll(argv[2],NULL);
@@ -406,6 +456,12 @@ void loadServerConfigFromString(char *config) {
             }
             server.pm_file_size = size;
 #endif
+#ifdef USE_PMDK
+        } else if (!strcasecmp(argv[0],"pm-prefault") && argc == 2) {
+            if ((server.pm_prefault = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#endif
 #ifdef USE_PB
         } else if (!strcasecmp(argv[0], "aof-flush-timer") && (argc == 2)) {
             long long aof_flush_timer = atoi(argv[1]);
@@ -419,11 +475,125 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0], "pm-read-latency") && (argc == 2)) {
             long long pm_read_latency = atoi(argv[1]);
             server.pm_read_latency = pm_read_latency;
+            server.pm_profile = PM_PROFILE_CUSTOM;
 #endif
 #ifdef USE_PB
         } else if (!strcasecmp(argv[0], "pm-write-latency") && (argc == 2)) {
             long long pm_write_latency = atoi(argv[1]);
             server.pm_write_latency = pm_write_latency;
+            server.pm_profile = PM_PROFILE_CUSTOM;
+#endif
+#ifdef USE_PB
+        } else if (!strcasecmp(argv[0],"pm-profile") && argc == 2) {
+            if (pmemLatencySetProfile(argv[1]) == C_ERR) {
+                err = "Invalid pm profile, must be one of dram, pcm, "
+                      "3dxpoint-mm or 3dxpoint-sm"; goto loaderr;
+            }
+        } else if ((!strcasecmp(argv[0],"pm-read-bandwidth") ||
+                    !strcasecmp(argv[0],"pm-write-bandwidth")) && argc == 2) {
+            long long bandwidth = strtoll(argv[1],NULL,10);
+            if (bandwidth < 0) {
+                err = "Invalid pm bandwidth"; goto loaderr;
+            }
+            if (!strcasecmp(argv[0],"pm-read-bandwidth"))
+                server.pm_read_bandwidth = bandwidth;
+            else
+                server.pm_write_bandwidth = bandwidth;
+            server.pm_profile = PM_PROFILE_CUSTOM;
+        } else if (!strcasecmp(argv[0],"pm-granularity") && argc == 2) {
+            long long gran = memtoll(argv[1],NULL);
+            if (gran < CONFIG_MIN_PM_GRANULARITY ||
+                gran > CONFIG_MAX_PM_GRANULARITY || (gran & (gran-1))) {
+                err = "Invalid pm granularity, must be a power of two "
+                      "between 64 and 4096"; goto loaderr;
+            }
+            server.pm_granularity = gran;
+            server.pm_profile = PM_PROFILE_CUSTOM;
+#endif
+#ifdef USE_PB
+        } else if (!strcasecmp(argv[0], "pb-log-size") && (argc == 2)) {
+            long long size = memtoll(argv[1],NULL);
+            if (size < CONFIG_MIN_PB_LOG_SIZE) {
+                err = "Invalid pb log size"; goto loaderr;
+            }
+            /* Records are cache line aligned. */
+            server.pb_log_size = size & ~((long long)PB_RECORD_ALIGN-1);
+        } else if (!strcasecmp(argv[0],"pb-group-commit") && argc == 2) {
+            if ((server.pb_group_commit = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-group-commit-size") && argc == 2) {
+            server.pb_group_commit_size = strtoll(argv[1],NULL,10);
+            if (server.pb_group_commit_size < 0) {
+                err = "Invalid pb group commit size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-reclaim-interval") && argc == 2) {
+            server.pb_reclaim_interval = atoi(argv[1]);
+            if (server.pb_reclaim_interval < 0) {
+                err = "Invalid pb reclaim interval"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-load-threads") && argc == 2) {
+            server.pb_load_threads = atoi(argv[1]);
+            if (server.pb_load_threads < 0 ||
+                server.pb_load_threads > PB_LOAD_MAX_THREADS)
+            {
+                err = "Invalid number of pb load threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-aof-drain") && argc == 2) {
+            if ((server.pb_aof_drain = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-record-encoding") && argc == 2) {
+            server.pb_record_encoding =
+                configEnumGetValue(pb_record_encoding_enum,argv[1]);
+            if (server.pb_record_encoding == INT_MIN) {
+                err = "argument must be 'resp' or 'binary'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-backlog-pmem") && argc == 2) {
+            if ((server.repl_backlog_pmem = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pm-tier-idle-time") && argc == 2) {
+            server.pm_tier_idle_time = atoi(argv[1]);
+            if (server.pm_tier_idle_time < 0) {
+                err = "Invalid pm tier idle time"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-compress-threshold") && argc == 2) {
+            long long threshold = memtoll(argv[1],NULL);
+
+            if (threshold < 0 || threshold > UINT32_MAX) {
+                err = "Invalid pb compress threshold"; goto loaderr;
+            }
+            server.pb_compress_threshold = threshold;
+#ifdef PB_FAULT_INJECTION
+        } else if (!strcasecmp(argv[0],"pb-fault-inject") && argc == 3) {
+            if (pmemFaultArm(argv[1],strtoll(argv[2],NULL,10)) == C_ERR) {
+                err = "Unknown persist point or invalid count"; goto loaderr;
+            }
+#endif
+        } else if (!strcasecmp(argv[0],"pb-stripe-policy") && argc == 2) {
+            server.pb_stripe_policy =
+                configEnumGetValue(pb_stripe_policy_enum,argv[1]);
+            if (server.pb_stripe_policy == INT_MIN) {
+                err = "argument must be 'round-robin', 'numa-local' or "
+                      "'shard'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-checkpoint-interval") && argc == 2) {
+            server.pb_checkpoint_interval = atoi(argv[1]);
+            if (server.pb_checkpoint_interval < 0) {
+                err = "Invalid pb checkpoint interval"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pb-max-memory") && argc == 2) {
+            server.pb_max_memory = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"pb-max-memory-policy") && argc == 2) {
+            server.pb_max_memory_policy =
+                configEnumGetValue(pb_max_memory_policy_enum,argv[1]);
+            if (server.pb_max_memory_policy == INT_MIN) {
+                err = "argument must be 'fsync', 'throttle' or 'reject'";
+                goto loaderr;
+            }
 #endif
         } else if (!strcasecmp(argv[0],"appendonly") && argc == 2) {
             int yes;
@@ -473,6 +643,18 @@ void loadServerConfigFromString(char *config) {
             if ((server.aof_load_truncated = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+#ifdef USE_PMDK
+        } else if (!strcasecmp(argv[0],"aof-dax") && argc == 2) {
+            if ((server.aof_dax = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-dax-prealloc") && argc == 2) {
+            server.aof_dax_prealloc = memtoll(argv[1],NULL);
+            if (server.aof_dax_prealloc < 4096) {
+                err = "Invalid aof-dax-prealloc, must be at least 4kb";
+                goto loaderr;
+            }
+#endif
         } else if (!strcasecmp(argv[0],"requirepass") && argc == 2) {
             if (strlen(argv[1]) > CONFIG_AUTHPASS_MAX_LEN) {
                 err = "Password is longer than CONFIG_AUTHPASS_MAX_LEN";
@@ -914,12 +1096,28 @@ void configSetCommand(client *c) {
     } config_set_special_field("slave-announce-ip") {
         zfree(server.slave_announce_ip);
         server.slave_announce_ip = ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
+#ifdef USE_PB
+    } config_set_special_field("pm-profile") {
+        if (pmemLatencySetProfile(o->ptr) == C_ERR) goto badfmt;
+    } config_set_special_field("pm-granularity") {
+        ll = memtoll(o->ptr,&err);
+        if (err || ll < CONFIG_MIN_PM_GRANULARITY ||
+            ll > CONFIG_MAX_PM_GRANULARITY || (ll & (ll-1))) goto badfmt;
+        server.pm_granularity = ll;
+        server.pm_profile = PM_PROFILE_CUSTOM;
+#endif
 
     /* Boolean fields.
      * config_set_bool_field(name,var). */
 #ifdef USE_PB
     } config_set_bool_field(
       "verbosity-pb-only", server.verbosity_pb_only) {
+    } config_set_bool_field(
+      "pb-group-commit", server.pb_group_commit) {
+        /* The next commands are appended right away: persist the staged
+         * ones first, records must follow the AOF order. */
+        if (!server.pb_group_commit && !server.pb_in_unit)
+            pmemCommitPBBatch();
 #endif
     } config_set_bool_field(
       "rdbcompression", server.rdb_compression) {
@@ -1020,6 +1218,30 @@ void configSetCommand(client *c) {
             enableWatchdog(ll);
         else
             disableWatchdog();
+#ifdef USE_PB
+    } config_set_numerical_field(
+      "aof-flush-timer",server.aof_flush_timer,CONFIG_MIN_AOF_FLUSH_TIMER,LLONG_MAX) {
+    } config_set_numerical_field(
+      "pm-read-latency",server.pm_read_latency,0,LLONG_MAX) {
+        server.pm_profile = PM_PROFILE_CUSTOM;
+    } config_set_numerical_field(
+      "pm-write-latency",server.pm_write_latency,0,LLONG_MAX) {
+        server.pm_profile = PM_PROFILE_CUSTOM;
+    } config_set_numerical_field(
+      "pm-read-bandwidth",server.pm_read_bandwidth,0,LLONG_MAX) {
+        server.pm_profile = PM_PROFILE_CUSTOM;
+    } config_set_numerical_field(
+      "pm-write-bandwidth",server.pm_write_bandwidth,0,LLONG_MAX) {
+        server.pm_profile = PM_PROFILE_CUSTOM;
+    } config_set_numerical_field(
+      "pb-group-commit-size",server.pb_group_commit_size,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "pb-reclaim-interval",server.pb_reclaim_interval,0,INT_MAX) {
+    } config_set_numerical_field(
+      "pb-checkpoint-interval",server.pb_checkpoint_interval,0,INT_MAX) {
+    } config_set_numerical_field(
+      "pm-tier-idle-time",server.pm_tier_idle_time,0,INT_MAX) {
+#endif
 
     /* Memory fields.
      * config_set_memory_field(name,var) */
@@ -1032,6 +1254,12 @@ void configSetCommand(client *c) {
         }
     } config_set_memory_field("repl-backlog-size",ll) {
         resizeReplicationBacklog(ll);
+#ifdef USE_PB
+    } config_set_memory_field("pb-max-memory",server.pb_max_memory) {
+    } config_set_memory_field("pb-compress-threshold",ll) {
+        if (ll > UINT32_MAX) goto badfmt;
+        server.pb_compress_threshold = ll;
+#endif
 
     /* Enumeration fields.
      * config_set_enum_field(name,var,enum_var) */
@@ -1041,6 +1269,11 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+#ifdef USE_PB
+    } config_set_enum_field(
+      "pb-max-memory-policy",server.pb_max_memory_policy,
+      pb_max_memory_policy_enum) {
+#endif
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1163,11 +1396,31 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
+#ifdef USE_PB
+    config_get_numerical_field("aof-flush-timer",server.aof_flush_timer);
+    config_get_numerical_field("pm-read-latency",server.pm_read_latency);
+    config_get_numerical_field("pm-write-latency",server.pm_write_latency);
+    config_get_numerical_field("pm-read-bandwidth",server.pm_read_bandwidth);
+    config_get_numerical_field("pm-write-bandwidth",
+            server.pm_write_bandwidth);
+    config_get_numerical_field("pm-granularity",server.pm_granularity);
+    config_get_numerical_field("pb-group-commit-size",
+            server.pb_group_commit_size);
+    config_get_numerical_field("pb-reclaim-interval",
+            server.pb_reclaim_interval);
+    config_get_numerical_field("pb-checkpoint-interval",
+            server.pb_checkpoint_interval);
+    config_get_numerical_field("pb-max-memory",server.pb_max_memory);
+    config_get_numerical_field("pb-compress-threshold",
+            server.pb_compress_threshold);
+    config_get_numerical_field("pm-tier-idle-time",server.pm_tier_idle_time);
+#endif
 
     /* Bool (yes/no) values */
 #ifdef USE_PB
     config_get_bool_field("verbosity-pb-only",
             server.verbosity_pb_only);
+    config_get_bool_field("pb-group-commit",server.pb_group_commit);
 #endif
     config_get_bool_field("cluster-require-full-coverage",
             server.cluster_require_full_coverage);
@@ -1204,9 +1457,20 @@ void configGetCommand(client *c) {
             server.aof_fsync,aof_fsync_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
+#ifdef USE_PB
+    config_get_enum_field("pb-max-memory-policy",
+            server.pb_max_memory_policy,pb_max_memory_policy_enum);
+#endif
 
     /* Everything we can't handle with macros follows. */
 
+#ifdef USE_PB
+    if (stringmatch(pattern,"pm-profile",1)) {
+        addReplyBulkCString(c,"pm-profile");
+        addReplyBulkCString(c,pmemLatencyProfileName());
+        matches++;
+    }
+#endif
     if (stringmatch(pattern,"appendonly",1)) {
         addReplyBulkCString(c,"appendonly");
         addReplyBulkCString(c,server.aof_state == AOF_OFF ? "no" : "yes");
@@ -1668,6 +1932,34 @@ void rewriteConfigClientoutputbufferlimitOption(struct rewriteConfigState *state
     }
 }
 
+#ifdef USE_PB
+/* Rewrite the PMEM emulation options. A named profile is written alone; a
+ * custom one, set with the individual options, is written in full and
+ * without pm-profile, which would override it. */
+void rewriteConfigPmProfileOption(struct rewriteConfigState *state) {
+    static char *options[] = {"pm-read-latency","pm-write-latency",
+        "pm-read-bandwidth","pm-write-bandwidth","pm-granularity",NULL};
+    size_t values[] = {server.pm_read_latency,server.pm_write_latency,
+        server.pm_read_bandwidth,server.pm_write_bandwidth,
+        server.pm_granularity};
+    int j;
+
+    if (server.pm_profile != PM_PROFILE_CUSTOM) {
+        rewriteConfigStringOption(state,"pm-profile",
+            (char*)pmemLatencyProfileName(),CONFIG_DEFAULT_PM_PROFILE);
+        for (j = 0; options[j]; j++)
+            rewriteConfigMarkAsProcessed(state,options[j]);
+        return;
+    }
+    rewriteConfigMarkAsProcessed(state,"pm-profile");
+    for (j = 0; options[j]; j++) {
+        sds line = sdscatprintf(sdsempty(),"%s %zu",options[j],values[j]);
+
+        rewriteConfigRewriteLine(state,options[j],line,1);
+    }
+}
+#endif
+
 /* Rewrite the bind option. */
 void rewriteConfigBindOption(struct rewriteConfigState *state) {
     int force = 1;
@@ -1906,6 +2198,18 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
+#ifdef USE_PB
+    rewriteConfigNumericalOption(state,"aof-flush-timer",server.aof_flush_timer,CONFIG_MIN_AOF_FLUSH_TIMER);
+    rewriteConfigPmProfileOption(state);
+    rewriteConfigYesNoOption(state,"pb-group-commit",server.pb_group_commit,CONFIG_DEFAULT_PB_GROUP_COMMIT);
+    rewriteConfigNumericalOption(state,"pb-group-commit-size",server.pb_group_commit_size,CONFIG_DEFAULT_PB_GROUP_COMMIT_SIZE);
+    rewriteConfigNumericalOption(state,"pb-reclaim-interval",server.pb_reclaim_interval,CONFIG_DEFAULT_PB_RECLAIM_INTERVAL);
+    rewriteConfigNumericalOption(state,"pb-checkpoint-interval",server.pb_checkpoint_interval,CONFIG_DEFAULT_PB_CHECKPOINT_INTERVAL);
+    rewriteConfigBytesOption(state,"pb-max-memory",server.pb_max_memory,CONFIG_DEFAULT_PB_MAX_MEMORY);
+    rewriteConfigEnumOption(state,"pb-max-memory-policy",server.pb_max_memory_policy,pb_max_memory_policy_enum,CONFIG_DEFAULT_PB_MAX_MEMORY_POLICY);
+    rewriteConfigBytesOption(state,"pb-compress-threshold",server.pb_compress_threshold,CONFIG_DEFAULT_PB_COMPRESS_THRESHOLD);
+    rewriteConfigNumericalOption(state,"pm-tier-idle-time",server.pm_tier_idle_time,CONFIG_DEFAULT_PM_TIER_IDLE_TIME);
+#endif
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
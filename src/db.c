@@ -51,6 +51,13 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
     if (de) {
         robj *val = dictGetVal(de);
 
+#ifdef USE_PB
+        /* A value moved to PMEM for being idle goes back to DRAM. */
+        if (server.pm_tier_cold_keys && !(flags & LOOKUP_NOTOUCH) &&
+            val->encoding == OBJ_ENCODING_RAW && pmemTierIsCold(val->ptr))
+            pmemTierPromote(val);
+#endif
+
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
          * a copy on write madness. */
@@ -163,6 +170,10 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
     if (server.cluster_enabled) slotToKeyAdd(key);
+#if defined(USE_PMDK) && !defined(USE_PB)
+    /* Not all the callers signal the key, MOVE for instance. */
+    pmemKeyspaceTouch(db,key);
+#endif
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -174,6 +185,17 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
+#if defined(USE_PMDK) && !defined(USE_PB)
+    /* The old value may be in the pool: free it in the same transaction
+     * that detaches it from the key. */
+    if (pmemIsPM(dictGetKey(de))) {
+        TX_BEGIN(server.pm_pool) {
+            pmemKeyspaceDetachValue(dictGetKey(de));
+            dictReplace(db->dict, key->ptr, val);
+        } TX_END
+        return;
+    }
+#endif
     dictReplace(db->dict, key->ptr, val);
 }
 
@@ -194,6 +216,47 @@ void setKey(redisDb *db, robj *key, robj *val) {
     signalModifiedKey(db,key);
 }
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+/* Like dbAdd(), for a string value whose sds is in the pool: the key is
+ * copied to the pool as well and linked to the value.
+ * Must be called in a transaction. */
+void dbAddPM(redisDb *db, robj *key, robj *val) {
+    void *ref;
+    sds copy = sdsdupPM(key->ptr,&ref);
+    int retval;
+
+    pmemKeyspaceAddPair(copy,val->ptr,db->id,-1);
+    retval = dictAdd(db->dict, copy, val);
+    serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    if (server.cluster_enabled) slotToKeyAdd(key);
+}
+
+/* Like dbOverwrite(), for a string value whose sds is in the pool.
+ * Must be called in a transaction. */
+void dbOverwritePM(redisDb *db, robj *key, robj *val) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    sds copy;
+
+    serverAssertWithInfo(NULL,key,de != NULL);
+    copy = pmemKeyspaceLink(db,de,val->ptr);
+    pmemKeyspaceInstallKey(db,de,copy);
+    dictReplace(db->dict, copy, val);
+}
+
+/* Like setKey(), for a string value whose sds is in the pool. The value is
+ * owned by the DB afterwards: its reference count is not incremented.
+ * Must be called in a transaction. */
+void setKeyPM(redisDb *db, robj *key, robj *val) {
+    if (lookupKeyWrite(db,key) == NULL) {
+        dbAddPM(db,key,val);
+    } else {
+        dbOverwritePM(db,key,val);
+    }
+    removeExpire(db,key);
+    signalModifiedKey(db,key);
+}
+#endif
+
 int dbExists(redisDb *db, robj *key) {
     return dictFind(db->dict,key->ptr) != NULL;
 }
@@ -266,7 +329,12 @@ int dbDelete(redisDb *db, robj *key) {
  */
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     serverAssert(o->type == OBJ_STRING);
-    if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
+    if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW
+#if defined(USE_PMDK) && !defined(USE_PB)
+        /* Strings in the pool can't be resized in place. */
+        || pmemIsPM(o->ptr)
+#endif
+        ) {
         robj *decoded = getDecodedObject(o);
         o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
         decrRefCount(decoded);
@@ -306,6 +374,9 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+#if defined(USE_PMDK) && !defined(USE_PB)
+    pmemKeyspaceTouch(db,key);
+#endif
 }
 
 void signalFlushedDb(int dbid) {
@@ -843,7 +914,11 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    if (dictDelete(db->expires,key->ptr) != DICT_OK) return 0;
+#if defined(USE_PMDK) && !defined(USE_PB)
+    pmemKeyspaceTouch(db,key);
+#endif
+    return 1;
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
@@ -854,6 +929,9 @@ void setExpire(redisDb *db, robj *key, long long when) {
     serverAssertWithInfo(NULL,key,kde != NULL);
     de = dictReplaceRaw(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
+#if defined(USE_PMDK) && !defined(USE_PB)
+    pmemKeyspaceTouch(db,key);
+#endif
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -309,6 +309,8 @@ void debugCommand(client *c) {
         "jemalloc info  -- Show internal jemalloc statistics.");
         blen++; addReplyStatus(c,
         "jemalloc purge -- Force jemalloc to release unused memory.");
+        blen++; addReplyStatus(c,
+        "pb-fault <point>|off [<count>] -- Kill the server the <count>th time a persistent buffer persist point is hit (PB_FAULT_INJECTION=yes builds).");
         setDeferredMultiBulkLength(c,blenp,blen);
     } else if (!strcasecmp(c->argv[1]->ptr,"segfault")) {
         *((char*)-1) = 'x';
@@ -346,9 +348,20 @@ void debugCommand(client *c) {
         serverLog(LL_WARNING,"DB reloaded by DEBUG RELOAD");
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
+        int retval;
+
         if (server.aof_state == AOF_ON) flushAppendOnlyFile(1);
+#ifdef USE_PMDK
+        /* The loader reads the file up to its end: trim the zeros after
+         * the logical end of a mapped AOF. */
+        aofDaxClose();
+#endif
         emptyDb(NULL);
-        if (loadAppendOnlyFile(server.aof_filename) != C_OK) {
+        retval = loadAppendOnlyFile(server.aof_filename);
+#ifdef USE_PMDK
+        if (server.aof_state == AOF_ON) aofDaxOpen();
+#endif
+        if (retval != C_OK) {
             addReply(c,shared.err);
             return;
         }
@@ -545,6 +558,24 @@ void debugCommand(client *c) {
         }
 #else
         addReplyErrorFormat(c, "jemalloc support not available");
+#endif
+    } else if (!strcasecmp(c->argv[1]->ptr,"pb-fault") &&
+               (c->argc == 3 || c->argc == 4))
+    {
+#if defined(USE_PB) && defined(PB_FAULT_INJECTION)
+        long long count = 1;
+
+        if (c->argc == 4 &&
+            getLongLongFromObjectOrReply(c,c->argv[3],&count,NULL) != C_OK)
+            return;
+        if (pmemFaultArm(c->argv[2]->ptr,count) == C_ERR) {
+            addReplyError(c,"Unknown persist point or invalid count");
+            return;
+        }
+        addReply(c,shared.ok);
+#else
+        addReplyError(c,"PB fault injection not available, build with "
+                        "PB_FAULT_INJECTION=yes");
 #endif
     } else {
         addReplyErrorFormat(c, "Unknown DEBUG subcommand or wrong number of arguments for '%s'",
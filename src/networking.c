@@ -905,6 +905,14 @@ int writeToClient(int fd, client *c, int handler_installed) {
     size_t objmem;
     robj *o;
 
+#ifdef USE_PB
+    /* Without AE_BARRIER a client with the write handler installed can be
+     * written in the middle of an event loop iteration: the commands staged
+     * for group commit, that the replies may acknowledge or depend on, are
+     * persisted first. */
+    if (server.persistent && !server.pb_in_unit) pmemCommitPBBatch();
+#endif
+
     while(clientHasPendingReplies(c)) {
         if (c->bufpos > 0) {
             nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
@@ -1439,6 +1447,7 @@ sds catClientInfoString(sds s, client *client) {
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (client->flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
     if (client->flags & CLIENT_READONLY) *p++ = 'r';
+    if (client->flags & CLIENT_PB_DURABLE) *p++ = 'D';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -1508,6 +1517,24 @@ void clientCommand(client *c) {
             addReply(c,shared.syntaxerr);
             return;
         }
+#ifdef USE_PB
+    } else if (!strcasecmp(c->argv[1]->ptr,"durable") && c->argc == 3) {
+        /* CLIENT DURABLE ON|OFF */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            if (!server.persistent || server.aof_state == AOF_OFF) {
+                addReplyError(c,"Durable writes need the persistent buffer "
+                                "and the AOF");
+                return;
+            }
+            c->flags |= CLIENT_PB_DURABLE;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_PB_DURABLE;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
+#endif
     } else if (!strcasecmp(c->argv[1]->ptr,"kill")) {
         /* CLIENT KILL <ip:port>
          * CLIENT KILL <option> [value] ... <option> [value] */
@@ -244,8 +244,6 @@ robj *dupStringObject(robj *o) {
  *
  * The resulting object always has refcount set to 1. */
 robj *dupStringObjectPM(robj *o) {
-    robj *d;
-
     serverAssert(o->type == OBJ_STRING);
 
     switch(o->encoding) {
@@ -253,14 +251,17 @@ robj *dupStringObjectPM(robj *o) {
     case OBJ_ENCODING_EMBSTR:
         return createRawStringObjectPM(o->ptr,sdslen(o->ptr));
         /* return createEmbeddedStringObjectPM(o->ptr,sdslen(o->ptr)); */
-    case OBJ_ENCODING_INT:
-        d = createObjectPM(OBJ_STRING, NULL);
-        d->encoding = OBJ_ENCODING_INT;
-        d->ptr = o->ptr;
-        return d;
+    case OBJ_ENCODING_INT: {
+        /* The integer lives in the robj, which is in DRAM: store its
+         * string form so that the value can be rebuilt from the pool. */
+        char buf[LONG_STR_SIZE];
+        int len = ll2string(buf,sizeof(buf),(long)o->ptr);
+
+        return createRawStringObjectPM(buf,len);
+    }
     default:
         serverPanic("Wrong encoding.");
-        break;
+        return NULL;
     }
 }
 #endif
@@ -320,6 +321,20 @@ robj *createZsetZiplistObject(void) {
 
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
+#if defined(USE_PMDK) && !defined(USE_PB)
+        /* A value of the PMEM keyspace may be released by its last user
+         * after the key is gone. */
+        if (server.persistent) {
+            sdsfreePM(o->ptr);
+            return;
+        }
+#endif
+#ifdef USE_PB
+        if (server.pm_tier_cold_keys && pmemTierIsCold(o->ptr)) {
+            pmemTierRelease(o->ptr);
+            return;
+        }
+#endif
         sdsfree(o->ptr);
     }
 }
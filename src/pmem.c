@@ -29,129 +29,1851 @@
 
 #ifdef USE_PB
 #include "server.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <sched.h>
+#include <ctype.h>
 #include "obj.h"
 #include "libpmemobj.h"
 #include "util.h"
 #include "pmem_latency.h"
+#include "bio.h"
+#include "lzf.h"
+#include "cluster.h"
 
+static inline pb_log_record *pbRecordAt(pbStripe *s, uint64_t pos) {
+    return (pb_log_record *)(s->log + (pos % s->log_size));
+}
+
+/* Return the record at '*pos' in the log of the pool, moving '*pos' past a
+ * WRAP marker, or NULL if there is no record before 'end'. */
+static pb_log_record *pbPeek(pbStripe *s, uint64_t *pos, uint64_t end) {
+    pb_log_record *rec;
+
+    if (*pos >= end) return NULL;
+    rec = pbRecordAt(s, *pos);
+    if (rec->magic == PB_RECORD_WRAP) {
+        *pos += s->log_size - (*pos % s->log_size);
+        if (*pos >= end) return NULL;
+        rec = pbRecordAt(s, *pos);
+    }
+    if (rec->magic != PB_RECORD_MAGIC) {
+        serverLog(LL_WARNING,"PB: corrupted record at log position %llu of "
+            "%s", (unsigned long long) *pos, s->path);
+        return NULL;
+    }
+    return rec;
+}
+
+/* Return the position of the first record of the pool numbered 'seq' or
+ * later, looking from 'pos' on. Only the record headers are read. */
+static uint64_t pbSeek(pbStripe *s, uint64_t pos, uint64_t seq) {
+    uint64_t tail = __atomic_load_n(&s->root->pb_tail, __ATOMIC_ACQUIRE);
+    pb_log_record *rec;
+
+    if (pos < s->root->pb_head) pos = s->root->pb_head;
+    if (pos >= tail || seq >= server.pb_next_seq) return tail;
+    while ((rec = pbPeek(s, &pos, tail)) != NULL && rec->seq < seq)
+        pos += PB_RECORD_SIZE(rec->len);
+    return pos < tail ? pos : tail;
+}
+
+/* NUMA node of the device backing 'path', -1 if unknown. */
+static int pbPathNumaNode(const char *path) {
+#ifdef __linux__
+    static const char *fmt[] = {
+        "/sys/dev/%s/%u:%u/device/numa_node",
+        "/sys/dev/%s/%u:%u/../device/numa_node" /* Partition. */
+    };
+    struct stat sb;
+    const char *kind = "block";
+    dev_t dev;
+    char buf[128];
+    FILE *fp;
+    int node = -1, j;
+
+    if (stat(path, &sb) == -1) return -1;
+    if (S_ISCHR(sb.st_mode)) {
+        kind = "char"; /* Device DAX. */
+        dev = sb.st_rdev;
+    } else {
+        dev = S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev;
+    }
+    for (j = 0; j < 2 && node == -1; j++) {
+        snprintf(buf, sizeof(buf), fmt[j], kind, major(dev), minor(dev));
+        if ((fp = fopen(buf, "r")) == NULL) continue;
+        if (fscanf(fp, "%d", &node) != 1) node = -1;
+        fclose(fp);
+    }
+    return node;
+#else
+    UNUSED(path);
+    return -1;
+#endif
+}
+
+/* NUMA node of the CPU the server runs on, -1 if unknown. */
+static int pbCurrentNumaNode(void) {
+#ifdef __linux__
+    char buf[64];
+    struct dirent *de;
+    DIR *dir;
+    int cpu = sched_getcpu(), node = -1;
+
+    if (cpu < 0) return -1;
+    snprintf(buf, sizeof(buf), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(buf)) == NULL) return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name, "node", 4) && isdigit(de->d_name[4])) {
+            node = atoi(de->d_name+4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    return -1;
+#endif
+}
+
+/* Choose the pools receiving new records according to pb-stripe-policy.
+ * Records are read back from every pool anyway. */
+static void pbSelectStripes(void) {
+    int j, node = -1, local = 0;
+
+    if (server.pb_stripe_policy == PB_STRIPE_NUMA_LOCAL) {
+        node = pbCurrentNumaNode();
+        for (j = 0; j < server.pb_stripes; j++)
+            if (node != -1 && server.pb_stripe[j].numa_node == node) local++;
+        if (!local)
+            serverLog(LL_NOTICE,"No persistent buffer pool on the NUMA node "
+                "of the server, new records go to all the pools.");
+    }
+    for (j = 0; j < server.pb_stripes; j++)
+        server.pb_stripe[j].active = !local ||
+                                     server.pb_stripe[j].numa_node == node;
+}
+
+/* Size of the log of a new pool: pb-log-size, or without it a quarter of
+ * the pool, leaving room for the checkpoint, up to 128MB. */
+static size_t pbLogSizeFor(pbStripe *s) {
+    size_t size = server.pb_log_size;
+
+    if (size == 0) {
+        size = s->size / PB_LOG_AUTO_POOL_FRACTION;
+        if (size > PB_LOG_AUTO_MAX_SIZE) size = PB_LOG_AUTO_MAX_SIZE;
+        size &= ~((size_t)PB_RECORD_ALIGN-1);
+    }
+    return size;
+}
+
+static int pbFormatStripe(pbStripe *s, int index, uint64_t set_id) {
+    struct redis_pmem_root *root = s->root;
+    size_t size = pbLogSizeFor(s);
+    const char *reason;
+
+    if (size >= s->size) {
+        serverLog(LL_WARNING,"The persistent buffer log of %zu bytes "
+            "(pb-log-size) doesn't fit in the pool %s of %zu bytes.",
+            size, s->path, s->size);
+        return C_ERR;
+    }
+    /* A log allocated by an interrupted format is just reallocated. */
+    if (!OID_IS_NULL(root->pb_log)) pmemobj_free(&root->pb_log);
+    if (pmemobj_alloc(s->pool, &root->pb_log, size,
+                      PM_TYPE_PB_LOG, NULL, NULL) != 0)
+    {
+        reason = pmemobj_errormsg();
+        serverLog(LL_WARNING,"Can't allocate a persistent buffer log of "
+            "%zu bytes in the pool %s of %zu bytes: %s. Use a smaller "
+            "pb-log-size.", size, s->path, s->size,
+            reason && reason[0] ? reason : strerror(errno));
+        return C_ERR;
+    }
+    root->pb_log_size = size;
+    root->pb_head = root->pb_aof_base = root->pb_durable = 0;
+    root->pb_cmdtab_sig = server.pb_cmdtab_sig;
+    root->pb_set_id = set_id;
+    root->pb_stripe = index;
+    root->pb_stripes = server.pb_stripes;
+    root->pb_tail = 0;
+    root->pb_next_seq = 1;
+    pmemobj_persist(s->pool, root, sizeof(*root));
+    root->pb_version = PB_LOG_VERSION;
+    pmemobj_persist(s->pool, &root->pb_version, sizeof(root->pb_version));
+    return C_OK;
+}
+
+static void pbIterInitRange(pbIterator *it, uint64_t from, uint64_t last) {
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+
+        it->end[j] = __atomic_load_n(&s->root->pb_tail, __ATOMIC_ACQUIRE);
+        it->pos[j] = pbSeek(s, s->root->pb_head, from);
+    }
+    it->last = last;
+    it->stripe = 0;
+    it->cur = it->pos[0];
+}
+
+/* Let the iterator return the records appended since it was set up. */
+static void pbIterRefresh(pbIterator *it) {
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++)
+        it->end[j] = __atomic_load_n(&server.pb_stripe[j].root->pb_tail,
+                                     __ATOMIC_ACQUIRE);
+    it->last = server.pb_next_seq;
+}
+
+/* The AOF is drained from the record numbered 'seq'. */
+static void pbDrainReset(uint64_t seq) {
+    pbIterInitRange(&server.pb_drain_it, seq, server.pb_next_seq);
+    server.pb_drain_pos = seq;
+    server.pb_drain_skip = server.pb_drain_pending = 0;
+}
+
+/* The checkpoint at 'oid', or NULL if there is none or it is incomplete. */
+static struct pb_checkpoint *pbCheckpointAt(PMEMoid oid) {
+    struct pb_checkpoint *ckpt = pmemobj_direct(oid);
+
+    return ckpt && ckpt->magic == PB_CKPT_MAGIC ? ckpt : NULL;
+}
+
+/* Forget the checkpoint when the records appended since it was taken can't
+ * be kept anymore. */
+static void pbCheckpointDrop(const char *reason) {
+    struct redis_pmem_root *root = server.pb_root;
+
+    if (OID_IS_NULL(root->pb_ckpt)) return;
+    serverLog(LL_NOTICE,"PB: dropping the checkpoint: %s.", reason);
+    pmemobj_free(&root->pb_ckpt);
+    server.pb_ckpt_seq = server.pb_ckpt_len = 0;
+}
+
+/* Records numbered from the returned one on can't be reclaimed: they are
+ * not fsynced in the AOF or they were appended after the checkpoint. */
+static uint64_t pbReclaimLimit(void) {
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+
+    return server.pb_ckpt_seq && server.pb_ckpt_seq < durable ?
+           server.pb_ckpt_seq : durable;
+}
+
+/* Attach the PB log of the pools, allocating and formatting it if the
+ * pools don't have one yet. The pools of a stripe set are formatted
+ * together, the first one last, and can't be changed afterwards. Returns
+ * C_ERR if the pools can't be used. */
+int pmemInitPBLog(void) {
+    uint64_t set_id = 0;
+    int j, formatted = 0;
+
+    pm_type_pb_log = TOID_TYPE_NUM(struct pb_log_record);
+    server.pb_cmdtab_sig = pbCommandTableSignature();
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+        struct redis_pmem_root *root = s->root;
+
+        if (root->pb_version == PB_LOG_VERSION) {
+            if (formatted++ == 0) set_id = root->pb_set_id;
+            if (root->pb_set_id != set_id || root->pb_stripe != (uint32_t)j ||
+                root->pb_stripes != (uint32_t)server.pb_stripes)
+            {
+                serverLog(LL_WARNING,"The PMEM pool %s is not the pool %d of "
+                    "a persistent buffer striped across %d pools: the pools "
+                    "of pmfile can't be changed once they were used.",
+                    s->path, j+1, server.pb_stripes);
+                return C_ERR;
+            }
+        } else if (!s->created && root->pb_version != 0) {
+            serverLog(LL_WARNING,"The PMEM pool %s was written with an "
+                "incompatible persistent buffer layout.", s->path);
+            return C_ERR;
+        }
+    }
+    if (formatted && formatted < server.pb_stripes) {
+        /* Unless the format was interrupted, a pool was replaced. */
+        for (j = 0; j < server.pb_stripes; j++) {
+            struct redis_pmem_root *root = server.pb_stripe[j].root;
+
+            if (server.pb_stripe[0].root->pb_version == PB_LOG_VERSION ||
+                (root->pb_version == PB_LOG_VERSION &&
+                 root->pb_head != root->pb_tail))
+            {
+                serverLog(LL_WARNING,"Some pools of the persistent buffer "
+                    "are missing: the pools of pmfile can't be changed once "
+                    "they were used.");
+                return C_ERR;
+            }
+        }
+        formatted = 0;
+    }
+    if (!formatted) {
+        getRandomHexChars((char*)&set_id, sizeof(set_id));
+        for (j = server.pb_stripes-1; j >= 0; j--)
+            if (pbFormatStripe(&server.pb_stripe[j], j, set_id) == C_ERR)
+                return C_ERR;
+    }
+
+    server.pb_root = server.pb_stripe[0].root;
+    server.pb_next_seq = 1;
+    server.stat_pm_allocated = 0;
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+        struct redis_pmem_root *root = s->root;
+
+        if (server.pb_log_size && root->pb_log_size != server.pb_log_size)
+            serverLog(LL_NOTICE,"Using the existing persistent buffer log "
+                "size of %llu bytes in %s.",
+                (unsigned long long) root->pb_log_size, s->path);
+        s->log = pmemobj_direct(root->pb_log);
+        s->log_size = root->pb_log_size;
+        s->durable_pos = s->covered_pos = root->pb_head;
+        s->numa_node = pbPathNumaNode(s->path);
+        if (root->pb_next_seq > server.pb_next_seq)
+            server.pb_next_seq = root->pb_next_seq;
+        server.stat_pm_allocated += pmemobj_root_size(s->pool) +
+                                    pmemobj_alloc_usable_size(root->pb_log);
+        if (server.pb_stripes > 1)
+            serverLog(LL_NOTICE,"Persistent buffer pool %d: %s, NUMA node %d",
+                j+1, s->path, s->numa_node);
+    }
+    pbSelectStripes();
+    server.pb_stripe_next = 0;
+
+    /* A checkpoint whose child didn't complete is useless. */
+    pm_type_pb_checkpoint = TOID_TYPE_NUM(struct pb_checkpoint);
+    pm_type_pb_repl_backlog = TOID_TYPE_NUM(struct pb_repl_backlog);
+    if (!OID_IS_NULL(server.pb_root->pb_ckpt_next))
+        pmemobj_free(&server.pb_root->pb_ckpt_next);
+    server.pb_ckpt_seq = server.pb_ckpt_len = 0;
+    if (pbCheckpointAt(server.pb_root->pb_ckpt) != NULL) {
+        struct pb_checkpoint *ckpt = pmemobj_direct(server.pb_root->pb_ckpt);
+
+        server.pb_ckpt_seq = ckpt->seq;
+        server.pb_ckpt_len = ckpt->len;
+    } else {
+        pbCheckpointDrop("incomplete");
+    }
+    /* The records in the log are replayed through the AOF buffer. */
+    pbDrainReset(server.pb_next_seq);
+    pmemTierInit();
+    return C_OK;
+}
+
+/* Replay the log and make the replayed commands durable in the AOF, so the
+ * log can be emptied afterwards. */
 int pmemReconstructPB(void) {
-    loadAppendOnlyPersistentBuffer();
-    pmemClearPBList(getCurrentHead());
-    pmemClearPBList(getAnotherHead());
+    uint64_t from = server.aof_state == AOF_ON ? pmemPBCoveredByAOF() : 0;
+
+    if (loadAppendOnlyPersistentBuffer(from) != C_OK) return C_ERR;
+    if (server.aof_state != AOF_OFF) {
+        flushAppendOnlyFile(1);
+        aof_fsync(server.aof_fd);
+    }
+    pmemClearPBList(PB_BUFFER_ALL);
+
+    /* The log is empty: new binary records use this server's commands. */
+    if (server.pb_root->pb_cmdtab_sig != server.pb_cmdtab_sig) {
+        server.pb_root->pb_cmdtab_sig = server.pb_cmdtab_sig;
+        pmemobj_persist(server.pm_pool, &server.pb_root->pb_cmdtab_sig,
+                        sizeof(server.pb_root->pb_cmdtab_sig));
+    }
     return C_OK;
 }
 
-PMEMoid getCurrentHead() {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    if (root->current_head == 0) return root->first_head.oid;
-    return root->second_head.oid;
+/* Reclaim the space of the records of the pool already fsynced in the
+ * AOF, the ones the checkpoint needs excepted. */
+static void pbReclaim(pbStripe *s) {
+    struct redis_pmem_root *root = s->root;
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+    uint64_t limit = pbReclaimLimit(), head;
+
+    s->durable_pos = pbSeek(s, s->durable_pos, durable);
+    head = limit == durable ? s->durable_pos : pbSeek(s, root->pb_head, limit);
+    if (head <= root->pb_head) return;
+    root->pb_head = head;
+    pmemobj_persist(s->pool, &root->pb_head, sizeof(root->pb_head));
+    pmemEmulateWrite(&root->pb_head, sizeof(root->pb_head));
+    PB_FAULT(PB_FAULT_RECLAIM);
+}
+
+/* The log is full of records that are not fsynced in the AOF yet, which
+ * happens when the fsync policy is "no" or the disk can't keep up: make
+ * them durable synchronously so their space can be reused. */
+static int pbSyncAOF(void) {
+    if (server.aof_state != AOF_ON) return C_ERR;
+    serverLog(LL_PB, "PB: fsyncing the AOF to reclaim the log");
+    flushAppendOnlyFile(1);
+    /* Write error. */
+    if (sdslen(server.aof_buf) != 0 || server.pb_drain_pending != 0)
+        return C_ERR;
+    if (aof_fsync(server.aof_fd) == -1) return C_ERR;
+    pmemPBSetDurable(pmemPBWatermark());
+    return C_OK;
+}
+
+/* Append latencies are counted in buckets of a quarter of a power of two:
+ * the first four hold 0-3 ns, then each power of two is split in four. */
+static int pbLatencyBucket(uint64_t ns) {
+    int exp, bucket;
+
+    if (ns < 4) return ns;
+    exp = 63 - __builtin_clzll(ns);
+    bucket = (exp-1)*4 + ((ns >> (exp-2)) & 3);
+    return bucket < PB_LATENCY_BUCKETS ? bucket : PB_LATENCY_BUCKETS-1;
+}
+
+/* Upper bound in nanoseconds of the append latency of the given percentile
+ * of the appends so far, or 0 if there were none. */
+uint64_t pmemPBAppendLatency(double percentile) {
+    long long total = 0, seen = 0, rank;
+    int j, exp;
+
+    for (j = 0; j < PB_LATENCY_BUCKETS; j++)
+        total += server.stat_pb_append_latency[j];
+    if (total == 0) return 0;
+    rank = (long long)(total * percentile / 100);
+    if (rank >= total) rank = total-1;
+    for (j = 0; j < PB_LATENCY_BUCKETS; j++) {
+        seen += server.stat_pb_append_latency[j];
+        if (seen > rank) break;
+    }
+    if (j < 4) return j;
+    exp = j/4 + 1;
+    return ((uint64_t)(4 + j%4 + 1) << (exp-2)) - 1;
+}
+
+/* Number of records in the log, the WRAP markers excluded. */
+long long pmemPBRecordCount(void) {
+    pb_log_record *rec;
+    pbIterator it;
+
+    pmemPBIterInit(&it, PB_BUFFER_ALL);
+    if ((rec = pmemPBIterNext(&it)) == NULL) return 0;
+    return server.pb_next_seq - rec->seq;
+}
+
+/* Bytes skipped at the tail of the log of the pool before a record of
+ * 'reclen' bytes: records never cross the end of the log. */
+static uint64_t pbGap(pbStripe *s, uint64_t reclen) {
+    uint64_t left = s->log_size - (s->root->pb_tail % s->log_size);
+
+    return left < reclen ? left : 0;
+}
+
+static int pbHasRoom(pbStripe *s, uint64_t reclen) {
+    struct redis_pmem_root *root = s->root;
+
+    return root->pb_tail + pbGap(s, reclen) + reclen - root->pb_head <=
+           s->log_size;
+}
+
+/* Return 1 if the pool can ever take a record of 'reclen' bytes. */
+static int pbStripeFits(pbStripe *s, uint64_t reclen) {
+    return s->active && pbGap(s, reclen) + reclen <= s->log_size;
 }
 
-PMEMoid getAnotherHead() {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    if (root->current_head == 0) return root->second_head.oid;
-    return root->first_head.oid;
+/* The pool of the shard, or -1 for any pool when it can't take the record:
+ * records are merged by sequence number on replay, so a shard is only a
+ * placement preference. */
+static int pbShardFor(int shard, uint64_t reclen) {
+    if (shard == -1 || pbStripeFits(&server.pb_stripe[shard], reclen))
+        return shard;
+    server.stat_pb_shard_fallbacks++;
+    return -1;
+}
+
+/* Pick the pool of the next record: the pool 'shard', or the active pools
+ * in turn if it is -1. When they are full, the space of the fsynced
+ * records is reclaimed and, as a last resort, the AOF is fsynced and the
+ * records kept for the checkpoint are given up. Returns NULL if there is no
+ * room for the record anyway. */
+static pbStripe *pbStripeFor(uint64_t reclen, int shard) {
+    int attempt, k, pools;
+
+    shard = pbShardFor(shard, reclen);
+    pools = shard == -1 ? server.pb_stripes : 1;
+
+    for (attempt = 0; attempt < 4; attempt++) {
+        if (attempt == 2) pbSyncAOF();
+        if (attempt == 3) {
+            if (pbReclaimLimit() == __atomic_load_n(
+                    &server.pb_root->pb_durable, __ATOMIC_ACQUIRE))
+                break;
+            pbCheckpointDrop("the log is full");
+        }
+        for (k = 0; k < pools; k++) {
+            int j = shard != -1 ? shard :
+                    (server.pb_stripe_next + k) % server.pb_stripes;
+            pbStripe *s = &server.pb_stripe[j];
+
+            if (!pbStripeFits(s, reclen)) continue;
+            if (attempt && !pbHasRoom(s, reclen)) pbReclaim(s);
+            if (pbHasRoom(s, reclen)) {
+                if (shard == -1)
+                    server.pb_stripe_next = (j+1) % server.pb_stripes;
+                return s;
+            }
+        }
+    }
+    return NULL;
 }
 
-void setCurrentHead(PMEMoid new_head_oid) {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    TX_ADD_DIRECT_LATENCY(root);
-    if (root->current_head == 0) {
-        root->first_head.oid = new_head_oid;
+/* Append a record with the given payload to the log, in the pool 'shard'
+ * unless it is -1. 'aof_len' is the size of the same commands in the AOF
+ * format. Returns C_ERR when there is no room left for it. */
+static int pbAppend(const char *payload, size_t len, size_t aof_len,
+                    int flags, int dictid, int shard)
+{
+    uint64_t reclen, start = pmemLatencyNanoseconds();
+    struct redis_pmem_root *root;
+    uint64_t tail, gap;
+    pbStripe *s;
+    pb_log_record *rec;
+    char *lzf = NULL;
+    size_t raw_len = 0, comprlen;
+
+    if (len > UINT32_MAX || aof_len > UINT32_MAX) return C_ERR;
+
+    /* Compress large payloads, unless they are written to the AOF as they
+     * are. Like in RDB files, the compressed form is only kept if it saves
+     * space: here it must take fewer cache lines. */
+    if (server.pb_compress_threshold && len > server.pb_compress_threshold &&
+        !pmemPBDrainsAOF())
+    {
+        lzf = zmalloc(len);
+        comprlen = lzf_compress(payload, len, lzf, len-1);
+        if (comprlen && PB_RECORD_SIZE(comprlen) < PB_RECORD_SIZE(len)) {
+            raw_len = len;
+            payload = lzf;
+            len = comprlen;
+            flags |= PB_RECORD_LZF;
+        }
+    }
+    reclen = PB_RECORD_SIZE(len);
+    if ((s = pbStripeFor(reclen, shard)) == NULL) {
+        zfree(lzf);
+        return C_ERR;
+    }
+    root = s->root;
+    tail = root->pb_tail;
+    gap = pbGap(s, reclen);
+
+    if (gap) {
+        rec = pbRecordAt(s, tail);
+        rec->magic = PB_RECORD_WRAP;
+        rec->len = 0;
+        pmemobj_flush(s->pool, rec, sizeof(*rec));
+        server.stat_pb_flushes++;
+        tail += gap;
+        PB_FAULT(PB_FAULT_WRAP);
+    }
+    rec = pbRecordAt(s, tail);
+    rec->magic = PB_RECORD_MAGIC;
+    rec->len = len;
+    rec->seq = server.pb_next_seq;
+    /* The commands are the last bytes fed to the AOF buffer, or the last
+     * ones to be written from the log in drain mode. */
+    if (pmemPBDrainsAOF()) {
+        server.pb_drain_pending += aof_len;
+        rec->aof_off = server.aof_current_size + sdslen(server.aof_buf) +
+                       server.pb_drain_pending;
+    } else if (server.aof_state == AOF_ON) {
+        rec->aof_off = server.aof_current_size + sdslen(server.aof_buf);
     } else {
-        root->second_head.oid = new_head_oid;
+        rec->aof_off = 0;
+    }
+    rec->dictid = dictid;
+    rec->flags = flags;
+    rec->aof_len = aof_len;
+    rec->raw_len = raw_len;
+    rec->checksum = (flags & (PB_RECORD_BINARY|PB_RECORD_LZF)) ?
+        crc64(0, (const unsigned char*)payload, len) : 0;
+    memcpy(rec->payload, payload, len);
+    zfree(lzf);
+    pmemobj_flush(s->pool, rec, sizeof(*rec)+len);
+    pmemobj_drain(s->pool);
+    pmemEmulateWrite(rec, sizeof(*rec)+len);
+    PB_FAULT(PB_FAULT_APPEND_RECORD);
+
+    /* The record is durable: publish it. */
+    root->pb_next_seq = ++server.pb_next_seq;
+    __atomic_store_n(&root->pb_tail, tail+reclen, __ATOMIC_RELEASE);
+    pmemobj_persist(s->pool, &root->pb_tail, sizeof(uint64_t)*2);
+    pmemEmulateWrite(&root->pb_tail, sizeof(uint64_t)*2);
+    PB_FAULT(PB_FAULT_APPEND_TAIL);
+    server.stat_pb_records++;
+    server.stat_pb_flushes += 2;
+    server.stat_pb_fences += 2;
+    server.stat_pb_payload_bytes += len;
+    if (flags & PB_RECORD_LZF) {
+        server.stat_pb_compressed_records++;
+        server.stat_pb_compressed_saved_bytes += raw_len-len;
+    }
+    server.stat_pb_persisted_bytes += sizeof(*rec)+len+sizeof(uint64_t)*2;
+    server.stat_pb_aof_bytes += aof_len;
+    server.stat_pb_append_latency[
+        pbLatencyBucket(pmemLatencyNanoseconds()-start)]++;
+    return C_OK;
+}
+
+/* Decompress the payload of an LZF record in 'buf', holding rec->raw_len
+ * bytes. Returns C_ERR if the payload is damaged. */
+int pmemPBDecompress(pb_log_record *rec, char *buf) {
+    return lzf_decompress(rec->payload, rec->len, buf, rec->raw_len) ==
+           rec->raw_len ? C_OK : C_ERR;
+}
+
+/* Return 1 if a record holding the staged commands and 'len' more bytes can
+ * be appended to the pool 'shard' (any pool if -1). Nothing is changed:
+ * the space the append would make, see pbStripeFor(), is counted instead.
+ * The AOF can be fsynced unless it can't be written, which frees the whole
+ * log, the checkpoint being given up if needed; otherwise the records
+ * fsynced already are reclaimable. */
+int pmemPBHasRoom(size_t len, int shard) {
+    uint64_t reclen = PB_RECORD_SIZE(sdslen(server.pb_batch)+len);
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+    int syncable = server.aof_state == AOF_ON &&
+                   server.aof_last_write_status == C_OK;
+    int j;
+
+    if (shard != -1 && !pbStripeFits(&server.pb_stripe[shard], reclen))
+        shard = -1;
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+        uint64_t head, gap = pbGap(s, reclen);
+
+        if ((shard != -1 && j != shard) || !pbStripeFits(s, reclen))
+            continue;
+        head = syncable ? s->root->pb_tail :
+                          pbSeek(s, s->durable_pos, durable);
+        if (s->root->pb_tail + gap + reclen - head <= s->log_size) return 1;
+    }
+    return 0;
+}
+
+/* Append a record holding 'len' bytes of AOF formatted commands. */
+int pmemAddToPBList(const char *cmd, size_t len, int dictid) {
+    return pbAppend(cmd, len, len, 0, dictid, -1);
+}
+
+/* With pb-stripe-policy shard, return the preferred pool of the records of
+ * a command: the DBs are spread over the pools, or in cluster mode, where
+ * there is a single DB, ranges of hash slots are. This is only a placement
+ * preference: a record the pool can't take goes to another one (see
+ * pbShardFor()), and the pools are reclaimed and replayed together, merged
+ * by sequence number, so the records of a shard may be in any pool. Returns
+ * -1 if the command may go to any pool: with another policy, or in cluster
+ * mode for the commands without keys. */
+int pmemPBShard(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    int *keys, numkeys, slot = -1;
+
+    if (server.pb_stripe_policy != PB_STRIPE_SHARD) return -1;
+    if (!server.cluster_enabled) return dictid % server.pb_stripes;
+    keys = getKeysFromCommand(cmd, argv, argc, &numkeys);
+    if (numkeys) {
+        sds key = argv[keys[0]]->ptr;
+
+        slot = keyHashSlot(key, sdslen(key));
+    }
+    getKeysFreeResult(keys);
+    return slot == -1 ? -1 : slot * server.pb_stripes / CLUSTER_SLOTS;
+}
+
+static sds pbCatVarint(sds s, uint64_t v) {
+    unsigned char buf[10];
+
+    return sdscatlen(s, buf, pbVarintEncode(buf, v));
+}
+
+/* Append to 'dst' the binary encoding (see pmem.h) of the AOF formatted
+ * commands in 'cmd'. The input is produced by feedAppendOnlyFile(), so it
+ * is trusted to be well formed. */
+static sds pbEncodeBinary(sds dst, const char *cmd, size_t len) {
+    const char *p = cmd, *end = cmd + len;
+    char *eptr;
+
+    while (p < end) {
+        long argc = strtol(p+1, &eptr, 10), j;
+
+        p = eptr+2;
+        dst = pbCatVarint(dst, argc);
+        for (j = 0; j < argc; j++) {
+            long arglen = strtol(p+1, &eptr, 10);
+            const char *arg = eptr+2;
+            long long value;
+
+            p = arg+arglen+2;
+            if (j == 0) {
+                struct redisCommand *c = NULL;
+                char name[64];
+
+                if (arglen < (long)sizeof(name)) {
+                    memcpy(name, arg, arglen);
+                    name[arglen] = '\0';
+                    c = lookupCommandByCString(name);
+                }
+                /* Renamed commands keep their name. */
+                if (c && !strcasecmp(c->name, name)) {
+                    dst = pbCatVarint(dst, pbCommandIndex(c)+1);
+                    continue;
+                }
+                dst = pbCatVarint(dst, 0);
+            }
+            if (arglen < LONG_STR_SIZE && string2ll(arg, arglen, &value)) {
+                dst = pbCatVarint(dst, PB_BINARY_ARG_INT);
+                dst = pbCatVarint(dst, ((uint64_t)value << 1) ^
+                                       (uint64_t)(value >> 63));
+            } else {
+                dst = pbCatVarint(dst, (uint64_t)arglen+1);
+                dst = sdscatlen(dst, arg, arglen);
+            }
+        }
+    }
+    return dst;
+}
+
+/* A record could not be appended. In drain mode the AOF buffer doesn't
+ * get a copy of the commands, so they are fed to it now, behind the records
+ * not drained yet that are moved there too: the AOF keeps the order of the
+ * commands, and the AOF offsets of the records don't change. */
+static void pbDrainFallback(const char *cmd, size_t len) {
+    pbIterator *it = &server.pb_drain_it;
+    pb_log_record *rec;
+
+    if (!pmemPBDrainsAOF()) return;
+    pbIterRefresh(it);
+    while ((rec = pmemPBIterNext(it)) != NULL) {
+        server.aof_buf = sdscatlen(server.aof_buf,
+                                   rec->payload + server.pb_drain_skip,
+                                   rec->len - server.pb_drain_skip);
+        server.pb_drain_pos = rec->seq+1;
+        server.pb_drain_skip = 0;
+    }
+    server.pb_drain_pending = 0;
+    server.aof_buf = sdscatlen(server.aof_buf, cmd, len);
+}
+
+/* The staged commands reached pb-group-commit-size: the batch is persisted
+ * without waiting for the end of the event loop iteration, bounding the
+ * size of the records and the time spent persisting before the replies. */
+static int pbBatchFull(void) {
+    return server.pb_group_commit_size &&
+           server.pb_batch_cmds >= server.pb_group_commit_size;
+}
+
+/* Log a command in the PB. In group commit mode the command is only
+ * staged in DRAM and becomes durable with the whole batch when
+ * pmemCommitPBBatch() is called before replies are sent, or as soon as the
+ * batch holds pb-group-commit-size commands; otherwise it is appended as a
+ * record of its own, unless it is part of a unit. 'shard' is the pool of
+ * the command, see pmemPBShard(). */
+void pmemLogCommand(const char *cmd, size_t len, int dictid, int shard) {
+    /* Records drained to the AOF must be in the AOF format. */
+    int binary = server.pb_record_encoding == PB_ENCODING_BINARY &&
+                 !pmemPBDrainsAOF();
+
+    if (!server.pb_group_commit && !server.pb_in_unit) {
+        sds enc = binary ? pbEncodeBinary(sdsempty(), cmd, len) : NULL;
+        int retval;
+
+        if (binary)
+            retval = pbAppend(enc, sdslen(enc), len, PB_RECORD_BINARY, dictid,
+                              shard);
+        else
+            retval = pbAppend(cmd, len, len, 0, dictid, shard);
+        if (retval == C_ERR) {
+            serverLog(LL_PB, "PB ERROR: add command to PB list failed");
+            server.stat_pb_append_errors++;
+            pbDrainFallback(cmd, len);
+        } else
+            server.stat_pb_commands++;
+        sdsfree(enc);
+        return;
     }
+    if (server.pb_batch_cmds == 0) {
+        server.pb_batch_dictid = dictid;
+        server.pb_batch_flags = binary ? PB_RECORD_BINARY : 0;
+        server.pb_batch_aof_len = 0;
+        server.pb_batch_shard = shard;
+    } else if (server.pb_batch_shard == -1) {
+        server.pb_batch_shard = shard;
+    }
+    if (server.pb_batch_flags & PB_RECORD_BINARY)
+        server.pb_batch = pbEncodeBinary(server.pb_batch, cmd, len);
+    else
+        server.pb_batch = sdscatlen(server.pb_batch, cmd, len);
+    server.pb_batch_aof_len += len;
+    server.pb_batch_cmds++;
+    if (!server.pb_in_unit && pbBatchFull()) pmemCommitPBBatch();
+}
+
+/* The commands propagated between MULTI and EXEC, by a transaction or a
+ * script, form a unit: it goes in a single record, so that it is persisted
+ * once and replayed either entirely or not at all. In group commit mode the
+ * batch holds whole units already. */
+void pmemBeginPBUnit(void) {
+    server.pb_in_unit = 1;
 }
 
-void setAnotherHead(PMEMoid new_head_oid) {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    TX_ADD_DIRECT_LATENCY(root);
-    if (root->current_head == 0) {
-        root->second_head.oid = new_head_oid;
+void pmemEndPBUnit(void) {
+    server.pb_in_unit = 0;
+    if (!server.pb_group_commit || pbBatchFull()) pmemCommitPBBatch();
+}
+
+/* Persist the staged commands before the command about to be fed to the
+ * AOF buffer, which the AOF offset of the record must not cover, when they
+ * can't share a record with it:
+ *
+ * - Before a unit: a unit is never split, and replies may be written while
+ *   it is open (see processEventsWhileBlocked()), which must not
+ *   acknowledge commands still staged.
+ * - With pb-stripe-policy shard a record holds the commands of a single
+ *   shard, a unit going to the shard of its first command with keys. */
+void pmemSplitPBBatch(int shard, int unit) {
+    if (server.pb_batch_cmds == 0 || server.pb_in_unit) return;
+    if (unit || (server.pb_stripe_policy == PB_STRIPE_SHARD &&
+                 shard != -1 && server.pb_batch_shard != -1 &&
+                 shard != server.pb_batch_shard))
+        pmemCommitPBBatch();
+}
+
+/* Persist the commands staged since the last call as a single record. The
+ * record is tagged with the DB of the first command: the following ones
+ * carry their own SELECT, like in the AOF. */
+void pmemCommitPBBatch(void) {
+    if (server.pb_batch_cmds == 0) return;
+
+    if (pbAppend(server.pb_batch, sdslen(server.pb_batch),
+                 server.pb_batch_aof_len, server.pb_batch_flags,
+                 server.pb_batch_dictid, server.pb_batch_shard) == C_ERR)
+    {
+        serverLog(LL_PB, "PB ERROR: add batch of %lld commands to PB list "
+            "failed", server.pb_batch_cmds);
+        server.stat_pb_append_errors++;
+        pbDrainFallback(server.pb_batch, sdslen(server.pb_batch));
     } else {
-        root->first_head.oid = new_head_oid;
+        server.stat_pb_commands += server.pb_batch_cmds;
+        if (server.pb_batch_cmds > server.stat_pb_max_batch)
+            server.stat_pb_max_batch = server.pb_batch_cmds;
+    }
+    server.pb_batch_cmds = 0;
+
+    /* Don't keep a huge buffer around after a burst. */
+    if (sdsalloc(server.pb_batch) > PB_BATCH_MAX_IDLE_ALLOC) {
+        sdsfree(server.pb_batch);
+        server.pb_batch = sdsempty();
+    } else {
+        sdsclear(server.pb_batch);
     }
 }
-PMEMoid pmemAddToPBList(void *cmd) {
-    // TODO(totoro): Implement Add persistent_aof_log logics.
-    PMEMoid cmd_oid;
-    PMEMoid paof_log_oid;
-    struct persistent_aof_log *paof_log_ptr;
-    TOID(struct persistent_aof_log) paof_log_toid;
-    struct redis_pmem_root *root;
 
-    cmd_oid.pool_uuid_lo = server.pool_uuid_lo;
-    cmd_oid.off = (uint64_t)cmd - (uint64_t)server.pm_pool->addr;
 
-    paof_log_oid = pmemobj_tx_zalloc_latency(sizeof(struct persistent_aof_log), pm_type_persistent_aof_log);
-    paof_log_ptr = (struct persistent_aof_log *) pmemobj_direct_latency(paof_log_oid);
-    paof_log_ptr->cmd_oid = cmd_oid;
-    paof_log_toid.oid = paof_log_oid;
+/* Return the sequence number of the first record the AOF won't cover once
+ * the data written so far is fsynced. It is passed along with the fsync
+ * job. */
+uint64_t pmemPBWatermark(void) {
+    if (pmemPBDrainsAOF()) return server.pb_drain_pos;
+    return server.pb_next_seq;
+}
+
+/* Mark the records numbered before 'seq' as fsynced in the AOF. Called by
+ * the bio thread after a background fsync, so only the watermark is written
+ * here: the space of the records is reclaimed later by the main thread. */
+void pmemPBSetDurable(uint64_t seq) {
+    struct redis_pmem_root *root = server.pb_root;
+    uint64_t cur = __atomic_load_n(&root->pb_durable, __ATOMIC_ACQUIRE);
+
+    /* Fsync jobs may complete after a newer synchronous fsync. */
+    do {
+        if (seq <= cur) return;
+    } while (!__atomic_compare_exchange_n(&root->pb_durable, &cur, seq, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    pmemobj_persist(server.pm_pool, &root->pb_durable, sizeof(root->pb_durable));
+    pmemEmulateWrite(&root->pb_durable, sizeof(root->pb_durable));
+    PB_FAULT(PB_FAULT_DURABLE);
+}
+
+/* A rewritten AOF was just installed and fsynced: it contains the commands
+ * of every record appended so far, while the AOF offsets of these records
+ * refer to the old file. */
+void pmemPBRewriteDone(void) {
+    struct redis_pmem_root *root = server.pb_root;
+
+    /* The batched commands are already in the rewrite buffer. */
+    pmemCommitPBBatch();
+    root->pb_aof_base = server.pb_next_seq;
+    pmemobj_persist(server.pm_pool, &root->pb_aof_base, sizeof(root->pb_aof_base));
+    PB_FAULT(PB_FAULT_REWRITE);
 
-    root = pmemobj_direct_latency(server.pm_rootoid.oid);
+    /* Like the AOF buffer, what was not drained yet is in the new file. */
+    pbDrainReset(server.pb_next_seq);
+}
 
-    TOID(struct persistent_aof_log) head;
-    head.oid = getCurrentHead();
+/* In drain mode the commands are not copied in the AOF buffer: the AOF is
+ * written straight from the records, which are in the AOF format. */
+int pmemPBDrainsAOF(void) {
+    return server.persistent && server.pb_aof_drain &&
+           server.aof_state == AOF_ON;
+}
 
-    paof_log_ptr->next = head;
-    if(!TOID_IS_NULL(head)) {
-        struct persistent_aof_log *head_ptr = D_RW_LATENCY(head);
-        TX_ADD_FIELD_DIRECT_LATENCY(head_ptr, prev);
-    	head_ptr->prev = paof_log_toid;
+/* Write to the AOF the content of the AOF buffer followed by the records
+ * not drained yet, without consuming them. Returns the number of bytes
+ * written, or -1 if nothing could be written, like write(2). */
+ssize_t pmemPBWriteAOF(int fd) {
+    struct iovec iov[PB_DRAIN_IOV];
+    pbIterator it = server.pb_drain_it;
+    pb_log_record *rec;
+    size_t skip = server.pb_drain_skip, bytes;
+    ssize_t nwritten, total = 0;
+    int iovcnt, drain = pmemPBDrainsAOF();
+
+    pbIterRefresh(&it);
+    do {
+        iovcnt = 0;
+        bytes = 0;
+        if (total == 0 && sdslen(server.aof_buf)) {
+            iov[iovcnt].iov_base = server.aof_buf;
+            iov[iovcnt].iov_len = sdslen(server.aof_buf);
+            bytes += iov[iovcnt++].iov_len;
+        }
+        while (drain && iovcnt < PB_DRAIN_IOV &&
+               (rec = pmemPBIterNext(&it)) != NULL)
+        {
+            iov[iovcnt].iov_base = rec->payload + skip;
+            iov[iovcnt].iov_len = rec->len - skip;
+            bytes += iov[iovcnt++].iov_len;
+            skip = 0;
+        }
+        if (iovcnt == 0) break;
+        nwritten = aofDaxActive() ? aofDaxWrite(iov, iovcnt) :
+                                    writev(fd, iov, iovcnt);
+        server.stat_pb_drain_writes++;
+        if (nwritten <= 0) return total ? total : nwritten;
+        total += nwritten;
+    } while ((size_t)nwritten == bytes);
+    return total;
+}
+
+/* Drop the first 'written' bytes of what pmemPBWriteAOF() writes. */
+void pmemPBConsumeAOF(size_t written) {
+    size_t buflen = sdslen(server.aof_buf);
+    pbIterator *it = &server.pb_drain_it;
+    pb_log_record *rec;
+
+    if (buflen) {
+        if (written < buflen) {
+            sdsrange(server.aof_buf, written, -1);
+            return;
+        }
+        sdsclear(server.aof_buf);
+        written -= buflen;
+    }
+
+    serverAssert(written <= server.pb_drain_pending);
+    server.pb_drain_pending -= written;
+    pbIterRefresh(it);
+    while (written && (rec = pmemPBIterNext(it)) != NULL) {
+        size_t left = rec->len - server.pb_drain_skip;
+
+        if (written < left) {
+            /* Come back to this record next time. */
+            it->pos[it->stripe] = it->cur;
+            server.pb_drain_skip += written;
+            return;
+        }
+        written -= left;
+        server.pb_drain_pos = rec->seq+1;
+        server.pb_drain_skip = 0;
     }
+}
+
+/* Records numbered before the returned one are known to be in the AOF
+ * file. */
+uint64_t pmemPBCoveredByAOF(void) {
+    struct redis_pmem_root *root = server.pb_root;
+    uint64_t durable = __atomic_load_n(&root->pb_durable, __ATOMIC_ACQUIRE);
+
+    return durable > root->pb_aof_base ? durable : root->pb_aof_base;
+}
+
+/* Return 1 if the records not fsynced in the AOF, the staged ones
+ * included, exceed pb-max-memory. */
+int pmemPBOverLimit(void) {
+    return server.pb_max_memory &&
+           pmemPBCurrentBytes() + sdslen(server.pb_batch) >
+           server.pb_max_memory;
+}
 
-    setCurrentHead(paof_log_toid.oid);
-    TX_ADD_DIRECT_LATENCY(root);
-    root->num_logs++;
+/* Make the records appended so far, and the commands in the AOF buffer,
+ * durable in the AOF now and reclaim their space. Returns C_ERR if the AOF
+ * could not be written or fsynced. */
+int pmemPBForceSync(void) {
+    int retval = pbSyncAOF();
+
+    pmemClearPBList(PB_BUFFER_ANOTHER);
+    server.stat_pb_forced_fsyncs++;
+    return retval;
+}
+
+/* Have the AOF fsynced in the background as soon as possible, to make room
+ * in the PB without blocking the main thread. */
+void pmemPBRequestFsync(void) {
+    if (server.aof_state != AOF_ON) return;
+    if (sdslen(server.aof_buf) || server.pb_drain_pending)
+        server.pb_fsync_asap = 1; /* Once written, see flushAppendOnlyFile() */
+    else if (bioPendingJobsOfType(BIO_AOF_FSYNC) == 0)
+        aof_background_fsync(server.aof_fd);
+}
+
+/* Called by serverCron(): every pb-reclaim-interval milliseconds give the
+ * space of the records fsynced in the AOF back to the log, instead of
+ * waiting for an append to find the log full. The appends then rarely pay
+ * for the reclaim, and the log usage reported by INFO follows the fsyncs. */
+void pmemPBReclaimCron(void) {
+    if (!server.persistent || server.pb_reclaim_interval == 0 ||
+        server.mstime - server.pb_reclaim_last < server.pb_reclaim_interval)
+        return;
+    server.pb_reclaim_last = server.mstime;
+    pmemClearPBList(PB_BUFFER_ANOTHER);
+}
 
-    return paof_log_oid;
+/* Mark every record appended so far as fsynced in the AOF. */
+void pmemSwitchDoubleBuffer(void) {
+    pmemPBSetDurable(pmemPBWatermark());
 }
 
-void pmemSwitchDoubleBuffer() {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    TX_ADD_DIRECT_LATENCY(root);
-    if (root->current_head == 0) {
-        root->current_head = 1;
+/* Drop the records of the given buffer. Only the positions are updated,
+ * the space is reused by the next appends. */
+void pmemClearPBList(int buffer) {
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+    int j;
+
+    if (buffer == PB_BUFFER_ANOTHER) {
+        for (j = 0; j < server.pb_stripes; j++)
+            pbReclaim(&server.pb_stripe[j]);
+    } else if (buffer == PB_BUFFER_CURRENT) {
+        uint64_t next = durable ? durable : 1;
+
+        for (j = 0; j < server.pb_stripes; j++) {
+            pbStripe *s = &server.pb_stripe[j];
+
+            s->durable_pos = pbSeek(s, s->durable_pos, durable);
+            if (s->covered_pos > s->durable_pos)
+                s->covered_pos = s->durable_pos;
+            s->root->pb_next_seq = next;
+            __atomic_store_n(&s->root->pb_tail, s->durable_pos,
+                             __ATOMIC_RELEASE);
+            pmemobj_persist(s->pool, &s->root->pb_tail, sizeof(uint64_t)*2);
+            PB_FAULT(PB_FAULT_CLEAR);
+        }
+        /* The checkpoint may include the dropped records. */
+        if (next != server.pb_next_seq)
+            pbCheckpointDrop("records were discarded");
+        server.pb_next_seq = next;
+        if (server.pb_drain_pos > next) pbDrainReset(next);
     } else {
-        root->current_head = 0;
+        if (server.pb_ckpt_seq != server.pb_next_seq)
+            pbCheckpointDrop("the log was emptied");
+        pmemPBSetDurable(server.pb_next_seq);
+        for (j = 0; j < server.pb_stripes; j++)
+            pbReclaim(&server.pb_stripe[j]);
+        pbDrainReset(server.pb_next_seq);
     }
 }
 
-void pmemClearPBList(PMEMoid head) {
-    struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    TOID(struct persistent_aof_log) log_toid;
-    int freed = 0;
-    log_toid.oid = head;
+void pmemPBIterInit(pbIterator *it, int buffer) {
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+
+    if (buffer == PB_BUFFER_CURRENT)
+        pbIterInitRange(it, durable, server.pb_next_seq);
+    else if (buffer == PB_BUFFER_ANOTHER)
+        pbIterInitRange(it, 0, durable);
+    else
+        pbIterInitRange(it, 0, server.pb_next_seq);
+}
+
+/* Return the next record of the iterator, oldest first, or NULL when
+ * there are no more records. The pools are merged by sequence number. */
+pb_log_record *pmemPBIterNext(pbIterator *it) {
+    pb_log_record *rec, *next = NULL;
+    int j, stripe = 0;
 
-    void *pmem_base_addr = (void *)server.pm_pool->addr;
-    while (!TOID_IS_NULL(log_toid)) {
-        TOID(struct persistent_aof_log) next_toid = D_RO_LATENCY(log_toid)->next;
-        struct persistent_aof_log *log_obj = (persistent_aof_log *)(
-                log_toid.oid.off + (uint64_t) pmem_base_addr
-        );
-        if (log_obj == NULL) {
-            TX_FREE_LATENCY(log_toid);
-            log_toid = next_toid;
+    for (j = 0; j < server.pb_stripes; j++) {
+        if ((rec = pbPeek(&server.pb_stripe[j], &it->pos[j],
+                          it->end[j])) == NULL)
+        {
+            it->pos[j] = it->end[j];
             continue;
         }
-        sds cmd = (sds)(log_obj->cmd_oid.off + (uint64_t) pmem_base_addr);
-        if (cmd == NULL) {
-            TX_FREE_LATENCY(log_toid);
-            log_toid = next_toid;
-            continue;
+        if (next == NULL || rec->seq < next->seq) {
+            next = rec;
+            stripe = j;
+        }
+    }
+    if (next == NULL || next->seq >= it->last) return NULL;
+    pmemEmulateRead(next, sizeof(*next)+next->len);
+    it->stripe = stripe;
+    it->cur = it->pos[stripe];
+    it->pos[stripe] += PB_RECORD_SIZE(next->len);
+    return next;
+}
+
+uint64_t pmemPBLogSize(void) {
+    uint64_t size = 0;
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++)
+        size += server.pb_stripe[j].log_size;
+    return size;
+}
+
+uint64_t pmemPBUsedBytes(void) {
+    uint64_t used = 0;
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++)
+        used += server.pb_stripe[j].root->pb_tail -
+                server.pb_stripe[j].root->pb_head;
+    return used;
+}
+
+/* Bytes of the records not fsynced in the AOF yet. */
+uint64_t pmemPBCurrentBytes(void) {
+    uint64_t durable = __atomic_load_n(&server.pb_root->pb_durable,
+                                       __ATOMIC_ACQUIRE);
+    uint64_t bytes = 0;
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+
+        s->durable_pos = pbSeek(s, s->durable_pos, durable);
+        bytes += s->root->pb_tail - s->durable_pos;
+    }
+    return bytes;
+}
+
+/* Bytes of the records not known to be in the AOF file. */
+uint64_t pmemPBUnsyncedBytes(void) {
+    uint64_t covered = pmemPBCoveredByAOF(), bytes = 0;
+    int j;
+
+    for (j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+
+        s->covered_pos = pbSeek(s, s->covered_pos, covered);
+        bytes += s->root->pb_tail - s->covered_pos;
+    }
+    return bytes;
+}
+
+int pmemPBActiveStripes(void) {
+    int j, active = 0;
+
+    for (j = 0; j < server.pb_stripes; j++)
+        active += server.pb_stripe[j].active;
+    return active;
+}
+
+/* ---------------------------- Fault injection ---------------------------- */
+
+#ifdef PB_FAULT_INJECTION
+static const char *pbFaultNames[PB_FAULT_POINTS] = {
+    "any", "wrap", "append-record", "append-tail", "durable", "reclaim",
+    "clear", "checkpoint", "rewrite", "replay"
+};
+
+/* Kill the server the 'count'th time the named persist point is hit from
+ * now on, or never again if 'point' is "off". Returns C_ERR if the point
+ * is unknown or the count is not positive. */
+int pmemFaultArm(const char *point, long long count) {
+    int j;
+
+    if (!strcasecmp(point, "off")) {
+        server.pb_fault_point = PB_FAULT_NONE;
+        return C_OK;
+    }
+    if (count <= 0) return C_ERR;
+    for (j = 0; j < PB_FAULT_POINTS; j++) {
+        if (!strcasecmp(point, pbFaultNames[j])) {
+            server.pb_fault_countdown = count;
+            server.pb_fault_point = j;
+            return C_OK;
         }
-        TX_FREE_LATENCY(log_toid);
-        log_toid = next_toid;
-        freed++;
     }
-    if (OID_EQUALS(head, getCurrentHead())) {
-        setCurrentHead(OID_NULL);
+    return C_ERR;
+}
+
+/* Called at every persist point. SIGKILL leaves the pools as they are at
+ * that point, without any chance to clean up. The durable watermark is
+ * persisted by the bio thread, hence the atomic countdown. */
+void pmemFaultPoint(int point) {
+    int armed = server.pb_fault_point;
+
+    if (armed == PB_FAULT_NONE || (armed != PB_FAULT_ANY && armed != point))
+        return;
+    if (__atomic_sub_fetch(&server.pb_fault_countdown, 1, __ATOMIC_RELAXED) > 0)
+        return;
+    serverLog(LL_WARNING,"PB fault injection: killed at the %s point.",
+        pbFaultNames[point]);
+    kill(getpid(), SIGKILL);
+}
+#endif
+
+/* ------------------------------ Checkpoints ------------------------------ */
+
+/* Start a checkpoint: like BGSAVE, a child process writes an RDB image of
+ * the dataset, here in a region of the first pool. The checkpoint replaces
+ * the previous one in pmemCheckpointDoneHandler() once the child is done. */
+int pmemCheckpointBackground(void) {
+    struct redis_pmem_root *root = server.pb_root;
+    struct pb_checkpoint *ckpt;
+    size_t size;
+    pid_t childpid;
+    long long start;
+
+    /* Without AOF the commands are not logged in the PB. */
+    if (server.aof_state == AOF_OFF) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    /* The dataset must not contain a part of a unit, like inside MULTI. */
+    if (server.pb_in_unit) return C_ERR;
+
+    /* The batched commands are in the dataset of the child. */
+    pmemCommitPBBatch();
+    server.pb_ckpt_time_last = server.unixtime;
+    size = server.pb_ckpt_next_size;
+    if (size == 0) size = server.pb_ckpt_len ? server.pb_ckpt_len*2 :
+                                               zmalloc_used_memory();
+    if (size < PB_CKPT_MIN_SIZE) size = PB_CKPT_MIN_SIZE;
+    if (pmemobj_alloc(server.pm_pool, &root->pb_ckpt_next,
+                      sizeof(*ckpt)+size, PM_TYPE_PB_CHECKPOINT,
+                      NULL, NULL) != 0)
+    {
+        server.pb_ckpt_last_status = C_ERR;
+        serverLog(LL_WARNING,"Can't allocate %zu bytes for a PB checkpoint: "
+            "%s", size, pmemobj_errormsg());
+        return C_ERR;
+    }
+    ckpt = pmemobj_direct(root->pb_ckpt_next);
+    ckpt->magic = 0;
+    server.pb_ckpt_next_seq = server.pb_next_seq;
+    server.pb_ckpt_next_size = size;
+
+    start = ustime();
+    if ((childpid = fork()) == 0) {
+        int error = 0;
+        rio rdb;
+
+        /* Child */
+        closeListeningSockets(0);
+        redisSetProcTitle("redis-pb-checkpoint");
+        rioInitWithPmem(&rdb, server.pm_pool, ckpt->rdb, size);
+        if (rdbSaveRio(&rdb,&error) == C_ERR || rioFlush(&rdb) == 0) {
+            serverLog(LL_WARNING,"Error writing the PB checkpoint: %s",
+                error ? strerror(error) : "the region is too small");
+            exitFromChild(1);
+        }
+        ckpt->seq = server.pb_ckpt_next_seq;
+        ckpt->len = rdb.io.pmem.pos;
+        pmemobj_persist(server.pm_pool, &ckpt->seq, sizeof(uint64_t)*2);
+        ckpt->magic = PB_CKPT_MAGIC;
+        pmemobj_persist(server.pm_pool, &ckpt->magic, sizeof(ckpt->magic));
+        exitFromChild(0);
+    } else {
+        /* Parent */
+        server.stat_fork_time = ustime()-start;
+        server.stat_fork_rate = (double) zmalloc_used_memory() * 1000000 / server.stat_fork_time / (1024*1024*1024); /* GB per second. */
+        latencyAddSampleIfNeeded("fork",server.stat_fork_time/1000);
+        if (childpid == -1) {
+            server.pb_ckpt_last_status = C_ERR;
+            pmemobj_free(&root->pb_ckpt_next);
+            serverLog(LL_WARNING,"Can't take a PB checkpoint: fork: %s",
+                strerror(errno));
+            return C_ERR;
+        }
+        serverLog(LL_NOTICE,"PB checkpoint started by pid %d",childpid);
+        server.rdb_save_time_start = time(NULL);
+        server.rdb_child_pid = childpid;
+        server.rdb_child_type = RDB_CHILD_TYPE_PMEM;
+        updateDictResizePolicy();
+        return C_OK;
+    }
+    return C_OK; /* unreached */
+}
+
+/* The checkpoint child terminated: publish the new checkpoint, which makes
+ * the records before it reclaimable. */
+void pmemCheckpointDoneHandler(int exitcode, int bysignal) {
+    struct redis_pmem_root *root = server.pb_root;
+    struct pb_checkpoint * volatile ckpt = pbCheckpointAt(root->pb_ckpt_next);
+
+    if (!bysignal && exitcode == 0 && ckpt &&
+        ckpt->seq == server.pb_ckpt_next_seq)
+    {
+        TX_BEGIN(server.pm_pool) {
+            pmemobj_tx_add_range_direct(&root->pb_ckpt, sizeof(PMEMoid)*2);
+            if (!OID_IS_NULL(root->pb_ckpt)) pmemobj_tx_free(root->pb_ckpt);
+            root->pb_ckpt = root->pb_ckpt_next;
+            root->pb_ckpt_next = OID_NULL;
+        } TX_ONABORT {
+            ckpt = NULL;
+        } TX_END
+    } else {
+        ckpt = NULL;
+    }
+
+    if (ckpt) {
+        PB_FAULT(PB_FAULT_CHECKPOINT);
+        server.pb_ckpt_seq = ckpt->seq;
+        server.pb_ckpt_len = ckpt->len;
+        server.pb_ckpt_next_size = 0;
+        server.pb_ckpt_last_status = C_OK;
+        serverLog(LL_NOTICE,"PB checkpoint of %llu bytes taken, "
+            "%llu records to replay",
+            (unsigned long long) ckpt->len,
+            (unsigned long long) (server.pb_next_seq - ckpt->seq));
     } else {
-        setAnotherHead(OID_NULL);
+        if (!OID_IS_NULL(root->pb_ckpt_next))
+            pmemobj_free(&root->pb_ckpt_next);
+        /* Most likely the region was too small. */
+        if (!bysignal) server.pb_ckpt_next_size *= 2;
+        else server.pb_ckpt_next_size = 0;
+        server.pb_ckpt_last_status = C_ERR;
+        serverLog(LL_WARNING,"PB checkpoint %s",
+            bysignal ? "terminated by signal" : "failed");
+    }
+    server.rdb_child_pid = -1;
+    server.rdb_child_type = RDB_CHILD_TYPE_NONE;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+}
+
+/* Called by serverCron(): take a checkpoint every pb-checkpoint-interval
+ * seconds, or earlier when the records kept for the checkpoint fill half
+ * of the log. */
+void pmemCheckpointCron(void) {
+    int pressure;
+
+    if (!server.persistent || server.pb_checkpoint_interval == 0 ||
+        server.aof_state == AOF_OFF || server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
+        server.pb_ckpt_seq == server.pb_next_seq) return;
+
+    pressure = pbReclaimLimit() == server.pb_ckpt_seq &&
+               pmemPBUsedBytes() > pmemPBLogSize()/2;
+    if (pressure || server.unixtime - server.pb_ckpt_time_last >=
+                    server.pb_checkpoint_interval)
+        pmemCheckpointBackground();
+}
+
+/* The checkpoint can be loaded at startup if the records appended since it
+ * was taken are all in the log. Without AOF they are not logged, and the
+ * RDB file is loaded instead. */
+int pmemCheckpointUsable(void) {
+    pb_log_record *rec;
+    pbIterator it;
+
+    if (server.pb_ckpt_seq == 0 || server.aof_state != AOF_ON) return 0;
+    if (server.pb_ckpt_seq == server.pb_next_seq) return 1;
+    pbIterInitRange(&it, server.pb_ckpt_seq, server.pb_next_seq);
+    rec = pmemPBIterNext(&it);
+    return rec && rec->seq == server.pb_ckpt_seq;
+}
+
+/* Load the dataset from the checkpoint and replay the records appended
+ * after it. The AOF file is not loaded, so it is rewritten in the
+ * background afterwards. */
+int pmemLoadCheckpoint(void) {
+    struct pb_checkpoint *ckpt = pmemobj_direct(server.pb_root->pb_ckpt);
+    long long start = ustime();
+    rio rdb;
+
+    startLoadingSize(ckpt->len);
+    rioInitWithPmem(&rdb, server.pm_pool, ckpt->rdb, ckpt->len);
+    if (rdbLoadRio(&rdb) != C_OK) {
+        stopLoading();
+        return C_ERR;
+    }
+    stopLoading();
+    serverLog(LL_NOTICE,"DB loaded from the PB checkpoint: %.3f seconds",
+        (float)(ustime()-start)/1000000);
+
+    server.aof_state = AOF_OFF;
+    if (loadAppendOnlyPersistentBuffer(server.pb_ckpt_seq) != C_OK)
+        return C_ERR;
+    close(server.aof_fd);
+    server.aof_fd = -1;
+    return startAppendOnly();
+}
+
+/* ------------------------- PMEM replication backlog ------------------------
+ * With repl-backlog-pmem the replication backlog buffer is a region of the
+ * first pool, written like the DRAM one. When a master is shut down cleanly
+ * the region is persisted and its header records the run id, the
+ * replication offsets and the number of the next PB record. If the server
+ * restarts with exactly that dataset, it takes them back: its slaves can
+ * then continue with a partial resynchronization instead of a full one.
+ *
+ * The header is invalidated once it is read and whenever the region is
+ * allocated, so a crash, which may lose writes the slaves received or the
+ * other way around, never resumes a stale stream.
+ * ------------------------------------------------------------------------- */
+
+static int pbReplBacklogInit(PMEMobjpool *pop, void *ptr, void *arg) {
+    struct pb_repl_backlog *bl = ptr;
+
+    UNUSED(arg);
+    bl->magic = 0;
+    pmemobj_persist(pop, &bl->magic, sizeof(bl->magic));
+    return 0;
+}
+
+/* Return a backlog buffer of 'size' bytes in the first pool, or NULL if it
+ * can't be allocated there. */
+char *pmemReplBacklogAlloc(size_t size) {
+    struct redis_pmem_root *root = server.pb_root;
+    struct pb_repl_backlog *bl;
+
+    if (!server.persistent) return NULL;
+    if (!OID_IS_NULL(root->pb_repl_backlog))
+        pmemobj_free(&root->pb_repl_backlog);
+    if (pmemobj_alloc(server.pm_pool, &root->pb_repl_backlog,
+                      sizeof(*bl)+size, PM_TYPE_PB_REPL_BACKLOG,
+                      pbReplBacklogInit, NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Can't allocate %zu bytes for the replication "
+            "backlog in PMEM, using DRAM: %s", size, pmemobj_errormsg());
+        return NULL;
+    }
+    bl = pmemobj_direct(root->pb_repl_backlog);
+    return bl->buf;
+}
+
+/* Free the backlog buffer 'buf' if it is in the pool. Returns 0 if it is
+ * not, so that the caller frees it. */
+int pmemReplBacklogRelease(char *buf) {
+    struct pb_repl_backlog *bl;
+
+    if (!pmemReplBacklogActive() || buf == NULL) return 0;
+    bl = pmemobj_direct(server.pb_root->pb_repl_backlog);
+    if (buf != bl->buf) return 0;
+    pmemobj_free(&server.pb_root->pb_repl_backlog);
+    return 1;
+}
+
+/* Return 1 if the replication backlog is in the pool. */
+int pmemReplBacklogActive(void) {
+    struct pb_repl_backlog *bl;
+
+    if (!server.persistent || server.repl_backlog == NULL) return 0;
+    bl = pmemobj_direct(server.pb_root->pb_repl_backlog);
+    return bl && bl->buf == server.repl_backlog;
+}
+
+/* Called on shutdown, once the dataset is durable: persist the backlog and
+ * the replication state of this master. */
+void pmemReplBacklogSave(void) {
+    struct pb_repl_backlog *bl;
+
+    if (!pmemReplBacklogActive() || server.masterhost ||
+        server.aof_state == AOF_OFF) return;
+
+    /* The commands fed to the backlog must all be in the dataset. */
+    pmemCommitPBBatch();
+    bl = pmemobj_direct(server.pb_root->pb_repl_backlog);
+    pmemobj_persist(server.pm_pool, bl->buf, server.repl_backlog_size);
+    bl->seq = server.pb_next_seq;
+    bl->master_repl_offset = server.master_repl_offset;
+    bl->size = server.repl_backlog_size;
+    bl->histlen = server.repl_backlog_histlen;
+    bl->idx = server.repl_backlog_idx;
+    bl->off = server.repl_backlog_off;
+    memcpy(bl->runid, server.runid, PB_REPL_RUNID_SIZE);
+    pmemobj_persist(server.pm_pool, bl, sizeof(*bl));
+    bl->magic = PB_REPL_MAGIC;
+    pmemobj_persist(server.pm_pool, &bl->magic, sizeof(bl->magic));
+    serverLog(LL_NOTICE,"Replication backlog saved in PMEM: run id %.*s, "
+        "offset %lld.", CONFIG_RUN_ID_SIZE, server.runid,
+        server.master_repl_offset);
+}
+
+/* Called once the dataset is loaded: take back the replication state saved
+ * on shutdown if the dataset is the one it was saved with. */
+void pmemReplBacklogRestore(void) {
+    struct redis_pmem_root *root = server.pb_root;
+    struct pb_repl_backlog *bl = pmemobj_direct(root->pb_repl_backlog);
+    const char *reason = NULL;
+
+    if (bl == NULL) return;
+    if (bl->magic != PB_REPL_MAGIC)
+        reason = "the server was not shut down cleanly";
+    else if (!server.repl_backlog_pmem)
+        reason = "repl-backlog-pmem is disabled";
+    else if (server.masterhost)
+        reason = "the server is a slave";
+    else if (server.aof_state == AOF_OFF)
+        reason = "the AOF is disabled";
+    else if (bl->seq != server.pb_next_seq)
+        reason = "the dataset changed";
+    else if (bl->size != server.repl_backlog_size)
+        reason = "repl-backlog-size changed";
+
+    if (reason) {
+        if (bl->magic == PB_REPL_MAGIC)
+            serverLog(LL_NOTICE,"Not using the replication backlog saved in "
+                "PMEM: %s.", reason);
+        pmemobj_free(&root->pb_repl_backlog);
+        return;
     }
-    TX_ADD_DIRECT_LATENCY(root);
-    root->num_logs -= freed;
+    bl->magic = 0;
+    pmemobj_persist(server.pm_pool, &bl->magic, sizeof(bl->magic));
+    memcpy(server.runid, bl->runid, CONFIG_RUN_ID_SIZE);
+    server.master_repl_offset = bl->master_repl_offset;
+    server.repl_backlog = bl->buf;
+    server.repl_backlog_histlen = bl->histlen;
+    server.repl_backlog_idx = bl->idx;
+    server.repl_backlog_off = bl->off;
+    server.repl_no_slaves_since = server.unixtime;
+    serverLog(LL_NOTICE,"Replication backlog restored from PMEM: run id "
+        "%.*s, offset %lld, %lld bytes of history.", CONFIG_RUN_ID_SIZE,
+        server.runid, server.master_repl_offset, server.repl_backlog_histlen);
 }
 
 #endif
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+#include "server.h"
+#include "obj.h"
+#include "libpmemobj.h"
+
+/* PMEM resident keyspace.
+ *
+ * The sds of a key in the pool holds the oid of its key_val_pair_PM in the
+ * slot before its header, see sdsnewlenPM(). SET writes its value to the
+ * pool directly; the keys modified by any other command are queued by
+ * signalModifiedKey() and copied to the pool by pmemKeyspaceSync() once the
+ * command returns. Every key is copied in its own transaction, allocating
+ * in the pool first and only then updating the DRAM dicts, so an abort
+ * leaves the key in DRAM and the keyspace consistent. */
+
+void slotToKeyAdd(robj *key);
+
+typedef struct pmDirtyKey {
+    redisDb *db;
+    sds key;
+} pmDirtyKey;
+
+int pmemIsPM(const void *ptr) {
+    return server.persistent && pmemobj_pool_by_ptr(ptr) == server.pm_pool;
+}
+
+static struct key_val_pair_PM *pmPair(sds key) {
+    return pmemobj_direct(*sdsPMEMoidBackReference(key));
+}
+
+/* Link a new pair for 'key' and 'val', both sds strings in the pool, at the
+ * head of the list. Must be called in a transaction. */
+void pmemKeyspaceAddPair(sds key, sds val, int dbid, long long expire) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    PMEMoid *ref = sdsPMEMoidBackReference(key);
+    TOID(struct key_val_pair_PM) pair;
+    struct key_val_pair_PM *kv;
+
+    kv = pmemSlabAlloc(sizeof(*kv));
+    pair.oid = pmemobj_oid(kv);
+    kv->pmem_list_prev.oid = OID_NULL;
+    kv->key_oid = pmemobj_oid(key);
+    kv->val_oid = pmemobj_oid(val);
+    kv->dbid = dbid;
+    kv->expire = expire;
+    kv->pmem_list_next = root->pe_first;
+    if (!TOID_IS_NULL(root->pe_first)) {
+        struct key_val_pair_PM *first = D_RW(root->pe_first);
+
+        TX_ADD_FIELD_DIRECT(first,pmem_list_prev);
+        first->pmem_list_prev = pair;
+    }
+    TX_ADD_DIRECT(root);
+    root->pe_first = pair;
+    root->num_dict_entries++;
+    TX_ADD_DIRECT(ref);
+    *ref = pair.oid;
+}
+
+/* Make the key of 'de' point to 'val', an sds string in the pool, with the
+ * current expire of the key. A key still in DRAM is copied to the pool: the
+ * copy is returned and must be installed with pmemKeyspaceInstallKey() once
+ * nothing else can abort. Must be called in a transaction. */
+sds pmemKeyspaceLink(redisDb *db, dictEntry *de, sds val) {
+    sds key = dictGetKey(de);
+    dictEntry *ede = dictFind(db->expires,key);
+    long long expire = ede ? dictGetSignedIntegerVal(ede) : -1;
+    PMEMoid val_oid = pmemobj_oid(val);
+    struct key_val_pair_PM *kv;
+
+    if (!pmemIsPM(key)) {
+        void *ref;
+
+        key = sdsdupPM(key,&ref);
+    } else if ((kv = pmPair(key)) != NULL) {
+        if (!OID_EQUALS(kv->val_oid,val_oid)) {
+            TX_ADD_FIELD_DIRECT(kv,val_oid);
+            kv->val_oid = val_oid;
+        }
+        if (kv->expire != expire) {
+            TX_ADD_FIELD_DIRECT(kv,expire);
+            kv->expire = expire;
+        }
+        return key;
+    }
+    pmemKeyspaceAddPair(key,val,db->id,expire);
+    return key;
+}
+
+/* Replace the DRAM key of 'de' with its copy in the pool. The expires dict
+ * shares the key sds with the main dict, so it is updated as well. */
+void pmemKeyspaceInstallKey(redisDb *db, dictEntry *de, sds key) {
+    sds old = dictGetKey(de);
+    dictEntry *ede;
+
+    if (key == old) return;
+    ede = dictFind(db->expires,old);
+    de->key = key;
+    if (ede) ede->key = key;
+    sdsfree(old);
+}
+
+/* Remove the pair of 'key', if any, from the list. The key itself is not
+ * freed. Must be called in a transaction. */
+void pmemKeyspaceUnlink(sds key) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    PMEMoid *ref = sdsPMEMoidBackReference(key);
+    TOID(struct key_val_pair_PM) pair;
+    struct key_val_pair_PM *kv;
+
+    if (OID_IS_NULL(*ref)) return;
+    pair.oid = *ref;
+    kv = D_RW(pair);
+    if (TOID_IS_NULL(kv->pmem_list_prev)) {
+        TX_ADD_FIELD_DIRECT(root,pe_first);
+        root->pe_first = kv->pmem_list_next;
+    } else {
+        struct key_val_pair_PM *prev = D_RW(kv->pmem_list_prev);
+
+        TX_ADD_FIELD_DIRECT(prev,pmem_list_next);
+        prev->pmem_list_next = kv->pmem_list_next;
+    }
+    if (!TOID_IS_NULL(kv->pmem_list_next)) {
+        struct key_val_pair_PM *next = D_RW(kv->pmem_list_next);
+
+        TX_ADD_FIELD_DIRECT(next,pmem_list_prev);
+        next->pmem_list_prev = kv->pmem_list_prev;
+    }
+    TX_ADD_FIELD_DIRECT(root,num_dict_entries);
+    root->num_dict_entries--;
+    pmemSlabFree(kv);
+    TX_ADD_DIRECT(ref);
+    *ref = OID_NULL;
+}
+
+/* The value of 'key' is about to be replaced by one not in the pool yet:
+ * clear the reference to the old one, that is going to be freed. A pair
+ * without value is dropped at startup. Must be called in a transaction. */
+void pmemKeyspaceDetachValue(sds key) {
+    struct key_val_pair_PM *kv = pmPair(key);
+
+    if (kv == NULL) return;
+    TX_ADD_FIELD_DIRECT(kv,val_oid);
+    kv->val_oid = OID_NULL;
+}
+
+/* Queue 'key' to be copied to the pool after the current command. */
+void pmemKeyspaceTouch(redisDb *db, robj *key) {
+    pmDirtyKey *dk;
+    robj *decoded;
+
+    if (!server.persistent || server.loading) return;
+    dk = zmalloc(sizeof(*dk));
+    decoded = getDecodedObject(key);
+    dk->db = db;
+    dk->key = sdsdup(decoded->ptr);
+    decrRefCount(decoded);
+    listAddNodeTail(server.pm_dirty_keys,dk);
+}
+
+static void pmSyncEntry(redisDb *db, dictEntry *de) {
+    robj *val = dictGetVal(de);
+    robj * volatile newval = NULL;
+    sds key = dictGetKey(de);
+
+    if (val->type != OBJ_STRING) {
+        /* Only strings are kept in the pool. */
+        if (pmemIsPM(key) && pmPair(key) != NULL) {
+            TX_BEGIN(server.pm_pool) {
+                pmemKeyspaceUnlink(key);
+            } TX_END
+        }
+        return;
+    }
+
+    if (val->encoding == OBJ_ENCODING_RAW && pmemIsPM(val->ptr) &&
+        pmemIsPM(key))
+    {
+        struct key_val_pair_PM *kv = pmPair(key);
+        dictEntry *ede = dictFind(db->expires,key);
+        long long expire = ede ? dictGetSignedIntegerVal(ede) : -1;
+
+        /* Already written by SET. */
+        if (kv && kv->expire == expire &&
+            OID_EQUALS(kv->val_oid,pmemobj_oid(val->ptr))) return;
+    }
+
+    server.stat_pm_tx_started++;
+    TX_BEGIN(server.pm_pool) {
+        if (val->encoding != OBJ_ENCODING_RAW || !pmemIsPM(val->ptr))
+            newval = dupStringObjectPM(val);
+        key = pmemKeyspaceLink(db,de,newval ? newval->ptr : val->ptr);
+        pmemKeyspaceInstallKey(db,de,key);
+        if (newval) {
+            dictSetVal(db->dict,de,newval);
+            decrRefCount(val);
+        }
+    } TX_ONABORT {
+        server.stat_pm_tx_aborted++;
+        if (newval) zfree(newval);
+        serverLog(LL_WARNING,"Can't copy key '%s' to PMEM: %s",
+            (char*)dictGetKey(de), pmemobj_errormsg());
+    } TX_END
+}
+
+/* Copy the keys modified by the last command to the pool. */
+void pmemKeyspaceSync(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.pm_dirty_keys)) != NULL) {
+        pmDirtyKey *dk = listNodeValue(ln);
+        dictEntry *de = dictFind(dk->db->dict,dk->key);
+
+        if (de) pmSyncEntry(dk->db,de);
+        sdsfree(dk->key);
+        zfree(dk);
+        listDelNode(server.pm_dirty_keys,ln);
+    }
+}
+
+/* Copy the whole keyspace to the pool, after loading an AOF or RDB file. */
+void pmemKeyspaceSyncAll(void) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dictIterator *di = dictGetSafeIterator(server.db[j].dict);
+        dictEntry *de;
+
+        while ((de = dictNext(di)) != NULL) pmSyncEntry(server.db+j,de);
+        dictReleaseIterator(di);
+    }
+}
+
+/* Rebuild the keyspace from the pairs in the pool. The dicts point straight
+ * to the sds strings in the pool, nothing is copied. The slots of the slabs
+ * that are not reachable from the pairs are freed on the way. */
+int pmemKeyspaceReconstruct(void) {
+    TOID(struct key_val_pair_PM) pair = D_RO(server.pm_rootoid)->pe_first;
+    long long keys = 0, dropped = 0;
+
+    pmemSlabRebuildBegin();
+    while (!TOID_IS_NULL(pair)) {
+        const struct key_val_pair_PM *kv = D_RO(pair);
+        sds key = pmemobj_direct(kv->key_oid);
+        redisDb *db;
+        robj *val;
+
+        pair = kv->pmem_list_next;
+        if (key == NULL || kv->dbid >= (uint64_t)server.dbnum) {
+            serverLog(LL_WARNING,"Corrupted key in the PMEM keyspace.");
+            return C_ERR;
+        }
+        if (OID_IS_NULL(kv->val_oid)) {
+            /* The server was stopped while replacing the value. */
+            TX_BEGIN(server.pm_pool) {
+                pmemKeyspaceUnlink(key);
+                sdsfreePM(key);
+            } TX_END
+            dropped++;
+            continue;
+        }
+        db = server.db+kv->dbid;
+        val = createObject(OBJ_STRING,pmemobj_direct(kv->val_oid));
+        pmemSlabMark((void*)kv);
+        pmemSlabMark(sdsPMEMoidBackReference(key));
+        pmemSlabMark(sdsPMEMoidBackReference(val->ptr));
+        if (dictAdd(db->dict,key,val) != DICT_OK) {
+            serverLog(LL_WARNING,"Duplicated key '%s' in the PMEM keyspace.",
+                key);
+            return C_ERR;
+        }
+        if (kv->expire != -1) {
+            dictEntry *de = dictReplaceRaw(db->expires,key);
+
+            dictSetSignedIntegerVal(de,kv->expire);
+        }
+        if (server.cluster_enabled) {
+            robj keyobj;
+
+            initStaticStringObject(keyobj,key);
+            slotToKeyAdd(&keyobj);
+        }
+        keys++;
+    }
+    pmemSlabRebuildEnd();
+    serverLog(LL_NOTICE,"PMEM keyspace: %lld keys loaded, %lld dropped",
+        keys, dropped);
+    return C_OK;
+}
+
+/* Drop the whole keyspace, before it is loaded from the AOF or RDB file.
+ * The list is detached first, then the strings over the largest slab class
+ * are freed and the slabs are released at once. */
+void pmemKeyspaceClear(void) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    TOID(struct key_val_pair_PM) pair = root->pe_first;
+    volatile int error = 0;
+
+    TX_BEGIN(server.pm_pool) {
+        TX_ADD_DIRECT(root);
+        root->pe_first.oid = OID_NULL;
+        root->num_dict_entries = 0;
+    } TX_ONABORT {
+        serverLog(LL_WARNING,"Can't clear the PMEM keyspace: %s",
+            pmemobj_errormsg());
+        error = 1;
+    } TX_END
+    if (error) return;
+
+    while (!TOID_IS_NULL(pair)) {
+        const struct key_val_pair_PM *kv = D_RO(pair);
+        PMEMoid oids[2] = {kv->key_oid, kv->val_oid};
+        int j;
+
+        pair = kv->pmem_list_next;
+        for (j = 0; j < 2; j++) {
+            PMEMoid obj;
+
+            if (OID_IS_NULL(oids[j])) continue;
+            obj = pmemobj_oid(sdsPMEMoidBackReference(pmemobj_direct(oids[j])));
+            if (!pmemSlabOwns(pmemobj_direct(obj))) pmemobj_free(&obj);
+        }
+    }
+    pmemSlabReleaseAll();
+}
+#endif
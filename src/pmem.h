@@ -36,20 +36,291 @@
 #ifdef USE_PB
 
 // Alias: PB
-typedef struct persistent_aof_log {
-    PMEMoid cmd_oid;
-    TOID(struct persistent_aof_log) next;
-    TOID(struct persistent_aof_log) prev;
-} persistent_aof_log;
+/* The persistent buffer is a fixed size circular log allocated once in the
+ * pool. Records are appended at the tail with a single flush + drain and
+ * the tail position is persisted afterwards, so neither the allocator nor a
+ * transaction is involved in the hot path.
+ *
+ * Positions (head, tail) are logical byte offsets that only grow; the
+ * physical offset inside the log is (pos % log size). Every record starts
+ * on a cache line boundary. A record that doesn't fit before the end of the
+ * log is preceded by a PB_RECORD_WRAP marker filling the gap.
+ *
+ * The log can be striped across several pools, each one with a log of its
+ * own: every record goes to a single pool and records are numbered across
+ * all of them, so the pools are merged by sequence number when they are
+ * read back. The watermarks shared by the pools (durable, AOF base, drain)
+ * are sequence numbers, kept in the root of the first pool. */
+#define PB_LOG_VERSION 0x3530766c6f6c6270ULL /* "pblolv05" */
+#define PB_RECORD_MAGIC 0x52425000 /* "\0PBR" */
+#define PB_RECORD_WRAP 0x57425000 /* "\0PBW" */
+#define PB_RECORD_ALIGN 64
+#define PB_RECORD_SIZE(len) \
+    (((sizeof(struct pb_log_record)+(len))+PB_RECORD_ALIGN-1) & \
+     ~((uint64_t)PB_RECORD_ALIGN-1))
+
+typedef struct pb_log_record {
+    uint32_t magic;     /* PB_RECORD_MAGIC or PB_RECORD_WRAP. */
+    uint32_t len;       /* Payload length. */
+    uint64_t seq;       /* Sequence number, increasing in commit order. */
+    uint64_t aof_off;   /* AOF file offset right after the commands, 0 when
+                           the commands are not written to the AOF file. */
+    int32_t dictid;     /* DB selected when the first command runs. */
+    uint32_t flags;     /* PB_RECORD_* flags. */
+    uint32_t aof_len;   /* Length of the commands in the AOF format. */
+    uint32_t raw_len;   /* Payload length before compression, if LZF. */
+    uint64_t checksum;  /* CRC64 of the payload of binary or LZF records. */
+    char payload[];     /* Command(s), AOF formatted unless binary. */
+} pb_log_record;
+
+/* Record flags. */
+#define PB_RECORD_BINARY (1<<0) /* Payload in the binary encoding. */
+#define PB_RECORD_LZF (1<<1)    /* Payload compressed with LZF. */
+
+/* Record encodings (pb-record-encoding). The binary encoding of a command
+ * is a sequence of varints:
+ *
+ *   <argc> <command> <arg 1> ... <arg argc-1>
+ *
+ * <command> is the index of the command in the command table plus one, or 0
+ * followed by the name encoded as a string argument. Each argument starts
+ * with a tag: 0 introduces an integer in its canonical form (what
+ * string2ll() accepts) stored as a zigzag varint, any other tag is the
+ * length plus one of the string bytes that follow. */
+#define PB_ENCODING_RESP 0
+#define PB_ENCODING_BINARY 1
+#define PB_BINARY_ARG_INT 0
+
+static inline size_t pbVarintEncode(unsigned char *buf, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+/* Decode a varint at *p, not reading past 'end'. Returns 0 if it is
+ * truncated or too long. */
+static inline int pbVarintDecode(const char **p, const char *end, uint64_t *v) {
+    const unsigned char *s = (const unsigned char*)*p;
+    uint64_t val = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if ((const char*)s >= end) return 0;
+        val |= (uint64_t)(*s & 0x7f) << shift;
+        if (!(*s++ & 0x80)) {
+            *p = (const char*)s;
+            *v = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Records before the durable watermark are fsynced in the AOF: they are the
+ * "another" buffer and their space can be reclaimed. The records after it,
+ * up to the tail, are the "current" buffer. The watermark is advanced by
+ * whoever fsyncs the AOF (usually the bio thread) while the head is only
+ * moved by the main thread, lazily, when the log runs out of space. */
+#define PB_BUFFER_CURRENT 0
+#define PB_BUFFER_ANOTHER 1
+#define PB_BUFFER_ALL 2
+
+/* Group commit staging buffer space kept across event loop iterations. */
+#define PB_BATCH_MAX_IDLE_ALLOC (64*1024)
+
+/* Buckets of the append latency histogram, see pbLatencyBucket(). */
+#define PB_LATENCY_BUCKETS 128
+
+/* What happens to writes when the records not fsynced in the AOF reach
+ * pb-max-memory (pb-max-memory-policy). */
+#define PB_MAXMEMORY_FSYNC 0    /* Fsync the AOF and reclaim synchronously. */
+#define PB_MAXMEMORY_THROTTLE 1 /* Block the writers until the background
+                                   fsync catches up. */
+#define PB_MAXMEMORY_REJECT 2   /* Refuse the writes. */
+
+/* Writers throttled longer than this get the AOF fsynced synchronously. */
+#define PB_THROTTLE_MAX_MS 1000
 
+/* Threads parsing the records at startup (pb-load-threads). */
+#define PB_LOAD_MAX_THREADS 16
+
+/* Records written to the AOF with a single writev() in drain mode. */
+#define PB_DRAIN_IOV 256
+
+/* Pools of a stripe set (pmfile with several pools). */
+#define PB_MAX_STRIPES 8
+
+/* Pools taking new records (pb-stripe-policy). */
+#define PB_STRIPE_ROUND_ROBIN 0 /* All of them, in turn. */
+#define PB_STRIPE_NUMA_LOCAL 1  /* The ones on the NUMA node of the server,
+                                   if any. */
+#define PB_STRIPE_SHARD 2       /* The pool of the DB, or of the range of
+                                   hash slots in cluster mode. */
+
+typedef struct pbStripe {
+    char *path;                 /* Pool file or poolset file. */
+    size_t size;                /* Size of the pool to create. */
+    int created;                /* The pool was created by this server. */
+    int numa_node;              /* NUMA node of the pool, -1 if unknown. */
+    int active;                 /* New records may be appended here. */
+    PMEMobjpool *pool;
+    struct redis_pmem_root *root;
+    char *log;
+    uint64_t log_size;
+    /* First record numbered at or after the durable and the covered (see
+     * pmemPBCoveredByAOF()) watermarks, moved forward lazily. */
+    uint64_t durable_pos;
+    uint64_t covered_pos;
+} pbStripe;
+
+typedef struct pbIterator {
+    uint64_t pos[PB_MAX_STRIPES];   /* Next record of every pool. */
+    uint64_t end[PB_MAX_STRIPES];
+    uint64_t last;      /* Records numbered from here on are not returned. */
+    int stripe;         /* Pool of the record returned last... */
+    uint64_t cur;       /* ...and its position there. */
+} pbIterator;
+
+/* A checkpoint is an RDB image of the dataset written by a child process in
+ * a region of the first pool (see pmemCheckpointBackground()), the header
+ * being persisted last. The records numbered from 'seq' on were appended
+ * after the fork and are kept in the log, so that at startup the checkpoint
+ * is loaded and only those records are replayed. */
+#define PB_CKPT_MAGIC 0x54504b43 /* "CKPT" */
+#define PB_CKPT_MIN_SIZE (1024*1024)
+
+struct pb_checkpoint {
+    uint32_t magic;     /* PB_CKPT_MAGIC once the image is complete. */
+    uint32_t reserved;
+    uint64_t seq;       /* First record not in the image. */
+    uint64_t len;       /* Length of the image. */
+    uint64_t pad[5];
+    char rdb[];
+};
+
+/* With repl-backlog-pmem the replication backlog buffer is a region of the
+ * first pool (see pmemReplBacklogAlloc()). The header is only valid after a
+ * clean shutdown of a master, and only until the next startup. */
+#define PB_REPL_MAGIC 0x4c504552 /* "REPL" */
+#define PB_REPL_RUNID_SIZE 40    /* CONFIG_RUN_ID_SIZE */
+
+struct pb_repl_backlog {
+    uint32_t magic;     /* PB_REPL_MAGIC once the backlog is saved. */
+    uint32_t reserved;
+    uint64_t seq;       /* Next record number when the backlog was saved. */
+    int64_t master_repl_offset;
+    int64_t size;       /* server.repl_backlog_* */
+    int64_t histlen;
+    int64_t idx;
+    int64_t off;
+    char runid[PB_REPL_RUNID_SIZE];
+    char buf[];
+};
+
+/* Persist points where a build with PB_FAULT_INJECTION=yes can kill the
+ * server on demand (DEBUG PB-FAULT, pb-fault-inject), to check and time the
+ * recovery from a crash at each of them. */
+#define PB_FAULT_NONE -1
+#define PB_FAULT_ANY 0          /* Any of the following. */
+#define PB_FAULT_WRAP 1         /* WRAP marker flushed, not the record. */
+#define PB_FAULT_APPEND_RECORD 2 /* Record persisted, not the tail. */
+#define PB_FAULT_APPEND_TAIL 3  /* Tail persisted. */
+#define PB_FAULT_DURABLE 4      /* Durable watermark persisted. */
+#define PB_FAULT_RECLAIM 5      /* Head of a pool persisted. */
+#define PB_FAULT_CLEAR 6        /* Tail of a pool reset by a clear. */
+#define PB_FAULT_CHECKPOINT 7   /* New checkpoint published. */
+#define PB_FAULT_REWRITE 8      /* AOF base persisted after a rewrite. */
+#define PB_FAULT_REPLAY 9       /* Record replayed at startup. */
+#define PB_FAULT_POINTS 10
+
+#ifdef PB_FAULT_INJECTION
+#define PB_FAULT(point) pmemFaultPoint(point)
+int pmemFaultArm(const char *point, long long count);
+void pmemFaultPoint(int point);
+#else
+#define PB_FAULT(point)
+#endif
+
+int pmemInitPBLog(void);
 int pmemReconstructPB(void);
-PMEMoid getCurrentHead();
-PMEMoid getAnotherHead();
-void setCurrentHead(PMEMoid new_head_oid);
-void setAnotherHead(PMEMoid new_head_oid);
-PMEMoid pmemAddToPBList(void *cmd);
-void pmemSwitchDoubleBuffer();
-void pmemClearPBList(PMEMoid head);
+int pmemCheckpointBackground(void);
+void pmemCheckpointDoneHandler(int exitcode, int bysignal);
+void pmemCheckpointCron(void);
+int pmemCheckpointUsable(void);
+int pmemLoadCheckpoint(void);
+int pmemAddToPBList(const char *cmd, size_t len, int dictid);
+void pmemLogCommand(const char *cmd, size_t len, int dictid, int shard);
+void pmemSplitPBBatch(int shard, int unit);
+void pmemCommitPBBatch(void);
+void pmemBeginPBUnit(void);
+void pmemEndPBUnit(void);
+uint64_t pmemPBWatermark(void);
+void pmemPBSetDurable(uint64_t pos);
+void pmemPBRewriteDone(void);
+int pmemPBDrainsAOF(void);
+ssize_t pmemPBWriteAOF(int fd);
+void pmemPBConsumeAOF(size_t written);
+uint64_t pmemPBCoveredByAOF(void);
+void pmemSwitchDoubleBuffer(void);
+void pmemClearPBList(int buffer);
+void pmemPBIterInit(pbIterator *it, int buffer);
+pb_log_record *pmemPBIterNext(pbIterator *it);
+uint64_t pmemPBLogSize(void);
+uint64_t pmemPBUsedBytes(void);
+uint64_t pmemPBCurrentBytes(void);
+uint64_t pmemPBUnsyncedBytes(void);
+int pmemPBActiveStripes(void);
+int pmemPBHasRoom(size_t len, int shard);
+int pmemPBDecompress(pb_log_record *rec, char *buf);
+int pmemPBOverLimit(void);
+int pmemPBForceSync(void);
+void pmemPBRequestFsync(void);
+void pmemPBReclaimCron(void);
+uint64_t pmemPBAppendLatency(double percentile);
+long long pmemPBRecordCount(void);
+char *pmemReplBacklogAlloc(size_t size);
+int pmemReplBacklogRelease(char *buf);
+int pmemReplBacklogActive(void);
+void pmemReplBacklogSave(void);
+void pmemReplBacklogRestore(void);
+#else
+
+/* PMEM resident keyspace: every string key has a pair in the pool pointing
+ * to its key and value sds, allocated in the pool as well, and linked in a
+ * list from the root object. The dict entries of the DBs point to the same
+ * sds strings, so at startup the keyspace is rebuilt by walking the list,
+ * without copying any data. Keys of the other types only live in DRAM. */
+struct key_val_pair_PM {
+    PMEMoid key_oid;    /* Key sds, in the pool. */
+    PMEMoid val_oid;    /* Value sds, in the pool. OID_NULL while the value
+                           is being replaced. */
+    uint64_t dbid;
+    int64_t expire;     /* Unix time in milliseconds, -1 if none. */
+    TOID(struct key_val_pair_PM) pmem_list_next;
+    TOID(struct key_val_pair_PM) pmem_list_prev;
+};
+
+/* Pairs and strings up to PM_SLAB_MAX_SLOT bytes are carved out of chunks
+ * of PM_SLAB_CHUNK_SIZE bytes, every chunk holding slots of a single size
+ * class. Chunks are linked from the root object, and a bit per slot tells
+ * if the slot is in use. See pmem_slab.c. */
+#define PM_SLAB_MAGIC 0x42414c53 /* "SLAB" */
+#define PM_SLAB_CHUNK_SIZE (256*1024)
+#define PM_SLAB_MAX_SLOT 4096
+
+struct pm_slab_chunk {
+    uint32_t magic;     /* PM_SLAB_MAGIC */
+    uint32_t slot_size;
+    uint32_t slots;
+    uint32_t slots_off; /* Offset of the first slot from the chunk start */
+    TOID(struct pm_slab_chunk) next;
+    uint64_t bitmap[];  /* Set bits are slots in use. */
+};
 #endif
 
 #endif
@@ -1,28 +1,161 @@
-
 #ifdef USE_PB
 #include "server.h"
 #include "obj.h"
 #include "libpmemobj.h"
 #include "util.h"
+#include "pmem_latency.h"
 
 #include <time.h>
 
-void emulateReadLatency(void) {
-    struct timespec base = nstimespec();
-    base.tv_nsec += server.pm_read_latency;
-    while (nstimeCompare(base, nstimespec()) == 1) {
-        // serverLog(LL_PB, "read latency loop");
-        true;
+/* Emulation of persistent memory on DRAM.
+ *
+ * Every access is charged the media latency once, plus the time needed to
+ * transfer the blocks it touches at the configured bandwidth. Blocks are
+ * pm-granularity bytes (3D XPoint reads and writes 256 bytes internally), so
+ * a small or misaligned write costs a whole block. The transfers of all the
+ * threads share the media: the bandwidth is a cap, not a per call delay.
+ *
+ * Delays are spun on the TSC, calibrated at startup, since clock_gettime()
+ * costs about as much as the latencies being emulated. */
+
+static struct pmProfile {
+    int id;
+    char *name;
+    size_t read_latency;        /* ns */
+    size_t write_latency;       /* ns */
+    size_t read_bandwidth;      /* MB/s, 0 is unlimited */
+    size_t write_bandwidth;     /* MB/s, 0 is unlimited */
+    size_t granularity;         /* bytes */
+} pmProfiles[] = {
+    {PM_PROFILE_DRAM, "dram", 0, 0, 0, 0, 64},
+    {PM_PROFILE_PCM, "pcm", 0, 450, 0, 1000, 64},
+    {PM_PROFILE_3DXPOINT_MM, "3dxpoint-mm", 50, 50, 6600, 2300, 256},
+    {PM_PROFILE_3DXPOINT_SM, "3dxpoint-sm", 150, 150, 6600, 2300, 256},
+    {PM_PROFILE_CUSTOM, "custom", 0, 0, 0, 0, 0}
+};
+
+static double pmCyclesPerNs = 1;
+static uint64_t pmReadBusyUntil;       /* Media busy reading until (cycles) */
+static uint64_t pmWriteBusyUntil;      /* Media busy writing until (cycles) */
+
+static uint64_t pmNanoseconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t pmCycles(void) {
+    uint32_t lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#define pmPause() __asm__ __volatile__ ("pause")
+#else
+#define pmCycles() pmNanoseconds()
+#define pmPause()
+#endif
+
+/* Measure the TSC frequency against the monotonic clock. */
+void pmemLatencyInit(void) {
+    uint64_t ns, cycles, start_ns = pmNanoseconds(), start = pmCycles();
+
+    while ((ns = pmNanoseconds() - start_ns) < 10000000) pmPause();
+    cycles = pmCycles() - start;
+    pmCyclesPerNs = (double)cycles/ns;
+    if (pmCyclesPerNs <= 0) pmCyclesPerNs = 1;
+
+    serverLog(LL_NOTICE,"PMEM emulation: profile %s, read %zu ns %zu MB/s, "
+        "write %zu ns %zu MB/s, %zu bytes blocks, TSC at %.3f GHz",
+        pmemLatencyProfileName(),
+        server.pm_read_latency, server.pm_read_bandwidth,
+        server.pm_write_latency, server.pm_write_bandwidth,
+        server.pm_granularity, pmCyclesPerNs);
+}
+
+/* Set the emulation parameters of the named profile. Returns C_ERR if
+ * there is no such profile. */
+int pmemLatencySetProfile(const char *name) {
+    struct pmProfile *p;
+
+    for (p = pmProfiles; p->id != PM_PROFILE_CUSTOM; p++) {
+        if (!strcasecmp(p->name, name)) {
+            server.pm_profile = p->id;
+            server.pm_read_latency = p->read_latency;
+            server.pm_write_latency = p->write_latency;
+            server.pm_read_bandwidth = p->read_bandwidth;
+            server.pm_write_bandwidth = p->write_bandwidth;
+            server.pm_granularity = p->granularity;
+            return C_OK;
+        }
     }
+    return C_ERR;
 }
 
-void emulateWriteLatency(void) {
-    struct timespec base = nstimespec();
-    base.tv_nsec += server.pm_write_latency;
-    while (nstimeCompare(base, nstimespec()) == 1) {
-        // serverLog(LL_PB, "write latency loop");
-        true;
+const char *pmemLatencyProfileName(void) {
+    struct pmProfile *p = pmProfiles;
+
+    while (p->id != PM_PROFILE_CUSTOM && p->id != server.pm_profile) p++;
+    return p->name;
+}
+
+double pmemLatencyTscGhz(void) {
+    return pmCyclesPerNs;
+}
+
+/* Cheap clock for the hot path statistics. */
+uint64_t pmemLatencyNanoseconds(void) {
+    return pmCycles()/pmCyclesPerNs;
+}
+
+/* Spin for the latency plus the transfer of the blocks spanned by
+ * [addr, addr+len) once the media is free. */
+static void pmDelay(uint64_t *busy, size_t latency, size_t bandwidth,
+                    const void *addr, size_t len)
+{
+    uint64_t now, start, end, gran = server.pm_granularity;
+
+    if (latency == 0 && bandwidth == 0) return;
+    now = pmCycles();
+    end = now;
+    if (bandwidth) {
+        uintptr_t first = (uintptr_t)addr & ~(gran-1);
+        uintptr_t last = ((uintptr_t)addr + (len ? len : 1) + gran-1) &
+                         ~(gran-1);
+        /* One MB/s is 1000 ns per byte. */
+        uint64_t xfer = (last-first)*1000*pmCyclesPerNs/bandwidth;
+        uint64_t prev = __atomic_load_n(busy, __ATOMIC_RELAXED);
+
+        do {
+            start = prev > now ? prev : now;
+            end = start + xfer;
+        } while (!__atomic_compare_exchange_n(busy, &prev, end, 1,
+                 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
+    end += latency*pmCyclesPerNs;
+    while (pmCycles() < end) pmPause();
+}
+
+void pmemEmulateRead(const void *addr, size_t len) {
+    pmDelay(&pmReadBusyUntil, server.pm_read_latency,
+            server.pm_read_bandwidth, addr, len);
+}
+
+/* Charge the flush of [addr, addr+len) to the media. */
+void pmemEmulateWrite(const void *addr, size_t len) {
+    pmDelay(&pmWriteBusyUntil, server.pm_write_latency,
+            server.pm_write_bandwidth, addr, len);
+}
+
+/* Access of a single block at an unknown address. */
+void emulateReadLatency(void) {
+    pmemEmulateRead(NULL, 1);
+}
+
+void emulateWriteLatency(void) {
+    pmemEmulateWrite(NULL, 1);
 }
 
 void *pmemobj_direct_latency(PMEMoid oid) {
@@ -31,12 +164,19 @@ void *pmemobj_direct_latency(PMEMoid oid) {
 }
 
 PMEMoid pmemobj_tx_zalloc_latency(size_t size, uint64_t type_num) {
-    emulateWriteLatency();
-    return pmemobj_tx_zalloc(size, type_num);
+    PMEMoid oid;
+
+    /* The object is zeroed. */
+    pmemEmulateWrite(NULL, size);
+    oid = pmemobj_tx_zalloc(size, type_num);
+    if (!OID_IS_NULL(oid))
+        server.stat_pm_allocated += pmemobj_alloc_usable_size(oid);
+    return oid;
 }
 
 int pmemobj_tx_free_latency(PMEMoid oid) {
     emulateWriteLatency();
+    server.stat_pm_allocated -= pmemobj_alloc_usable_size(oid);
     return pmemobj_tx_free(oid);
 }
-#endif
\ No newline at end of file
+#endif
@@ -34,6 +34,20 @@
 #include "libpmemobj.h"
 
 #ifdef USE_PB
+/* Profiles of the emulated persistent memory, see pm-profile. */
+#define PM_PROFILE_CUSTOM 0
+#define PM_PROFILE_DRAM 1
+#define PM_PROFILE_PCM 2
+#define PM_PROFILE_3DXPOINT_MM 3
+#define PM_PROFILE_3DXPOINT_SM 4
+
+void pmemLatencyInit(void);
+int pmemLatencySetProfile(const char *name);
+const char *pmemLatencyProfileName(void);
+double pmemLatencyTscGhz(void);
+uint64_t pmemLatencyNanoseconds(void);
+void pmemEmulateRead(const void *addr, size_t len);
+void pmemEmulateWrite(const void *addr, size_t len);
 void emulateReadLatency(void);
 void emulateWriteLatency(void);
 
@@ -42,15 +56,15 @@ PMEMoid pmemobj_tx_zalloc_latency(size_t size, uint64_t type_num);
 int pmemobj_tx_free_latency(PMEMoid oid);
 
 #define D_RW_LATENCY(o) ({\
-    emulateReadLatency();\
+    pmemEmulateRead(NULL, sizeof(*D_RO(o)));\
     D_RW(o);\
 })
 #define D_RO_LATENCY(o) ({\
-    emulateReadLatency();\
+    pmemEmulateRead(NULL, sizeof(*D_RO(o)));\
     D_RO(o);\
 })
 #define TX_ADD_DIRECT_LATENCY(o) ({\
-    emulateWriteLatency();\
+    pmemEmulateWrite((o), sizeof(*(o)));\
     TX_ADD_DIRECT(o);\
 })
 #define TX_FREE_LATENCY(o) ({\
@@ -58,7 +72,7 @@ int pmemobj_tx_free_latency(PMEMoid oid);
     TX_FREE(o);\
 })
 #define TX_ADD_FIELD_DIRECT_LATENCY(o, field) ({\
-    emulateWriteLatency();\
+    pmemEmulateWrite(&(o)->field, sizeof((o)->field));\
     TX_ADD_FIELD_DIRECT(o, field);\
 })
 #endif
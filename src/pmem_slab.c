@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2017, Andreas Bluemle <andreas dot bluemle at itxperts dot de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(USE_PMDK) && !defined(USE_PB)
+#include "server.h"
+#include "obj.h"
+#include "libpmemobj.h"
+
+/* Slab allocator for the PMEM keyspace.
+ *
+ * Pairs and short strings are the bulk of the allocations of the keyspace,
+ * and every one of them used to go through the transactional heap of
+ * libpmemobj. Here they are carved out of chunks, each holding the slots of
+ * one size class, with a bit per slot in the chunk header. Allocating or
+ * freeing a slot only flips its bit, logged in the transaction of the
+ * caller, so an abort gives the slot back as well.
+ *
+ * Chunks are reserved with an atomic allocation that also links them at
+ * the head of the list in the root object. They are not rolled back by the
+ * transaction that needed them: an empty chunk is just released later by
+ * pmemSlabCron(). The bitmaps are rebuilt at startup from the pairs that
+ * are reachable from the root, which reclaims whatever was left behind.
+ *
+ * Everything else lives in DRAM: per class, the list of chunks and a count
+ * of their free slots. The count is a hint, as aborted transactions make it
+ * drift, and it is recomputed from the bitmap by the cron. To find the
+ * chunk of a slot, the pool is split in windows of the chunk size, every
+ * window pointing to the (at most two) chunks overlapping it. */
+
+#define PM_SLAB_WINDOW_SHIFT 18
+#define PM_SLAB_CRON_CHUNKS 64      /* Chunks visited per pmemSlabCron() */
+
+typedef struct pmSlabChunk {
+    struct pm_slab_chunk *pm;
+    int cls;
+    uint32_t free;                  /* Free slots, a hint. */
+    uint32_t hint;                  /* Bitmap word to scan first. */
+    struct pmSlabChunk *prev, *next; /* Same order as the list in the pool */
+} pmSlabChunk;
+
+static const uint32_t pmSlabClasses[] = {
+    32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 640, 768,
+    1024, 1280, 1536, 2048, 3072, 4096
+};
+#define PM_SLAB_CLASSES (sizeof(pmSlabClasses)/sizeof(pmSlabClasses[0]))
+
+static struct {
+    pmSlabChunk *first;             /* All the chunks */
+    pmSlabChunk *current[PM_SLAB_CLASSES]; /* Last chunk allocated from */
+    pmSlabChunk **windows;          /* Two entries per window */
+    size_t nwindows;
+    size_t chunks;
+    pmSlabChunk *cron_cursor;
+} pmSlab;
+
+static int pmSlabClass(size_t size) {
+    int j;
+
+    for (j = 0; j < (int)PM_SLAB_CLASSES; j++)
+        if (pmSlabClasses[j] >= size) return j;
+    return -1;
+}
+
+static inline uint32_t pmSlabWords(const struct pm_slab_chunk *pm) {
+    return (pm->slots+63)/64;
+}
+
+static inline char *pmSlabSlot(const pmSlabChunk *c, uint32_t slot) {
+    return (char*)c->pm + c->pm->slots_off + (size_t)slot*c->pm->slot_size;
+}
+
+static uint32_t pmSlabCountFree(const struct pm_slab_chunk *pm) {
+    uint32_t used = 0, w;
+
+    for (w = 0; w < pmSlabWords(pm); w++)
+        used += __builtin_popcountll(pm->bitmap[w]);
+    return pm->slots - used;
+}
+
+static void pmSlabWindowsUpdate(pmSlabChunk *c, pmSlabChunk *to) {
+    uintptr_t start = (char*)c->pm - (char*)server.pm_pool;
+    size_t w, last = (start+PM_SLAB_CHUNK_SIZE-1) >> PM_SLAB_WINDOW_SHIFT;
+
+    for (w = start >> PM_SLAB_WINDOW_SHIFT; w <= last; w++) {
+        serverAssert(w < pmSlab.nwindows);
+        if (pmSlab.windows[2*w] == (to ? NULL : c))
+            pmSlab.windows[2*w] = to;
+        else if (pmSlab.windows[2*w+1] == (to ? NULL : c))
+            pmSlab.windows[2*w+1] = to;
+    }
+}
+
+static pmSlabChunk *pmSlabTrack(struct pm_slab_chunk *pm) {
+    pmSlabChunk *c = zmalloc(sizeof(*c));
+
+    c->pm = pm;
+    c->cls = pmSlabClass(pm->slot_size);
+    c->free = pmSlabCountFree(pm);
+    c->hint = 0;
+    c->prev = NULL;
+    c->next = NULL;
+    pmSlabWindowsUpdate(c,c);
+    pmSlab.chunks++;
+    return c;
+}
+
+/* Chunk containing the slot at 'ptr', NULL if it isn't a slab slot. */
+static pmSlabChunk *pmSlabLookup(const void *ptr) {
+    uintptr_t off;
+    int j;
+
+    if (pmSlab.windows == NULL || (char*)ptr < (char*)server.pm_pool)
+        return NULL;
+    off = (char*)ptr - (char*)server.pm_pool;
+    if ((off >> PM_SLAB_WINDOW_SHIFT) >= pmSlab.nwindows) return NULL;
+    for (j = 0; j < 2; j++) {
+        pmSlabChunk *c = pmSlab.windows[2*(off >> PM_SLAB_WINDOW_SHIFT)+j];
+        char *slots;
+
+        if (c == NULL) continue;
+        slots = (char*)c->pm + c->pm->slots_off;
+        if ((char*)ptr >= slots &&
+            (char*)ptr < slots + (size_t)c->pm->slots*c->pm->slot_size)
+            return c;
+    }
+    return NULL;
+}
+
+int pmemSlabOwns(const void *ptr) {
+    return pmSlabLookup(ptr) != NULL;
+}
+
+/* Load the chunks of the pool. */
+void pmemSlabInit(void) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    TOID(struct pm_slab_chunk) chunk = root->slab_first;
+    pmSlabChunk *last = NULL;
+
+    pmSlab.nwindows = (server.pm_file_size >> PM_SLAB_WINDOW_SHIFT) + 2;
+    pmSlab.windows = zcalloc(sizeof(pmSlabChunk*)*2*pmSlab.nwindows);
+    while (!TOID_IS_NULL(chunk)) {
+        struct pm_slab_chunk *pm = D_RW(chunk);
+        pmSlabChunk *c;
+
+        if (pm->magic != PM_SLAB_MAGIC || pmSlabClass(pm->slot_size) < 0) {
+            serverLog(LL_WARNING,"Corrupted slab chunk in the PMEM pool.");
+            exit(1);
+        }
+        c = pmSlabTrack(pm);
+        if (last) {
+            last->next = c;
+            c->prev = last;
+        } else {
+            pmSlab.first = c;
+        }
+        last = c;
+        chunk = pm->next;
+    }
+    if (pmSlab.chunks)
+        serverLog(LL_NOTICE,"PMEM slab: %zu chunks", pmSlab.chunks);
+}
+
+static int pmSlabChunkConstr(PMEMobjpool *pop, void *ptr, void *arg) {
+    struct pm_slab_chunk *pm = ptr;
+    uint32_t slot_size = *(uint32_t*)arg, words;
+    size_t base = sizeof(*pm);
+
+    pm->magic = PM_SLAB_MAGIC;
+    pm->slot_size = slot_size;
+    pm->slots = ((PM_SLAB_CHUNK_SIZE-base)*8) / ((size_t)slot_size*8+1);
+    do {
+        words = (pm->slots+63)/64;
+        pm->slots_off = (base + words*8 + 63) & ~63;
+        if (pm->slots_off + (size_t)pm->slots*slot_size <=
+            PM_SLAB_CHUNK_SIZE) break;
+        pm->slots--;
+    } while(1);
+    pm->next = D_RO(server.pm_rootoid)->slab_first;
+    memset(pm->bitmap,0,words*8);
+    pmemobj_persist(pop,pm,pm->slots_off);
+    return 0;
+}
+
+/* Reserve a chunk for class 'cls' and link it in the pool. */
+static pmSlabChunk *pmSlabReserve(int cls) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    uint32_t slot_size = pmSlabClasses[cls];
+    pmSlabChunk *c;
+
+    if (pmemobj_alloc(server.pm_pool,&root->slab_first.oid,
+                      PM_SLAB_CHUNK_SIZE,TOID_TYPE_NUM(struct pm_slab_chunk),
+                      pmSlabChunkConstr,&slot_size) != 0) return NULL;
+    c = pmSlabTrack(D_RW(root->slab_first));
+    c->next = pmSlab.first;
+    if (c->next) c->next->prev = c;
+    pmSlab.first = c;
+    return c;
+}
+
+static void *pmSlabTake(pmSlabChunk *c) {
+    uint32_t words = pmSlabWords(c->pm), w, j;
+
+    for (j = 0; j < words; j++) {
+        uint64_t *word, free;
+        uint32_t slot;
+
+        w = (c->hint+j) % words;
+        word = &c->pm->bitmap[w];
+        free = ~*word;
+        if (w == words-1 && c->pm->slots % 64)
+            free &= (1ULL << (c->pm->slots % 64))-1;
+        if (free == 0) continue;
+        slot = w*64 + __builtin_ctzll(free);
+        TX_ADD_DIRECT(word);
+        *word |= 1ULL << (slot % 64);
+        c->hint = w;
+        if (c->free) c->free--;
+        return pmSlabSlot(c,slot);
+    }
+    c->free = 0;
+    return NULL;
+}
+
+/* Allocate 'size' bytes from a slab, or return NULL if 'size' is over the
+ * largest class: the caller then uses the heap of libpmemobj. The memory is
+ * not zeroed. Must be called in a transaction, that is aborted if the pool
+ * is full. */
+void *pmemSlabAlloc(size_t size) {
+    int cls = pmSlabClass(size);
+    pmSlabChunk *c;
+    void *ptr;
+
+    if (cls < 0) return NULL;
+    c = pmSlab.current[cls];
+    if (c && c->free && (ptr = pmSlabTake(c)) != NULL) return ptr;
+    for (c = pmSlab.first; c; c = c->next) {
+        if (c->cls != cls || c->free == 0) continue;
+        if ((ptr = pmSlabTake(c)) != NULL) {
+            pmSlab.current[cls] = c;
+            return ptr;
+        }
+    }
+    if ((c = pmSlabReserve(cls)) == NULL) {
+        pmemobj_tx_abort(ENOMEM);
+        return NULL;
+    }
+    pmSlab.current[cls] = c;
+    return pmSlabTake(c);
+}
+
+/* Free the slot at 'ptr'. Returns 0 if 'ptr' isn't a slab slot. Must be
+ * called in a transaction. */
+int pmemSlabFree(void *ptr) {
+    pmSlabChunk *c = pmSlabLookup(ptr);
+    uint32_t slot;
+    uint64_t *word;
+
+    if (c == NULL) return 0;
+    slot = ((char*)ptr - pmSlabSlot(c,0)) / c->pm->slot_size;
+    word = &c->pm->bitmap[slot/64];
+    TX_ADD_DIRECT(word);
+    *word &= ~(1ULL << (slot % 64));
+    c->free++;
+    return 1;
+}
+
+/* The bitmaps are rebuilt at startup: pmemSlabRebuildBegin() marks every
+ * slot as free, pmemSlabMark() is called for every object reachable from
+ * the root and pmemSlabRebuildEnd() persists the result. An interrupted
+ * rebuild is simply done again at the next startup. */
+void pmemSlabRebuildBegin(void) {
+    pmSlabChunk *c;
+
+    for (c = pmSlab.first; c; c = c->next)
+        memset(c->pm->bitmap,0,pmSlabWords(c->pm)*8);
+}
+
+void pmemSlabMark(void *ptr) {
+    pmSlabChunk *c = pmSlabLookup(ptr);
+    uint32_t slot;
+
+    if (c == NULL) return;
+    slot = ((char*)ptr - pmSlabSlot(c,0)) / c->pm->slot_size;
+    c->pm->bitmap[slot/64] |= 1ULL << (slot % 64);
+}
+
+void pmemSlabRebuildEnd(void) {
+    pmSlabChunk *c;
+
+    for (c = pmSlab.first; c; c = c->next) {
+        pmemobj_persist(server.pm_pool,c->pm->bitmap,pmSlabWords(c->pm)*8);
+        c->free = pmSlabCountFree(c->pm);
+    }
+}
+
+static void pmSlabUntrack(pmSlabChunk *c) {
+    int j;
+
+    if (c->prev) c->prev->next = c->next;
+    else pmSlab.first = c->next;
+    if (c->next) c->next->prev = c->prev;
+    for (j = 0; j < (int)PM_SLAB_CLASSES; j++)
+        if (pmSlab.current[j] == c) pmSlab.current[j] = NULL;
+    if (pmSlab.cron_cursor == c) pmSlab.cron_cursor = c->next;
+    pmSlabWindowsUpdate(c,NULL);
+    pmSlab.chunks--;
+    zfree(c);
+}
+
+/* Release all the chunks at once, when the keyspace is dropped. */
+void pmemSlabReleaseAll(void) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    volatile int error = 0;
+
+    if (pmSlab.first == NULL) return;
+    TX_BEGIN(server.pm_pool) {
+        pmSlabChunk *c;
+
+        TX_ADD_FIELD_DIRECT(root,slab_first);
+        root->slab_first.oid = OID_NULL;
+        for (c = pmSlab.first; c; c = c->next)
+            pmemobj_tx_free(pmemobj_oid(c->pm));
+    } TX_ONABORT {
+        serverLog(LL_WARNING,"Can't release the PMEM slab chunks: %s",
+            pmemobj_errormsg());
+        error = 1;
+    } TX_END
+    if (!error) while (pmSlab.first) pmSlabUntrack(pmSlab.first);
+}
+
+/* Recount the free slots of a few chunks, and release the ones that are
+ * empty, unless it's the last chunk of its class. Called by serverCron(),
+ * outside of any transaction. */
+void pmemSlabCron(void) {
+    struct redis_pmem_root *root = D_RW(server.pm_rootoid);
+    int visited = 0;
+
+    while (visited++ < PM_SLAB_CRON_CHUNKS && pmSlab.first) {
+        pmSlabChunk *c = pmSlab.cron_cursor ? pmSlab.cron_cursor :
+                         pmSlab.first;
+        pmSlabChunk *other;
+
+        pmSlab.cron_cursor = c->next;
+        c->free = pmSlabCountFree(c->pm);
+        if (c->free != c->pm->slots) continue;
+        for (other = pmSlab.first; other; other = other->next)
+            if (other != c && other->cls == c->cls) break;
+        if (other == NULL) continue;
+
+        TX_BEGIN(server.pm_pool) {
+            if (c->prev) {
+                TX_ADD_FIELD_DIRECT(c->prev->pm,next);
+                c->prev->pm->next = c->pm->next;
+            } else {
+                TX_ADD_FIELD_DIRECT(root,slab_first);
+                root->slab_first = c->pm->next;
+            }
+            pmemobj_tx_free(pmemobj_oid(c->pm));
+        } TX_ONCOMMIT {
+            pmSlabUntrack(c);
+        } TX_END
+    }
+}
+
+size_t pmemSlabChunks(void) {
+    return pmSlab.chunks;
+}
+
+/* Bytes in use in the slots, from the free slot counts. */
+size_t pmemSlabUsedBytes(void) {
+    pmSlabChunk *c;
+    size_t used = 0;
+
+    for (c = pmSlab.first; c; c = c->next)
+        used += (size_t)(c->pm->slots - c->free) * c->pm->slot_size;
+    return used;
+}
+#endif
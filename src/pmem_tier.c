@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017, Andreas Bluemle <andreas dot bluemle at itxperts dot de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef USE_PB
+#include "server.h"
+#include "obj.h"
+#include "libpmemobj.h"
+
+/* Hot/cold tiering of the values.
+ *
+ * With the persistent buffer the keyspace lives in DRAM, the pool only
+ * holding the log and the checkpoints. With pm-tier-idle-time the string
+ * values not accessed for that long are moved to the first pool by
+ * pmemTierCron(), while the keys, the dicts and the objects stay in DRAM.
+ * lookupKey() moves a value back on its next access: commands may modify a
+ * value in place, so they never see a cold one.
+ *
+ * The cold values are not persistent, the dataset being rebuilt from the
+ * AOF and the PB at startup, so pmemTierInit() frees the ones left in the
+ * pool by the previous run. A child process (BGSAVE, AOF rewrite,
+ * checkpoint) shares the mapping of the pool instead of getting a copy on
+ * write of it: the values released while one is running are only freed
+ * once it is gone. */
+
+#define PM_TIER_MIN_SIZE 64         /* Smaller values stay in DRAM. */
+#define PM_TIER_CYCLE_BUCKETS 1000  /* Max dict buckets scanned per call... */
+#define PM_TIER_CYCLE_USEC 1000     /* ...and max time spent. */
+
+typedef struct pmTierScan {
+    redisDb *db;
+    unsigned long long min_idle;    /* In milliseconds. */
+    int stop;                       /* The pool is full. */
+} pmTierScan;
+
+static int pmemTierChildActive(void) {
+    return server.rdb_child_pid != -1 || server.aof_child_pid != -1;
+}
+
+/* Free the cold values of the previous run. Nothing else in the pools of
+ * the PB has the type of the sds strings, the root object excepted. */
+void pmemTierInit(void) {
+    PMEMoid oid, next;
+    size_t freed = 0;
+
+    server.pm_tier_pending = listCreate();
+    for (oid = pmemobj_first(server.pm_pool); !OID_IS_NULL(oid); oid = next) {
+        next = pmemobj_next(oid);
+        if (pmemobj_type_num(oid) != PM_TYPE_SDS ||
+            OID_EQUALS(oid, server.pm_rootoid.oid)) continue;
+        pmemobj_free(&oid);
+        freed++;
+    }
+    if (freed)
+        serverLog(LL_NOTICE,"Freed %zu cold values left in PMEM by the "
+            "previous run.", freed);
+}
+
+/* Return 1 if 's' is the sds of a cold value. */
+int pmemTierIsCold(const void *s) {
+    return server.pm_tier_cold_keys &&
+           pmemobj_pool_by_ptr(s) == server.pm_pool;
+}
+
+/* Free the sds of a cold value that is going away. */
+void pmemTierRelease(sds s) {
+    server.pm_tier_cold_keys--;
+    server.pm_tier_cold_bytes -= sdslen(s);
+    if (pmemTierChildActive())
+        listAddNodeTail(server.pm_tier_pending, s);
+    else
+        sdsfreePM(s);
+}
+
+/* Move the value of 'o' back to DRAM. */
+void pmemTierPromote(robj *o) {
+    sds cold = o->ptr;
+
+    o->ptr = sdsnewlen(cold, sdslen(cold));
+    pmemTierRelease(cold);
+    server.stat_pm_tier_promotions++;
+}
+
+/* Move the value of the entry to the pool if it is idle. Only values
+ * referenced by the keyspace alone are moved, replacing their object. */
+static void pmemTierScanCallback(void *privdata, const dictEntry *const_de) {
+    pmTierScan *scan = privdata;
+    dictEntry *de = (dictEntry*)const_de;
+    robj *val = dictGetVal(de);
+    robj * volatile cold = NULL;
+
+    if (scan->stop || val->type != OBJ_STRING ||
+        val->encoding != OBJ_ENCODING_RAW || val->refcount != 1 ||
+        sdslen(val->ptr) < PM_TIER_MIN_SIZE || pmemTierIsCold(val->ptr) ||
+        estimateObjectIdleTime(val) < scan->min_idle) return;
+
+    TX_BEGIN(server.pm_pool) {
+        cold = dupStringObjectPM(val);
+    } TX_ONABORT {
+        cold = NULL;
+    } TX_END
+
+    if (cold == NULL) {
+        server.stat_pm_tier_errors++;
+        scan->stop = 1;
+        return;
+    }
+    cold->lru = val->lru;
+    server.pm_tier_cold_keys++;
+    server.pm_tier_cold_bytes += sdslen(cold->ptr);
+    server.stat_pm_tier_demotions++;
+    dictSetVal(scan->db->dict, de, cold);
+    decrRefCount(val);
+}
+
+/* Called by serverCron(): free the values released while a child was
+ * running, and scan a part of the keyspace for idle values. */
+void pmemTierCron(void) {
+    static int db_id = 0;
+    static unsigned long cursor = 0;
+    long long start = ustime();
+    int buckets = 0, dbs = 0;
+    pmTierScan scan;
+
+    if (!server.persistent || pmemTierChildActive() || server.loading) return;
+
+    if (listLength(server.pm_tier_pending)) {
+        TX_BEGIN(server.pm_pool) {
+            listNode *ln;
+
+            while ((ln = listFirst(server.pm_tier_pending)) != NULL) {
+                sdsfreePM(listNodeValue(ln));
+                listDelNode(server.pm_tier_pending, ln);
+            }
+        } TX_END
+    }
+    if (server.pm_tier_idle_time == 0) return;
+
+    scan.min_idle = (unsigned long long)server.pm_tier_idle_time*1000;
+    scan.stop = 0;
+    while (buckets < PM_TIER_CYCLE_BUCKETS && !scan.stop) {
+        scan.db = server.db + (db_id % server.dbnum);
+        if (dictSize(scan.db->dict))
+            cursor = dictScan(scan.db->dict, cursor, pmemTierScanCallback,
+                              &scan);
+        else
+            cursor = 0;
+        if (cursor == 0) {
+            db_id++;
+            if (++dbs == server.dbnum) break;
+        }
+        if ((++buckets & 15) == 0 && ustime()-start > PM_TIER_CYCLE_USEC)
+            break;
+    }
+}
+
+#endif
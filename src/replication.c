@@ -74,9 +74,29 @@ char *replicationGetSlaveName(client *c) {
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+/* With repl-backlog-pmem the buffer is allocated in the PMEM pool, so that
+ * it survives a clean restart, see pmemReplBacklogSave(). */
+static char *allocReplicationBacklogBuffer(void) {
+#ifdef USE_PB
+    char *buf;
+
+    if (server.repl_backlog_pmem &&
+        (buf = pmemReplBacklogAlloc(server.repl_backlog_size)) != NULL)
+        return buf;
+#endif
+    return zmalloc(server.repl_backlog_size);
+}
+
+static void freeReplicationBacklogBuffer(char *buf) {
+#ifdef USE_PB
+    if (pmemReplBacklogRelease(buf)) return;
+#endif
+    zfree(buf);
+}
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    server.repl_backlog = allocReplicationBacklogBuffer();
     server.repl_backlog_histlen = 0;
     server.repl_backlog_idx = 0;
     /* When a new backlog buffer is created, we increment the replication
@@ -109,8 +129,8 @@ void resizeReplicationBacklog(long long newsize) {
          * The reason is that copying a few gigabytes adds latency and even
          * worse often we need to alloc additional space before freeing the
          * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
+        freeReplicationBacklogBuffer(server.repl_backlog);
+        server.repl_backlog = allocReplicationBacklogBuffer();
         server.repl_backlog_histlen = 0;
         server.repl_backlog_idx = 0;
         /* Next byte we have is... the next since the buffer is empty. */
@@ -120,7 +140,7 @@ void resizeReplicationBacklog(long long newsize) {
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
-    zfree(server.repl_backlog);
+    freeReplicationBacklogBuffer(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
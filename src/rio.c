@@ -54,6 +54,9 @@
 #include "crc64.h"
 #include "config.h"
 #include "server.h"
+#ifdef USE_PB
+#include "pmem_latency.h"
+#endif
 
 /* ------------------------- Buffer I/O implementation ----------------------- */
 
@@ -283,6 +286,81 @@ void rioFreeFdset(rio *r) {
     sdsfree(r->io.fdset.buf);
 }
 
+#ifdef USE_PB
+/* ------------------------- PMEM region implementation ---------------------- */
+
+/* Written bytes are flushed from the CPU caches RIO_PMEM_FLUSH_CHUNK at a
+ * time rather than on every (usually tiny) write. */
+#define RIO_PMEM_FLUSH_CHUNK (64*1024)
+
+static void rioPmemFlushCaches(rio *r) {
+    char *start = r->io.pmem.base + r->io.pmem.flushed;
+    size_t len = r->io.pmem.pos - r->io.pmem.flushed;
+
+    if (len == 0) return;
+    pmemobj_flush(r->io.pmem.pool, start, len);
+    pmemEmulateWrite(start, len);
+    r->io.pmem.flushed = r->io.pmem.pos;
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioPmemWrite(rio *r, const void *buf, size_t len) {
+    if ((size_t)(r->io.pmem.size - r->io.pmem.pos) < len)
+        return 0; /* The region is too small. */
+    memcpy(r->io.pmem.base+r->io.pmem.pos,buf,len);
+    r->io.pmem.pos += len;
+    if (r->io.pmem.pos - r->io.pmem.flushed >= RIO_PMEM_FLUSH_CHUNK)
+        rioPmemFlushCaches(r);
+    return 1;
+}
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioPmemRead(rio *r, void *buf, size_t len) {
+    const char *src = r->io.pmem.base+r->io.pmem.pos;
+
+    if ((size_t)(r->io.pmem.size - r->io.pmem.pos) < len)
+        return 0; /* not enough bytes in the region. */
+    pmemEmulateRead(src,len);
+    memcpy(buf,src,len);
+    r->io.pmem.pos += len;
+    return 1;
+}
+
+/* Returns read/write position in the region. */
+static off_t rioPmemTell(rio *r) {
+    return r->io.pmem.pos;
+}
+
+/* Make the bytes written so far durable. Returns 1 on success. */
+static int rioPmemFlush(rio *r) {
+    rioPmemFlushCaches(r);
+    pmemobj_drain(r->io.pmem.pool);
+    return 1;
+}
+
+static const rio rioPmemIO = {
+    rioPmemRead,
+    rioPmemWrite,
+    rioPmemTell,
+    rioPmemFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Read or write the 'size' bytes at 'base', a region of the PMEM pool. */
+void rioInitWithPmem(rio *r, void *pool, char *base, size_t size) {
+    *r = rioPmemIO;
+    r->io.pmem.pool = pool;
+    r->io.pmem.base = base;
+    r->io.pmem.pos = 0;
+    r->io.pmem.size = size;
+    r->io.pmem.flushed = 0;
+}
+#endif
+
 /* ---------------------------- Generic functions ---------------------------- */
 
 /* This function can be installed both in memory and file streams when checksum
@@ -81,6 +81,14 @@ struct _rio {
             off_t pos;
             sds buf;
         } fdset;
+        /* PMEM region target (PB checkpoints). */
+        struct {
+            void *pool;     /* PMEMobjpool of the region. */
+            char *base;
+            off_t pos;
+            off_t size;
+            off_t flushed;  /* Bytes flushed from the CPU caches. */
+        } pmem;
     } io;
 };
 
@@ -127,6 +135,9 @@ static inline int rioFlush(rio *r) {
 void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithFdset(rio *r, int *fds, int numfds);
+#ifdef USE_PB
+void rioInitWithPmem(rio *r, void *pool, char *base, size_t size);
+#endif
 
 void rioFreeFdset(rio *r);
 
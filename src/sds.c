@@ -44,6 +44,11 @@
 
 #ifdef USE_PB
 #include "pmem_latency.h"
+#elif defined(USE_PMDK)
+/* The PMEM emulation is only built with the persistent buffer. */
+#define pmemobj_tx_zalloc_latency pmemobj_tx_zalloc
+#define pmemobj_direct_latency pmemobj_direct
+#define pmemobj_tx_free_latency pmemobj_tx_free
 #endif
 
 static inline int sdsHdrSize(char type) {
@@ -167,8 +172,16 @@ sds sdsnewlenPM(const void *init, size_t initlen) {
     unsigned char *fp; /* flags pointer. */
 
     hdrlen += sizeof(PMEMoid);
-    oid = pmemobj_tx_zalloc_latency((hdrlen+initlen+1),PM_TYPE_SDS);
-    sh = pmemobj_direct_latency(oid);
+#ifndef USE_PB
+    /* Short strings come from the slabs, that don't zero the memory. */
+    if ((sh = pmemSlabAlloc(hdrlen+initlen+1)) != NULL) {
+        *(PMEMoid *)sh = OID_NULL;
+    } else
+#endif
+    {
+        oid = pmemobj_tx_zalloc_latency((hdrlen+initlen+1),PM_TYPE_SDS);
+        sh = pmemobj_direct_latency(oid);
+    }
 
     if (!init)
         memset(sh, 0, hdrlen+initlen+1);
@@ -257,16 +270,29 @@ void sdsfree(sds s) {
 }
 
 #ifdef USE_PMDK
-/* Free an sds string. No operation is performed if 's' is NULL. */
+static void sdsfreePMObject(PMEMoid oid) {
+#ifndef USE_PB
+    if (pmemSlabFree(pmemobj_direct(oid))) return;
+#endif
+    pmemobj_tx_free_latency(oid);
+}
+
+/* Free an sds string. No operation is performed if 's' is NULL.
+ * Strings that are not in the pool are freed with sdsfree(), and the free
+ * runs in its own transaction if none is active. */
 void sdsfreePM(sds s) {
     PMEMoid oid;
     if (s == NULL) return;
-    if (server.persistent) {
-        oid.off = (uint64_t)((char*)s-sdsHdrSize(s[-1])) - sizeof(PMEMoid) - (uint64_t)server.pm_pool;
-        oid.pool_uuid_lo = server.pool_uuid_lo;
-        pmemobj_tx_free_latency(oid);
-    } else {
+    oid = server.persistent ?
+        pmemobj_oid((char*)s-sdsHdrSize(s[-1])-sizeof(PMEMoid)) : OID_NULL;
+    if (OID_IS_NULL(oid)) {
         s_free((char*)s-sdsHdrSize(s[-1]));
+    } else if (pmemobj_tx_stage() == TX_STAGE_NONE) {
+        TX_BEGIN(server.pm_pool) {
+            sdsfreePMObject(oid);
+        } TX_END
+    } else {
+        sdsfreePMObject(oid);
     }
 }
 #endif
@@ -36,6 +36,9 @@
 #ifdef USE_PB
 #include "pmem_latency.h"
 #endif
+#ifdef USE_PMDK
+#include "libpmem.h"
+#endif
 
 #include <time.h>
 #include <signal.h>
@@ -58,6 +61,7 @@
 #include <sys/utsname.h>
 #include <locale.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 
 /* Our shared "common" objects */
 
@@ -307,6 +311,7 @@ struct redisCommand redisCommandTable[] = {
     {"addpblist",addPBListCommand,-2,"wm",0,NULL,1,1,1,0,0},
     {"switchpblist",switchPBListCommand,1,"r",0,NULL,0,0,0,0,0},
     {"clearcurrentpblist",clearCurrentPBListCommand,1,"r",0,NULL,0,0,0,0,0},
+    {"pbcheckpoint",pbCheckpointCommand,1,"a",0,NULL,0,0,0,0,0},
 #endif
     {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0}
 };
@@ -525,6 +530,32 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+void dictObjectDestructorPM(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if (val == NULL) return;
+    decrRefCountPM(val);
+}
+
+/* Keys in the pool are unlinked from the PMEM keyspace before being freed,
+ * in the same transaction. */
+void dictSdsDestructorPM(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if (!pmemIsPM(val)) {
+        sdsfree(val);
+        return;
+    }
+    TX_BEGIN(server.pm_pool) {
+        pmemKeyspaceUnlink(val);
+        sdsfreePM(val);
+    } TX_END
+}
+#endif
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -616,6 +647,18 @@ dictType dbDictType = {
     dictObjectDestructor   /* val destructor */
 };
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+/* Db->dict of the PMEM keyspace, keys and string values may be in the pool. */
+dictType dbDictTypePM = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructorPM,        /* key destructor */
+    dictObjectDestructorPM      /* val destructor */
+};
+#endif
+
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
 dictType shaScriptObjectDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -1160,6 +1203,16 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 server.stat_net_input_bytes);
         trackInstantaneousMetric(STATS_METRIC_NET_OUTPUT,
                 server.stat_net_output_bytes);
+#ifdef USE_PB
+        trackInstantaneousMetric(STATS_METRIC_PB_RECORDS,
+                server.stat_pb_records);
+        trackInstantaneousMetric(STATS_METRIC_PB_BYTES,
+                server.stat_pb_persisted_bytes);
+        trackInstantaneousMetric(STATS_METRIC_PM_TIER_DEMOTIONS,
+                server.stat_pm_tier_demotions);
+        trackInstantaneousMetric(STATS_METRIC_PM_TIER_PROMOTIONS,
+                server.stat_pm_tier_promotions);
+#endif
     }
 
     /* We have just LRU_BITS bits per object for LRU information.
@@ -1222,6 +1275,20 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+    /* Give the empty slab chunks back to the pool. */
+    if (server.persistent) {
+        run_with_period(100) pmemSlabCron();
+    }
+#endif
+#ifdef USE_PB
+    /* Move the idle values to PMEM. */
+    pmemTierCron();
+
+    /* Give the space of the fsynced records back to the PB log. */
+    pmemPBReclaimCron();
+#endif
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
@@ -1299,6 +1366,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 rewriteAppendOnlyFileBackground();
             }
          }
+#ifdef USE_PB
+         /* Trigger a PB checkpoint if needed */
+         pmemCheckpointCron();
+#endif
     }
 
 
@@ -1399,10 +1470,23 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
+#ifdef USE_PB
+    /* Resume the writers throttled by pb-max-memory if possible. */
+    if (listLength(server.pb_throttled_clients))
+        pbReleaseThrottledClients();
+#endif
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+#ifdef USE_PB
+    /* Persist the commands of this iteration in the PB as one record.
+     * writeToClient() does it as well, for the replies sent by the write
+     * handlers before getting here. */
+    if (server.persistent) pmemCommitPBBatch();
+#endif
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
@@ -1454,6 +1538,8 @@ void createSharedObjects(void) {
         "-NOAUTH Authentication required.\r\n"));
     shared.oomerr = createObject(OBJ_STRING,sdsnew(
         "-OOM command not allowed when used memory > 'maxmemory'.\r\n"));
+    shared.pbfullerr = createObject(OBJ_STRING,sdsnew(
+        "-PBFULL The write can't be persisted in the persistent buffer.\r\n"));
     shared.execaborterr = createObject(OBJ_STRING,sdsnew(
         "-EXECABORT Transaction discarded because of previous errors.\r\n"));
     shared.noreplicaserr = createObject(OBJ_STRING,sdsnew(
@@ -1536,10 +1622,38 @@ void initServerConfig(void) {
     server.pm_file_path = NULL;
     server.pm_file_size = CONFIG_DEFAULT_PM_FILE_SIZE;
     server.pm_reconstruct_required = false;
+    server.pm_prefault = CONFIG_DEFAULT_PM_PREFAULT;
 #endif
 #ifdef USE_PB
     server.verbosity_pb_only = CONFIG_DEFAULT_VERBOSITY_PB_ONLY;
     server.aof_flush_timer = CONFIG_MIN_AOF_FLUSH_TIMER;
+    server.pb_log_size = CONFIG_DEFAULT_PB_LOG_SIZE;
+    server.pb_group_commit = CONFIG_DEFAULT_PB_GROUP_COMMIT;
+    server.pb_group_commit_size = CONFIG_DEFAULT_PB_GROUP_COMMIT_SIZE;
+    server.pb_reclaim_interval = CONFIG_DEFAULT_PB_RECLAIM_INTERVAL;
+    server.pb_load_threads = CONFIG_DEFAULT_PB_LOAD_THREADS;
+    server.pb_record_encoding = CONFIG_DEFAULT_PB_RECORD_ENCODING;
+    server.pb_compress_threshold = CONFIG_DEFAULT_PB_COMPRESS_THRESHOLD;
+    server.pb_aof_drain = CONFIG_DEFAULT_PB_AOF_DRAIN;
+    server.pb_stripes = 0;
+    server.pb_stripe_policy = CONFIG_DEFAULT_PB_STRIPE_POLICY;
+    server.pb_checkpoint_interval = CONFIG_DEFAULT_PB_CHECKPOINT_INTERVAL;
+    server.pb_max_memory = CONFIG_DEFAULT_PB_MAX_MEMORY;
+    server.pb_max_memory_policy = CONFIG_DEFAULT_PB_MAX_MEMORY_POLICY;
+    server.pb_fsync_asap = 0;
+    server.pb_ckpt_seq = server.pb_ckpt_len = 0;
+    server.pb_ckpt_next_size = 0;
+    server.repl_backlog_pmem = CONFIG_DEFAULT_REPL_BACKLOG_PMEM;
+    server.pm_tier_idle_time = CONFIG_DEFAULT_PM_TIER_IDLE_TIME;
+    server.pm_tier_cold_keys = server.pm_tier_cold_bytes = 0;
+    server.pm_tier_pending = NULL;
+#ifdef PB_FAULT_INJECTION
+    server.pb_fault_point = PB_FAULT_NONE;
+    server.pb_fault_countdown = 0;
+#endif
+    server.pb_ckpt_time_last = 0;
+    server.pb_ckpt_last_status = C_OK;
+    pmemLatencySetProfile(CONFIG_DEFAULT_PM_PROFILE);
 #endif
     server.supervised = 0;
     server.supervised_mode = SUPERVISED_NONE;
@@ -1560,6 +1674,10 @@ void initServerConfig(void) {
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
+#ifdef USE_PMDK
+    server.aof_dax = CONFIG_DEFAULT_AOF_DAX;
+    server.aof_dax_prealloc = CONFIG_DEFAULT_AOF_DAX_PREALLOC;
+#endif
     server.pidfile = NULL;
     server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
@@ -1920,6 +2038,34 @@ void resetServerStats(void) {
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
     server.aof_delayed_fsync = 0;
+#ifdef USE_PB
+    server.stat_pb_records = 0;
+    server.stat_pb_commands = 0;
+    server.stat_pb_fences = 0;
+    server.stat_pb_max_batch = 0;
+    server.stat_pb_payload_bytes = 0;
+    server.stat_pb_aof_bytes = 0;
+    server.stat_pb_compressed_records = 0;
+    server.stat_pb_compressed_saved_bytes = 0;
+    server.stat_pb_flushes = 0;
+    server.stat_pb_persisted_bytes = 0;
+    server.stat_pb_drain_writes = 0;
+    server.stat_pb_append_errors = 0;
+    server.stat_pb_forced_fsyncs = 0;
+    server.stat_pb_durable_fallbacks = 0;
+    server.stat_pb_shard_fallbacks = 0;
+    server.stat_pb_throttled_writes = 0;
+    server.stat_pb_rejected_writes = 0;
+    memset(server.stat_pb_append_latency,0,
+        sizeof(server.stat_pb_append_latency));
+    server.stat_pm_tier_demotions = 0;
+    server.stat_pm_tier_promotions = 0;
+    server.stat_pm_tier_errors = 0;
+#endif
+#ifdef USE_PMDK
+    server.stat_pm_tx_started = 0;
+    server.stat_pm_tx_aborted = 0;
+#endif
 }
 
 void initServer(void) {
@@ -1929,7 +2075,9 @@ void initServer(void) {
     signal(SIGPIPE, SIG_IGN);
     setupSignalHandlers();
 
+#ifdef USE_PB
     serverLog(LL_PB, "PB: Server start");
+#endif
 
     if (server.syslog_enabled) {
         openlog(server.syslog_ident, LOG_PID | LOG_NDELAY | LOG_NOWAIT,
@@ -1945,6 +2093,9 @@ void initServer(void) {
     server.clients_pending_write = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
+#ifdef USE_PB
+    server.pb_throttled_clients = listCreate();
+#endif
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
@@ -1988,7 +2139,6 @@ void initServer(void) {
             server.db[j].dict = dictCreate(&dbDictType,NULL);
             
             pm_type_root_type_id = TOID_TYPE_NUM(struct redis_pmem_root);
-            pm_type_persistent_aof_log = TOID_TYPE_NUM(struct persistent_aof_log);
         } else
 #else
         if (server.persistent) {
@@ -2008,6 +2158,9 @@ void initServer(void) {
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
     }
+#if defined(USE_PMDK) && !defined(USE_PB)
+    server.pm_dirty_keys = listCreate();
+#endif
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
@@ -2019,6 +2172,11 @@ void initServer(void) {
     server.rdb_bgsave_scheduled = 0;
     aofRewriteBufferReset();
     server.aof_buf = sdsempty();
+#ifdef USE_PB
+    server.pb_batch = sdsempty();
+    server.pb_batch_cmds = 0;
+    server.pb_in_unit = 0;
+#endif
     server.lastsave = time(NULL); /* At startup we consider the DB saved. */
     server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
     server.rdb_save_time_last = -1;
@@ -2084,6 +2242,35 @@ void initServer(void) {
     bioInit();
 }
 
+#ifdef USE_PB
+/* Binary persistent buffer records refer to commands by their position in
+ * the command table. */
+long pbCommandIndex(struct redisCommand *cmd) {
+    return cmd - redisCommandTable;
+}
+
+struct redisCommand *pbCommandByIndex(uint64_t idx) {
+    uint64_t numcommands = sizeof(redisCommandTable)/sizeof(struct redisCommand);
+
+    return idx < numcommands ? redisCommandTable+idx : NULL;
+}
+
+/* Checksum of the command names in table order: binary records written
+ * by a server with a different table can't be decoded. */
+uint64_t pbCommandTableSignature(void) {
+    int numcommands = sizeof(redisCommandTable)/sizeof(struct redisCommand);
+    uint64_t crc = 0;
+    int j;
+
+    for (j = 0; j < numcommands; j++) {
+        char *name = redisCommandTable[j].name;
+
+        crc = crc64(crc,(unsigned char*)name,strlen(name)+1);
+    }
+    return crc;
+}
+#endif
+
 /* Populates the Redis Command Table starting from the hard coded list
  * we have on top of redis.c file. */
 void populateCommandTable(void) {
@@ -2334,6 +2521,9 @@ void call(client *c, int flags) {
     start = ustime();
     c->cmd->proc(c);
     duration = ustime()-start;
+#if defined(USE_PMDK) && !defined(USE_PB)
+    if (server.persistent) pmemKeyspaceSync();
+#endif
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
 
@@ -2514,6 +2704,18 @@ int processCommand(client *c) {
         }
     }
 
+#ifdef USE_PB
+    /* Handle the pb-max-memory directive: the write may be refused or
+     * throttled, in which case it is executed once the client is
+     * unblocked. */
+    if (server.persistent && server.pb_max_memory &&
+        c->cmd->flags & CMD_WRITE && !(c->flags & CLIENT_MASTER) &&
+        pbMaxMemoryCheck(c) == C_ERR)
+    {
+        return (c->flags & CLIENT_BLOCKED) ? C_ERR : C_OK;
+    }
+#endif
+
     /* Don't accept write commands if there are problems persisting on disk
      * and if this is a master instance. */
     if (((server.stop_writes_on_bgsave_err &&
@@ -2603,6 +2805,18 @@ int processCommand(client *c) {
         return C_OK;
     }
 
+#ifdef USE_PB
+    /* Don't accept writes from a durable client (CLIENT DURABLE) if they
+     * can't be persisted in the PB. */
+    if (c->flags & CLIENT_PB_DURABLE && c->cmd->flags & CMD_WRITE &&
+        pbDurableCheck(c) == C_ERR)
+    {
+        flagTransaction(c);
+        addReply(c, shared.pbfullerr);
+        return C_OK;
+    }
+#endif
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand && c->cmd->proc != discardCommand &&
@@ -2611,7 +2825,16 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+#ifdef USE_PB
+        int durable = c->flags & CLIENT_PB_DURABLE;
+        pbDurableState pbst;
+
+        if (durable) pbDurableBegin(c,&pbst);
         call(c,CMD_CALL_FULL);
+        if (durable) pbDurableCommit(c,&pbst);
+#else
+        call(c,CMD_CALL_FULL);
+#endif
         c->woff = server.master_repl_offset;
         if (listLength(server.ready_keys))
             handleClientsBlockedOnLists();
@@ -2671,6 +2894,9 @@ int prepareForShutdown(int flags) {
         /* Append only file: fsync() the AOF and exit */
         serverLog(LL_NOTICE,"Calling fsync() on the AOF file.");
         aof_fsync(server.aof_fd);
+#ifdef USE_PMDK
+        aofDaxClose();
+#endif
     }
 
     /* Create a new RDB file before exiting. */
@@ -2697,6 +2923,10 @@ int prepareForShutdown(int flags) {
     /* Best effort flush of slave output buffers, so that we hopefully
      * send them pending writes. */
     flushSlavesOutputBuffers();
+#ifdef USE_PB
+    /* Let the slaves continue from here after the restart. */
+    pmemReplBacklogSave();
+#endif
 
     /* Close the listening sockets. Apparently this allows faster restarts. */
     closeListeningSockets(1);
@@ -3132,6 +3362,9 @@ sds genRedisInfoString(char *section) {
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
+#ifdef USE_PMDK
+            info = sdscatprintf(info,"aof_dax:%d\r\n",aofDaxActive());
+#endif
         }
 
         if (server.loading) {
@@ -3166,6 +3399,203 @@ sds genRedisInfoString(char *section) {
         }
     }
 
+#ifdef USE_PB
+    /* Persistent buffer */
+    if (server.persistent &&
+        (allsections || defsections || !strcasecmp(section,"persistentbuffer")))
+    {
+        uint64_t used = pmemPBUsedBytes(), current = pmemPBCurrentBytes();
+        size_t pool_size = 0;
+
+        for (j = 0; j < server.pb_stripes; j++)
+            pool_size += server.pb_stripe[j].size;
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Persistentbuffer\r\n"
+            "pm_profile:%s\r\n"
+            "pm_read_latency:%zu\r\n"
+            "pm_write_latency:%zu\r\n"
+            "pm_read_bandwidth:%zu\r\n"
+            "pm_write_bandwidth:%zu\r\n"
+            "pm_granularity:%zu\r\n"
+            "pm_tsc_ghz:%.3f\r\n"
+            "pb_group_commit:%d\r\n"
+            "pb_group_commit_size:%lld\r\n"
+            "pb_reclaim_interval:%d\r\n"
+            "pb_record_encoding:%s\r\n"
+            "pb_compress_threshold:%zu\r\n"
+            "pb_aof_drain:%d\r\n"
+            "pb_aof_drain_pending:%zu\r\n"
+            "pb_stripes:%d\r\n"
+            "pb_stripes_active:%d\r\n"
+            "pb_stripe_policy:%s\r\n"
+            "pb_shard_fallbacks:%lld\r\n"
+            "pb_log_size:%llu\r\n"
+            "pb_log_used:%llu\r\n"
+            "pb_log_unsynced:%llu\r\n"
+            "pb_records_appended:%lld\r\n"
+            "pb_commands_logged:%lld\r\n"
+            "pb_avg_batch_size:%.2f\r\n"
+            "pb_max_batch_size:%lld\r\n"
+            "pb_fences:%lld\r\n"
+            "pb_fences_per_command:%.2f\r\n"
+            "pb_payload_bytes:%lld\r\n"
+            "pb_payload_aof_ratio:%.2f\r\n"
+            "pb_compressed_records:%lld\r\n"
+            "pb_compressed_saved_bytes:%lld\r\n"
+            "pb_persisted_bytes:%lld\r\n"
+            "pb_flushes:%lld\r\n"
+            "pb_aof_drain_writes:%lld\r\n"
+            "pb_append_errors:%lld\r\n"
+            "pb_max_memory:%llu\r\n"
+            "pb_max_memory_policy:%s\r\n"
+            "pb_log_fill_pct:%.2f\r\n"
+            "pb_unsynced_pct:%.2f\r\n"
+            "pb_throttled_clients:%lu\r\n"
+            "pb_forced_fsyncs:%lld\r\n"
+            "pb_durable_fallbacks:%lld\r\n"
+            "pb_throttled_writes:%lld\r\n"
+            "pb_rejected_writes:%lld\r\n"
+            "instantaneous_pb_appends_per_sec:%lld\r\n"
+            "instantaneous_pb_persisted_kbps:%.2f\r\n"
+            "pb_append_latency_p50_ns:%llu\r\n"
+            "pb_append_latency_p99_ns:%llu\r\n"
+            "pb_append_latency_p999_ns:%llu\r\n"
+            "pb_log_records:%lld\r\n"
+            "pb_current_bytes:%llu\r\n"
+            "pb_another_bytes:%llu\r\n"
+            "pb_last_clear_usec:%lld\r\n"
+            "pb_checkpoint_in_progress:%d\r\n"
+            "pb_checkpoint_bytes:%llu\r\n"
+            "pb_checkpoint_records_after:%llu\r\n"
+            "pb_last_checkpoint_status:%s\r\n"
+            "repl_backlog_pmem:%d\r\n"
+            "pm_tier_idle_time:%d\r\n"
+            "pm_tier_cold_keys:%zu\r\n"
+            "pm_tier_cold_bytes:%zu\r\n"
+            "pm_tier_pending_frees:%lu\r\n"
+            "pm_tier_demotions:%lld\r\n"
+            "pm_tier_promotions:%lld\r\n"
+            "pm_tier_errors:%lld\r\n"
+            "instantaneous_pm_tier_demotions_per_sec:%lld\r\n"
+            "instantaneous_pm_tier_promotions_per_sec:%lld\r\n"
+            "pm_tx_started:%lld\r\n"
+            "pm_tx_aborted:%lld\r\n"
+            "pm_pool_size:%zu\r\n"
+            "pm_pool_used:%lld\r\n"
+            "pm_pool_free:%lld\r\n",
+            pmemLatencyProfileName(),
+            server.pm_read_latency,
+            server.pm_write_latency,
+            server.pm_read_bandwidth,
+            server.pm_write_bandwidth,
+            server.pm_granularity,
+            pmemLatencyTscGhz(),
+            server.pb_group_commit,
+            server.pb_group_commit_size,
+            server.pb_reclaim_interval,
+            server.pb_record_encoding == PB_ENCODING_BINARY ? "binary" : "resp",
+            server.pb_compress_threshold,
+            server.pb_aof_drain,
+            server.pb_drain_pending,
+            server.pb_stripes,
+            pmemPBActiveStripes(),
+            server.pb_stripe_policy == PB_STRIPE_SHARD ? "shard" :
+            server.pb_stripe_policy == PB_STRIPE_NUMA_LOCAL ? "numa-local" :
+                                                              "round-robin",
+            server.stat_pb_shard_fallbacks,
+            (unsigned long long)pmemPBLogSize(),
+            (unsigned long long)used,
+            (unsigned long long)pmemPBUnsyncedBytes(),
+            server.stat_pb_records,
+            server.stat_pb_commands,
+            server.stat_pb_records ?
+                (double)server.stat_pb_commands/server.stat_pb_records : 0,
+            server.stat_pb_max_batch,
+            server.stat_pb_fences,
+            server.stat_pb_commands ?
+                (double)server.stat_pb_fences/server.stat_pb_commands : 0,
+            server.stat_pb_payload_bytes,
+            server.stat_pb_aof_bytes ?
+                (double)server.stat_pb_payload_bytes/server.stat_pb_aof_bytes : 0,
+            server.stat_pb_compressed_records,
+            server.stat_pb_compressed_saved_bytes,
+            server.stat_pb_persisted_bytes,
+            server.stat_pb_flushes,
+            server.stat_pb_drain_writes,
+            server.stat_pb_append_errors,
+            server.pb_max_memory,
+            server.pb_max_memory_policy == PB_MAXMEMORY_THROTTLE ? "throttle" :
+            server.pb_max_memory_policy == PB_MAXMEMORY_REJECT ? "reject" :
+                                                                 "fsync",
+            (double)used*100/pmemPBLogSize(),
+            (double)current*100/(server.pb_max_memory ?
+                                 server.pb_max_memory : pmemPBLogSize()),
+            listLength(server.pb_throttled_clients),
+            server.stat_pb_forced_fsyncs,
+            server.stat_pb_durable_fallbacks,
+            server.stat_pb_throttled_writes,
+            server.stat_pb_rejected_writes,
+            getInstantaneousMetric(STATS_METRIC_PB_RECORDS),
+            (float)getInstantaneousMetric(STATS_METRIC_PB_BYTES)/1024,
+            (unsigned long long)pmemPBAppendLatency(50),
+            (unsigned long long)pmemPBAppendLatency(99),
+            (unsigned long long)pmemPBAppendLatency(99.9),
+            pmemPBRecordCount(),
+            (unsigned long long)current,
+            (unsigned long long)(used - current),
+            __atomic_load_n(&server.stat_pb_last_clear_usec,__ATOMIC_RELAXED),
+            server.rdb_child_type == RDB_CHILD_TYPE_PMEM,
+            (unsigned long long)server.pb_ckpt_len,
+            (unsigned long long)(server.pb_ckpt_seq ?
+                server.pb_next_seq - server.pb_ckpt_seq : 0),
+            server.pb_ckpt_last_status == C_OK ? "ok" : "err",
+            pmemReplBacklogActive(),
+            server.pm_tier_idle_time,
+            server.pm_tier_cold_keys,
+            server.pm_tier_cold_bytes,
+            listLength(server.pm_tier_pending),
+            server.stat_pm_tier_demotions,
+            server.stat_pm_tier_promotions,
+            server.stat_pm_tier_errors,
+            getInstantaneousMetric(STATS_METRIC_PM_TIER_DEMOTIONS),
+            getInstantaneousMetric(STATS_METRIC_PM_TIER_PROMOTIONS),
+            server.stat_pm_tx_started,
+            server.stat_pm_tx_aborted,
+            pool_size,
+            server.stat_pm_allocated,
+            (long long)pool_size - server.stat_pm_allocated);
+        for (j = 0; server.pb_stripes > 1 && j < server.pb_stripes; j++) {
+            struct redis_pmem_root *root = server.pb_stripe[j].root;
+
+            info = sdscatprintf(info,"pb_stripe_%d:used=%llu,active=%d\r\n",
+                j, (unsigned long long)(root->pb_tail - root->pb_head),
+                server.pb_stripe[j].active);
+        }
+    }
+#elif defined(USE_PMDK)
+    /* PMEM keyspace */
+    if (server.persistent &&
+        (allsections || defsections || !strcasecmp(section,"persistentmemory")))
+    {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Persistentmemory\r\n"
+            "pm_keys:%llu\r\n"
+            "pm_tx_started:%lld\r\n"
+            "pm_tx_aborted:%lld\r\n"
+            "pm_pool_size:%zu\r\n"
+            "pm_slab_chunks:%zu\r\n"
+            "pm_slab_used_bytes:%zu\r\n",
+            (unsigned long long)D_RO(server.pm_rootoid)->num_dict_entries,
+            server.stat_pm_tx_started,
+            server.stat_pm_tx_aborted,
+            server.pm_file_size,
+            pmemSlabChunks(),
+            pmemSlabUsedBytes());
+    }
+#endif
+
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3905,6 +4335,51 @@ void loadDataFromDisk(void) {
     }
 }
 
+#if defined(USE_PMDK) && !defined(USE_PB)
+/* Without the AOF the PMEM keyspace is the dataset, and it is rebuilt from
+ * the pool. Otherwise the AOF, or the RDB file of a new pool, is loaded as
+ * usual and the keyspace is copied to the pool again. */
+void loadDataFromPMEM(void) {
+    long long start = ustime();
+
+    if (server.aof_state == AOF_ON || !server.pm_reconstruct_required) {
+        pmemKeyspaceClear();
+        loadDataFromDisk();
+        pmemKeyspaceSyncAll();
+    } else if (pmemKeyspaceReconstruct() == C_OK) {
+        serverLog(LL_NOTICE,"DB loaded from PMEM: %.3f seconds",
+            (float)(ustime()-start)/1000000);
+    } else {
+        serverLog(LL_WARNING,"Fatal error loading the DB from PMEM. Exiting.");
+        exit(1);
+    }
+}
+#endif
+
+#ifdef USE_PB
+/* The dataset is the checkpoint plus the records appended after it, if it
+ * is usable, otherwise the AOF (or the RDB file) plus the records not in
+ * the AOF yet. */
+void loadDataFromPB(void) {
+    long long start = ustime();
+    int retval;
+
+    if (pmemCheckpointUsable()) {
+        retval = pmemLoadCheckpoint();
+    } else {
+        loadDataFromDisk();
+        retval = pmemReconstructPB();
+    }
+    if (retval == C_OK) {
+        serverLog(LL_NOTICE,"DB loaded from PMEM: %.3f seconds",
+            (float)(ustime()-start)/1000000);
+    } else {
+        serverLog(LL_WARNING,"Fatal error loading the DB from PMEM. Exiting.");
+        exit(1);
+    }
+}
+#endif
+
 void redisOutOfMemoryHandler(size_t allocation_size) {
     serverLog(LL_WARNING,"Out Of Memory allocating %zu bytes!",
         allocation_size);
@@ -4023,36 +4498,166 @@ int redisIsSupervised(int mode) {
 }
 
 #ifdef USE_PMDK
-void initPersistentMemory(void) {
-    PMEMoid oid;
-    struct redis_pmem_root *root;
-    
+typedef struct pmPrefaultRange {
+    char *start;
+    size_t len;
+} pmPrefaultRange;
+
+/* Fault in the pages of a range of a pool mapping, writable, without
+ * modifying them. */
+static void *prefaultPersistentMemoryRange(void *arg) {
+    pmPrefaultRange *r = arg;
+    size_t off, pagesize = sysconf(_SC_PAGESIZE);
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(r->start, r->len, MADV_POPULATE_WRITE) == 0) return NULL;
+#endif
+    /* Kernels before 5.14: write every page with what it holds already. */
+    for (off = 0; off < r->len; off += pagesize) {
+        volatile char *p = r->start + off;
+        *p = *p;
+    }
+    return NULL;
+}
 
-    long long start = ustime();
-    char pmfile_hmem[64];
-    bytesToHuman(pmfile_hmem, server.pm_file_size);
+/* Fault in the whole mapping of a pool, with up to PM_PREFAULT_MAX_THREADS
+ * threads, so that the accesses after startup don't take a page fault each.
+ * On tmpfs, as used for PMEM emulation, this allocates the memory, like
+ * MAP_POPULATE would. Huge pages are requested as well: DAX maps the pool
+ * with them when the mapping is 2MB aligned, tmpfs when its shmem_enabled
+ * setting is "advise". */
+static void prefaultPersistentMemoryPool(void *base, size_t size) {
+    pthread_t threads[PM_PREFAULT_MAX_THREADS];
+    pmPrefaultRange ranges[PM_PREFAULT_MAX_THREADS];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunk;
+    int j, numthreads;
+
+    size &= ~(size_t)(sysconf(_SC_PAGESIZE)-1);
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    numthreads = size / PM_PREFAULT_MIN_CHUNK;
+    if (numthreads > ncpus) numthreads = ncpus;
+    if (numthreads > PM_PREFAULT_MAX_THREADS)
+        numthreads = PM_PREFAULT_MAX_THREADS;
+    if (numthreads < 1) numthreads = 1;
+    chunk = (size/numthreads + PM_HUGEPAGE_SIZE-1) &
+            ~(size_t)(PM_HUGEPAGE_SIZE-1);
+
+    for (j = 0; j < numthreads; j++) {
+        size_t off = j*chunk;
+
+        ranges[j].start = (char*)base + off;
+        ranges[j].len = off >= size ? 0 :
+                        (j == numthreads-1 || size-off < chunk) ? size-off :
+                                                                  chunk;
+    }
+    /* The main thread takes the first range. Ranges without a thread, if
+     * one can't be created, are done by the main thread too. Only the
+     * ranges left with a length have a thread to join. */
+    for (j = 1; j < numthreads; j++) {
+        if (!ranges[j].len) continue;
+        if (pthread_create(&threads[j],NULL,prefaultPersistentMemoryRange,
+                           &ranges[j]) != 0)
+        {
+            prefaultPersistentMemoryRange(&ranges[j]);
+            ranges[j].len = 0;
+        }
+    }
+    prefaultPersistentMemoryRange(&ranges[0]);
+    for (j = 1; j < numthreads; j++)
+        if (ranges[j].len) pthread_join(threads[j],NULL);
+}
+
+/* Create the PMEM pool, or open it if it exists already. 'size' is
+ * updated to the size of an existing pool. Exits on failure. */
+static PMEMobjpool *openPersistentMemoryPool(const char *path, size_t *size,
+                                             int *created)
+{
+    PMEMobjpool *pool;
+    char pmfile_hmem[64], mapped[64];
+    long long start = ustime(), open_time;
+
+    /* With a size multiple of 2MB the whole pool can be mapped with huge
+     * pages. */
+    *size = (*size + PM_HUGEPAGE_SIZE-1) & ~(size_t)(PM_HUGEPAGE_SIZE-1);
+    bytesToHuman(pmfile_hmem, *size);
     serverLog(LL_NOTICE,"Start init Persistent memory file %s size %s",
-            server.pm_file_path, pmfile_hmem);
+            path, pmfile_hmem);
 
     /* Create new PMEM pool file. */
-    server.pm_pool = pmemobj_create(server.pm_file_path, PM_LAYOUT_NAME, server.pm_file_size, 0666);
+    pool = pmemobj_create(path, PM_LAYOUT_NAME, *size, 0666);
+    *created = 1;
 
-    if (server.pm_pool == NULL) {
+    if (pool == NULL) {
         /* Open the existing PMEM pool file. */
-        server.pm_pool = pmemobj_open(server.pm_file_path, PM_LAYOUT_NAME);
-        server.pm_rootoid = POBJ_ROOT(server.pm_pool, struct redis_pmem_root);
-	server.pm_reconstruct_required = true;
+        pool = pmemobj_open(path, PM_LAYOUT_NAME);
+        *created = 0;
 
-        if (server.pm_pool == NULL) {
+        if (pool == NULL) {
             serverLog(LL_WARNING,"Cannot init persistent memory poolset file "
-                "%s size %s", server.pm_file_path, pmfile_hmem);
+                "%s size %s", path, pmfile_hmem);
             exit(1);
         }
+        /* The size of an existing pool is the one it was created with. */
+        struct stat sb;
+        if (stat(path,&sb) == 0 && S_ISREG(sb.st_mode))
+            *size = sb.st_size;
+    }
+    open_time = ustime()-start;
+
+    /* Opening only maps the pool: the pages are faulted in on first access
+     * unless they are prefaulted now. */
+    if (server.pm_prefault) {
+        start = ustime();
+        prefaultPersistentMemoryPool(pool, *size);
+        snprintf(mapped, sizeof(mapped), "prefaulted in %.3f seconds",
+            (double)(ustime()-start)/1000000);
     } else {
-        server.pm_rootoid = POBJ_ROOT(server.pm_pool, struct redis_pmem_root);
-        root = pmemobj_direct_latency(server.pm_rootoid.oid);
-        root->num_logs = 0;
+        snprintf(mapped, sizeof(mapped), "faulted in on first access");
     }
+    serverLog(LL_NOTICE,"Persistent memory pool %s opened in %.3f seconds, "
+        "%s (%s, %s)",
+        path, (double)open_time/1000000, mapped,
+        ((uintptr_t)pool & (PM_HUGEPAGE_SIZE-1)) ? "not 2MB aligned" :
+                                                    "2MB aligned",
+        pmem_is_pmem(pool, *size) ? "DAX" : "not DAX");
+    return pool;
+}
+
+void initPersistentMemory(void) {
+    PMEMoid oid;
+    int created;
+
+    long long start = ustime();
+#ifdef USE_PB
+    pmemLatencyInit();
+#endif
+    server.pm_pool = openPersistentMemoryPool(server.pm_file_path,
+                                              &server.pm_file_size, &created);
+    server.pm_rootoid = POBJ_ROOT(server.pm_pool, struct redis_pmem_root);
+    if (!created) server.pm_reconstruct_required = true;
+#ifdef USE_PB
+    /* The first pool is the one of pm_pool. */
+    for (int j = 0; j < server.pb_stripes; j++) {
+        pbStripe *s = &server.pb_stripe[j];
+
+        if (j == 0) {
+            s->pool = server.pm_pool;
+            s->size = server.pm_file_size;
+            s->created = created;
+        } else {
+            s->pool = openPersistentMemoryPool(s->path, &s->size, &s->created);
+            if (!s->created) server.pm_reconstruct_required = true;
+        }
+        s->root = pmemobj_direct(POBJ_ROOT(s->pool,
+                                           struct redis_pmem_root).oid);
+    }
+    if (pmemInitPBLog() == C_ERR) exit(1);
+#else
+    pmemSlabInit();
+#endif
 
     /* Get pool UUID from root object's OID. */
     oid = pmemobj_root(server.pm_pool, 1);
@@ -4222,24 +4827,24 @@ int main(int argc, char **argv) {
     #ifdef __linux__
         linuxMemoryWarnings();
     #endif
-        loadDataFromDisk();
 #ifdef USE_PMDK
-        if (server.pm_reconstruct_required) {
-            long long start = ustime();
+        aofDaxRecover();
+#endif
+#if defined(USE_PMDK) && !defined(USE_PB)
+        if (server.persistent)
+            loadDataFromPMEM();
+        else
+#elif defined(USE_PB)
+        if (server.pm_reconstruct_required)
+            loadDataFromPB();
+        else
+#endif
+        loadDataFromDisk();
 #ifdef USE_PB
-            TX_BEGIN(server.pm_pool) {
-                if (pmemReconstructPB() == C_OK) {
-                    serverLog(LL_NOTICE,"DB loaded from PMEM: %.3f seconds",(float)(ustime()-start)/1000000);
-                } else if (errno != ENOENT) {
-                    serverLog(LL_WARNING,"Fatal error loading the DB from PMEM: %s. Exiting.",strerror(errno));
-                    exit(1);
-                }
-            } TX_ONABORT {
-                serverLog(LL_WARNING,"Fatal error loading the DB from PMEM. Exiting.");
-                exit(1);
-            } TX_END
-	    }
+        if (server.persistent) pmemReplBacklogRestore();
 #endif
+#ifdef USE_PMDK
+        if (server.aof_state == AOF_ON) aofDaxOpen();
 #endif
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
@@ -44,6 +44,7 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <lua.h>
 #include <signal.h>
@@ -59,7 +60,11 @@ POBJ_LAYOUT_BEGIN(store_db);
 POBJ_LAYOUT_TOID(store_db, struct redis_pmem_root);
 POBJ_LAYOUT_TOID(store_db, struct key_val_pair_PM);
 #ifdef USE_PB
-POBJ_LAYOUT_TOID(store_db, struct persistent_aof_log);
+POBJ_LAYOUT_TOID(store_db, struct pb_log_record);
+POBJ_LAYOUT_TOID(store_db, struct pb_checkpoint);
+POBJ_LAYOUT_TOID(store_db, struct pb_repl_backlog);
+#else
+POBJ_LAYOUT_TOID(store_db, struct pm_slab_chunk);
 #endif
 POBJ_LAYOUT_END(store_db);
 
@@ -70,7 +75,9 @@ uint64_t pm_type_key_val_pair_PM;
 uint64_t pm_type_sds_type_id;
 uint64_t pm_type_emb_sds_type_id;
 #ifdef USE_PB
-uint64_t pm_type_persistent_aof_log;
+uint64_t pm_type_pb_log;
+uint64_t pm_type_pb_checkpoint;
+uint64_t pm_type_pb_repl_backlog;
 #endif
 
 /* Type key_val_pair_PM Object */
@@ -80,21 +87,44 @@ uint64_t pm_type_persistent_aof_log;
 /* Type Embedded SDS Object */
 #define PM_TYPE_EMB_SDS pm_type_emb_sds_type_id
 #ifdef USE_PB
-#define PM_TYPE_PERSISTENT_AOF_LOG pm_type_persistent_aof_log
+#define PM_TYPE_PB_LOG pm_type_pb_log
+#define PM_TYPE_PB_CHECKPOINT pm_type_pb_checkpoint
+#define PM_TYPE_PB_REPL_BACKLOG pm_type_pb_repl_backlog
 #endif
 
 #ifdef USE_PB
 struct redis_pmem_root {
-	uint64_t num_logs;
-    // Using double buffer method.
-    unsigned current_head:1;
-	TOID(struct persistent_aof_log) first_head;
-    TOID(struct persistent_aof_log) second_head;
+    uint64_t pb_version;            /* PB_LOG_VERSION once the log is formatted */
+    PMEMoid pb_log;                 /* Circular log region */
+    uint64_t pb_log_size;           /* Size of the log region in bytes */
+    uint64_t pb_head;               /* Oldest record not reclaimed yet */
+    uint64_t pb_aof_base;           /* Records numbered before it are in the
+                                       AOF file installed by the last rewrite
+                                       (first pool only) */
+    uint64_t pb_cmdtab_sig;         /* Command table of the binary records */
+    uint64_t pb_set_id;             /* Shared by the pools of a stripe set */
+    /* Written by the bio thread only, after every AOF fsync. */
+    uint64_t pb_durable;            /* Records numbered before it are fsynced
+                                       in the AOF (first pool only) */
+    uint32_t pb_stripe;             /* Index of the pool in its stripe set */
+    uint32_t pb_stripes;            /* Number of pools in the stripe set */
+    uint64_t pb_pad1[6];
+    /* Written by the main thread on every append: keep them in one line so
+     * a single flush persists them together. */
+    uint64_t pb_tail;               /* End of the newest record */
+    uint64_t pb_next_seq;           /* Sequence number of the record after
+                                       the newest one of this pool */
+    PMEMoid pb_ckpt;                /* Last complete checkpoint (first pool
+                                       only) */
+    PMEMoid pb_ckpt_next;           /* Checkpoint being written */
+    PMEMoid pb_repl_backlog;        /* Replication backlog (first pool
+                                       only) */
 };
 #else
 struct redis_pmem_root {
 	uint64_t num_dict_entries;
 	TOID(struct key_val_pair_PM) pe_first;
+	TOID(struct pm_slab_chunk) slab_first; /* Chunks of pmem_slab.c */
 };
 #endif
 
@@ -183,6 +213,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
+#define CONFIG_DEFAULT_AOF_DAX 0
+#define CONFIG_DEFAULT_AOF_DAX_PREALLOC (64*1024*1024)
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
@@ -196,10 +228,34 @@ typedef long long mstime_t; /* millisecond time type. */
 #ifdef USE_PMDK
 #define CONFIG_MIN_PM_FILE_SIZE PMEMOBJ_MIN_POOL
 #define CONFIG_DEFAULT_PM_FILE_SIZE (1024*1024*1024) /* 1GB */
+#define CONFIG_DEFAULT_PM_PREFAULT 0
+#define PM_HUGEPAGE_SIZE (2*1024*1024)  /* Pool sizes are rounded to it */
+#define PM_PREFAULT_MAX_THREADS 8
+#define PM_PREFAULT_MIN_CHUNK (64*1024*1024) /* Per prefault thread */
 #endif
 
 #ifdef USE_PB
 #define CONFIG_MIN_AOF_FLUSH_TIMER 0
+#define CONFIG_MIN_PB_LOG_SIZE (1024*1024) /* 1MB */
+#define CONFIG_DEFAULT_PB_LOG_SIZE 0 /* A quarter of the pool, up to 128MB */
+#define PB_LOG_AUTO_MAX_SIZE (128*1024*1024)
+#define PB_LOG_AUTO_POOL_FRACTION 4
+#define CONFIG_DEFAULT_PB_GROUP_COMMIT 1
+#define CONFIG_DEFAULT_PB_GROUP_COMMIT_SIZE 0
+#define CONFIG_DEFAULT_PB_RECLAIM_INTERVAL 0
+#define CONFIG_DEFAULT_PB_RECORD_ENCODING PB_ENCODING_RESP
+#define CONFIG_DEFAULT_PB_AOF_DRAIN 0
+#define CONFIG_DEFAULT_PB_STRIPE_POLICY PB_STRIPE_ROUND_ROBIN
+#define CONFIG_DEFAULT_PB_CHECKPOINT_INTERVAL 0
+#define CONFIG_DEFAULT_PB_MAX_MEMORY 0
+#define CONFIG_DEFAULT_PB_MAX_MEMORY_POLICY PB_MAXMEMORY_FSYNC
+#define CONFIG_DEFAULT_PB_LOAD_THREADS 2
+#define CONFIG_DEFAULT_PB_COMPRESS_THRESHOLD 0
+#define CONFIG_DEFAULT_REPL_BACKLOG_PMEM 0
+#define CONFIG_DEFAULT_PM_TIER_IDLE_TIME 0
+#define CONFIG_DEFAULT_PM_PROFILE "dram"
+#define CONFIG_MIN_PM_GRANULARITY 64
+#define CONFIG_MAX_PM_GRANULARITY 4096
 #endif
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
@@ -213,7 +269,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
 #define STATS_METRIC_NET_INPUT 1    /* Bytes read to network .*/
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
+#ifdef USE_PB
+#define STATS_METRIC_PB_RECORDS 3   /* Records appended to the PB log. */
+#define STATS_METRIC_PB_BYTES 4     /* Bytes persisted by PB appends. */
+#define STATS_METRIC_PM_TIER_DEMOTIONS 5 /* Values moved to PMEM. */
+#define STATS_METRIC_PM_TIER_PROMOTIONS 6 /* Values moved back to DRAM. */
+#define STATS_METRIC_COUNT 7
+#else
 #define STATS_METRIC_COUNT 3
+#endif
 
 /* Protocol and I/O related defines */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
@@ -334,12 +398,14 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_REPLY_SKIP (1<<24)  /* Don't send just this reply. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
+#define CLIENT_PB_DURABLE (1<<27)  /* Writes in the PB before the reply. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
 #define BLOCKED_NONE 0    /* Not blocked, no CLIENT_BLOCKED flag set. */
 #define BLOCKED_LIST 1    /* BLPOP & co. */
 #define BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
+#define BLOCKED_PB 3      /* Write throttled by pb-max-memory. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -495,6 +561,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define RDB_CHILD_TYPE_NONE 0
 #define RDB_CHILD_TYPE_DISK 1     /* RDB is written to disk. */
 #define RDB_CHILD_TYPE_SOCKET 2   /* RDB is written to slave socket. */
+#define RDB_CHILD_TYPE_PMEM 3     /* PB checkpoint written to the pool. */
 
 /* Keyspace changes notification classes. Every class is associated with a
  * character for configuration purposes. */
@@ -615,6 +682,9 @@ typedef struct blockingState {
     /* BLOCKED_WAIT */
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
     long long reploffset;   /* Replication offset to reach. */
+
+    /* BLOCKED_PB */
+    mstime_t pb_since;      /* Time the write was throttled. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -688,6 +758,18 @@ typedef struct client {
     char buf[PROTO_REPLY_CHUNK_BYTES];
 } client;
 
+#ifdef USE_PB
+/* State of a durable client before its command is executed, so that its
+ * reply can be replaced if the write can't be persisted. */
+typedef struct pbDurableState {
+    long long errors;       /* PB append errors counter. */
+    int bufpos;             /* Reply buffer position. */
+    size_t sentlen;         /* Bytes of the reply sent already. */
+    unsigned long nodes;    /* Objects in the reply list. */
+    size_t taillen;         /* Length of the last object of the list. */
+} pbDurableState;
+#endif
+
 struct saveparam {
     time_t seconds;
     int changes;
@@ -699,7 +781,7 @@ struct sharedObjectsStruct {
     *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
-    *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+    *busykeyerr, *oomerr, *pbfullerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *rpop, *lpop,
     *lpush, *emptyscan, *minstring, *maxstring,
     *select[PROTO_SHARED_SELECT_CMDS],
@@ -871,17 +953,101 @@ struct redisServer {
     /* Persistent memory */
     char* pm_file_path;             /* Path to persistent memory file */
     size_t pm_file_size;            /* If PM file does not exist, create new one with given size */
+    int pm_prefault;                /* Fault the pool pages in at startup */
     bool persistent;                /* Persistence enabled/disabled */
     bool pm_reconstruct_required; /* reconstruct database form PMEM */
     PMEMobjpool *pm_pool;           /* PMEM pool handle */
     TOID(struct redis_pmem_root) pm_rootoid; /*PMEM root object OID*/
     uint64_t pool_uuid_lo;          /* PMEM pool UUID */
+    long long stat_pm_tx_started;   /* PMEM transactions begun */
+    long long stat_pm_tx_aborted;   /* PMEM transactions aborted */
+#ifndef USE_PB
+    list *pm_dirty_keys;            /* Keys to copy to the pool after the
+                                       current command, see pmemKeyspaceSync() */
+#endif
 #endif
 #ifdef USE_PB
     int verbosity_pb_only;          /* Force to write LL_PB log only. */
     size_t aof_flush_timer;         /* AOF log flush timer */
+    int pm_profile;                 /* PM_PROFILE_* of the emulated PMEM */
     size_t pm_read_latency;         /* Read latency */
     size_t pm_write_latency;        /* Write latency */
+    size_t pm_read_bandwidth;       /* Emulated read bandwidth in MB/s */
+    size_t pm_write_bandwidth;      /* Emulated write bandwidth in MB/s */
+    size_t pm_granularity;          /* Emulated media access size */
+    size_t pb_log_size;             /* Size of the PB circular log, 0 =
+                                       sized after the pool */
+    struct redis_pmem_root *pb_root; /* Root object of the first pool */
+    pbStripe pb_stripe[PB_MAX_STRIPES]; /* Pools the PB log is striped on */
+    int pb_stripes;                 /* Number of pools in pb_stripe */
+    int pb_stripe_policy;           /* PB_STRIPE_* */
+    int pb_stripe_next;             /* Pool of the next append */
+    uint64_t pb_next_seq;           /* Sequence number of the next record */
+    int pb_group_commit;            /* Persist commands once per event loop */
+    long long pb_group_commit_size; /* Max commands per batch, 0 = no limit */
+    int pb_reclaim_interval;        /* Milliseconds between reclaims, 0 = when
+                                       the log is full only */
+    mstime_t pb_reclaim_last;       /* Time of the last periodic reclaim */
+    int pb_load_threads;            /* Threads parsing the PB at startup */
+    int pb_record_encoding;         /* PB_ENCODING_(RESP|BINARY) */
+    size_t pb_compress_threshold;   /* LZF payloads above this size, 0 = off */
+    uint64_t pb_cmdtab_sig;         /* pbCommandTableSignature() */
+    sds pb_batch;                   /* Commands staged for the next PB record */
+    int pb_batch_dictid;            /* DB selected when the batch started */
+    int pb_batch_shard;             /* Pool of the batch, -1 if any */
+    int pb_batch_flags;             /* Record flags of the staged commands */
+    long long pb_batch_cmds;        /* Number of commands in pb_batch */
+    size_t pb_batch_aof_len;        /* Size of the staged commands in the AOF */
+    int pb_in_unit;                 /* Between a propagated MULTI and EXEC */
+    int pb_aof_drain;               /* Write the AOF from the PB, not aof_buf */
+    uint64_t pb_drain_pos;          /* First record not written to the AOF */
+    pbIterator pb_drain_it;         /* Where the pools are at pb_drain_pos */
+    int pb_checkpoint_interval;     /* Seconds between checkpoints, 0 = off */
+    unsigned long long pb_max_memory; /* Max bytes of records not fsynced */
+    int pb_max_memory_policy;       /* PB_MAXMEMORY_* */
+    int pb_fsync_asap;              /* Start a background fsync right away */
+    list *pb_throttled_clients;     /* Clients blocked by pb-max-memory */
+    uint64_t pb_ckpt_seq;           /* First record not in the checkpoint,
+                                       0 if there is no checkpoint */
+    uint64_t pb_ckpt_len;           /* Size of the checkpoint RDB payload */
+    uint64_t pb_ckpt_next_seq;      /* pb_ckpt_seq of the one being written */
+    size_t pb_ckpt_next_size;       /* Size of the region for the next one */
+    time_t pb_ckpt_time_last;       /* Time the last checkpoint started */
+    int pb_ckpt_last_status;        /* C_OK or C_ERR */
+    int repl_backlog_pmem;          /* Replication backlog in the first pool */
+    int pm_tier_idle_time;          /* Seconds before a value goes to PMEM */
+    size_t pm_tier_cold_keys;       /* Values in PMEM */
+    size_t pm_tier_cold_bytes;      /* Their length */
+    list *pm_tier_pending;          /* Cold sds to free once the child exits */
+#ifdef PB_FAULT_INJECTION
+    int pb_fault_point;             /* PB_FAULT_*, armed by DEBUG PB-FAULT */
+    long long pb_fault_countdown;   /* Hits left before the kill */
+#endif
+    size_t pb_drain_skip;           /* Bytes of that record already written */
+    size_t pb_drain_pending;        /* PB bytes not written to the AOF yet */
+    long long stat_pb_records;      /* Records appended to the PB log */
+    long long stat_pb_commands;     /* Commands persisted in the PB log */
+    long long stat_pb_fences;       /* Persist barriers issued by PB appends */
+    long long stat_pb_max_batch;    /* Largest batch persisted as one record */
+    long long stat_pb_payload_bytes; /* Record payload bytes written to PMEM */
+    long long stat_pb_aof_bytes;    /* Same commands in the AOF format */
+    long long stat_pb_compressed_records; /* Records stored LZF compressed */
+    long long stat_pb_compressed_saved_bytes; /* Payload bytes saved by LZF */
+    long long stat_pb_flushes;      /* Cache line flush calls of PB appends */
+    long long stat_pb_persisted_bytes; /* Bytes flushed by PB appends */
+    long long stat_pb_drain_writes; /* writev() calls draining the AOF */
+    long long stat_pb_append_errors; /* Records that couldn't be appended */
+    long long stat_pb_forced_fsyncs; /* Synchronous fsyncs of pb-max-memory */
+    long long stat_pb_durable_fallbacks; /* Durable writes fsynced in the AOF */
+    long long stat_pb_shard_fallbacks; /* Records not in the pool of their shard */
+    long long stat_pb_throttled_writes; /* Writes delayed by pb-max-memory */
+    long long stat_pb_rejected_writes; /* Writes refused by pb-max-memory */
+    long long stat_pb_last_clear_usec; /* Last bio fsync + durable update */
+    long long stat_pb_append_latency[PB_LATENCY_BUCKETS]; /* Histogram */
+    long long stat_pm_tier_demotions; /* Values moved to PMEM */
+    long long stat_pm_tier_promotions; /* Values moved back to DRAM */
+    long long stat_pm_tier_errors;  /* Values PMEM had no room for */
+    long long stat_pm_allocated;    /* Bytes allocated in the pool */
 #endif
     /* AOF persistence */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
@@ -897,6 +1063,10 @@ struct redisServer {
     list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
     int aof_fd;       /* File descriptor of currently selected AOF file */
+#ifdef USE_PB
+    uintptr_t aof_fd_gen;           /* Bumped when aof_fd is replaced, see
+                                       aof_background_fsync() */
+#endif
     int aof_selected_db; /* Currently selected DB in AOF */
     time_t aof_flush_postponed_start; /* UNIX time of postponed AOF flush */
     time_t aof_last_fsync;            /* UNIX time of last fsync() */
@@ -908,6 +1078,10 @@ struct redisServer {
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+#ifdef USE_PMDK
+    int aof_dax;                    /* Write the AOF through a mapping */
+    long long aof_dax_prealloc;     /* Bytes the mapped AOF grows by */
+#endif
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -1208,6 +1382,7 @@ void addReplyLongLong(client *c, long long ll);
 void addReplyMultiBulkLen(client *c, long length);
 void copyClientOutputBuffer(client *dst, client *src);
 void *dupClientReplyValue(void *o);
+size_t getStringObjectSdsUsedMemory(robj *o);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
@@ -1354,6 +1529,7 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset);
 
 /* Generic persistence functions */
 void startLoading(FILE *fp);
+void startLoadingSize(off_t size);
 void loadingProgress(off_t pos);
 void stopLoading(void);
 
@@ -1362,18 +1538,28 @@ void stopLoading(void);
 
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
+void aof_background_fsync(int fd);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
 #ifdef USE_PB
-int loadAppendOnlyPersistentBuffer();
+int loadAppendOnlyPersistentBuffer(uint64_t from);
+void feedAppendOnlyFileRaw(int dictid, const char *buf, size_t len);
 #endif
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
 void aofRewriteBufferReset(void);
 unsigned long aofRewriteBufferSize(void);
+#ifdef USE_PMDK
+void aofDaxOpen(void);
+void aofDaxClose(void);
+void aofDaxRecover(void);
+int aofDaxActive(void);
+size_t aofDaxSize(void);
+ssize_t aofDaxWrite(const struct iovec *iov, int iovcnt);
+#endif
 
 /* Sorted sets data type */
 
@@ -1432,6 +1618,11 @@ void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
 void populateCommandTable(void);
+#ifdef USE_PB
+long pbCommandIndex(struct redisCommand *cmd);
+struct redisCommand *pbCommandByIndex(uint64_t idx);
+uint64_t pbCommandTableSignature(void);
+#endif
 void resetCommandTableStats(void);
 void adjustOpenFilesLimit(void);
 void closeListeningSockets(int unlink_unix_socket);
@@ -1527,6 +1718,38 @@ long long emptyDb(void(callback)(void*));
 int selectDb(client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
+#if defined(USE_PMDK) && !defined(USE_PB)
+int pmemIsPM(const void *ptr);
+void pmemKeyspaceAddPair(sds key, sds val, int dbid, long long expire);
+sds pmemKeyspaceLink(redisDb *db, dictEntry *de, sds val);
+void pmemKeyspaceInstallKey(redisDb *db, dictEntry *de, sds key);
+void pmemKeyspaceUnlink(sds key);
+void pmemKeyspaceDetachValue(sds key);
+void pmemKeyspaceTouch(redisDb *db, robj *key);
+void pmemKeyspaceSync(void);
+void pmemKeyspaceSyncAll(void);
+int pmemKeyspaceReconstruct(void);
+void pmemKeyspaceClear(void);
+void pmemSlabInit(void);
+void *pmemSlabAlloc(size_t size);
+int pmemSlabFree(void *ptr);
+int pmemSlabOwns(const void *ptr);
+void pmemSlabRebuildBegin(void);
+void pmemSlabMark(void *ptr);
+void pmemSlabRebuildEnd(void);
+void pmemSlabReleaseAll(void);
+void pmemSlabCron(void);
+size_t pmemSlabChunks(void);
+size_t pmemSlabUsedBytes(void);
+#endif
+#ifdef USE_PB
+void pmemTierInit(void);
+int pmemTierIsCold(const void *s);
+void pmemTierRelease(sds s);
+void pmemTierPromote(robj *o);
+void pmemTierCron(void);
+int pmemPBShard(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+#endif
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
 unsigned int delKeysInSlot(unsigned int hashslot);
@@ -1759,6 +1982,13 @@ void getAnotherPBListStatusCommand(client *c);
 void addPBListCommand(client *c);
 void switchPBListCommand(client *c);
 void clearCurrentPBListCommand(client *c);
+void pbCheckpointCommand(client *c);
+int pbDurableCheck(client *c);
+int pbMaxMemoryCheck(client *c);
+void pbReleaseThrottledClients(void);
+void unblockClientThrottledByPB(client *c);
+void pbDurableBegin(client *c, pbDurableState *st);
+void pbDurableCommit(client *c, pbDurableState *st);
 #endif
 
 #if defined(__GNUC__)
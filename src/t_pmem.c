@@ -49,121 +49,226 @@ void getDramStatusCommand(client *c) {
     setDeferredMultiBulkLength(c, replylen, numreplies);
 }
 
-void getPBListStatusCommand(client *c) {
+void replyPBList(client *c, int buffer) {
     void *replylen = addDeferredMultiBulkLength(c);
     unsigned long numreplies = 0;
-    char str_buf[1024];
-    TOID(struct persistent_aof_log) log_toid;
-    struct persistent_aof_log *log_obj;
-    void *cmd;
-    void *pmem_base_addr;
+    pbIterator it;
+    pb_log_record *rec;
 
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    log_toid.oid = getCurrentHead();
+    pmemPBIterInit(&it, buffer);
+    while ((rec = pmemPBIterNext(&it)) != NULL) {
+        sds str = sdsnew("cmd: ");
+        char *payload = rec->payload, *raw = NULL;
+        size_t len = rec->len;
+        int repr = rec->flags & PB_RECORD_BINARY;
 
-    if (TOID_IS_NULL(log_toid)) {
-        setDeferredMultiBulkLength(c, replylen, numreplies);
-        return;
-    }
-    while (1) {
-        log_obj = (persistent_aof_log *)(
-                log_toid.oid.off + (uint64_t) pmem_base_addr
-        );
-        cmd = (void *)(log_obj->cmd_oid.off + (uint64_t) pmem_base_addr);
-
-        sprintf(str_buf, "cmd: %s", (sds) cmd);
-        addReplyBulkCString(c, str_buf);
-        numreplies++;
+        if (rec->flags & PB_RECORD_LZF) {
+            raw = zmalloc(rec->raw_len);
+            if (pmemPBDecompress(rec, raw) == C_OK) {
+                payload = raw;
+                len = rec->raw_len;
+            } else {
+                /* Show the compressed bytes of a damaged record. */
+                repr = 1;
+            }
+        }
+        if (repr)
+            str = sdscatrepr(str, payload, len);
+        else
+            str = sdscatlen(str, payload, len);
+        zfree(raw);
 
-        log_toid = D_RO(log_toid)->next;
-        if (TOID_IS_NULL(log_toid))
-            break;
+        addReplyBulkSds(c, str);
+        numreplies++;
     }
 
     setDeferredMultiBulkLength(c, replylen, numreplies);
 }
 
+void getPBListStatusCommand(client *c) {
+    replyPBList(c, PB_BUFFER_CURRENT);
+}
+
 void getAnotherPBListStatusCommand(client *c) {
-    void *replylen = addDeferredMultiBulkLength(c);
-    unsigned long numreplies = 0;
-    char str_buf[1024];
-    TOID(struct persistent_aof_log) log_toid;
-    struct persistent_aof_log *log_obj;
-    void *cmd;
-    void *pmem_base_addr;
+    replyPBList(c, PB_BUFFER_ANOTHER);
+}
 
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    log_toid.oid = getAnotherHead();
+void addPBListCommand(client *c) {
+    robj *cmd = getDecodedObject(c->argv[1]);
+    int error = pmemAddToPBList(cmd->ptr, sdslen(cmd->ptr), c->db->id) == C_ERR;
 
-    if (TOID_IS_NULL(log_toid)) {
-        setDeferredMultiBulkLength(c, replylen, numreplies);
+    decrRefCount(cmd);
+    if (error) {
+        addReplyError(c, "Add PB List in PM failed!");
         return;
     }
-    while (1) {
-        log_obj = (persistent_aof_log *)(
-                log_toid.oid.off + (uint64_t) pmem_base_addr
-        );
-        cmd = (void *)(log_obj->cmd_oid.off + (uint64_t) pmem_base_addr);
-
-        sprintf(str_buf, "cmd: %s", (sds) cmd);
-        addReplyBulkCString(c, str_buf);
-        numreplies++;
+    addReply(c, shared.ok);
+}
 
-        log_toid = D_RO(log_toid)->next;
-        if (TOID_IS_NULL(log_toid))
-            break;
-    }
+void switchPBListCommand(client *c) {
+    pmemSwitchDoubleBuffer();
+    addReply(c, shared.ok);
+}
 
-    setDeferredMultiBulkLength(c, replylen, numreplies);
+void clearCurrentPBListCommand(client *c) {
+    pmemClearPBList(PB_BUFFER_CURRENT);
+    addReply(c, shared.ok);
 }
 
-void addPBListCommand(client *c) {
-    void* cmd_oid;
-    int error = 0;
+/* Durable writes (CLIENT DURABLE ON): the writes of the client are in the
+ * PB before it gets the replies, the batch staged for group commit being
+ * persisted right after each command. */
 
-    TX_BEGIN(server.pm_pool) {
-        sds cmd = sdsdupPM(c->argv[1]->ptr, &cmd_oid);
-        pmemAddToPBList(cmd);
-    } TX_ONABORT {
-        error = 1;
-    } TX_END
+/* Called before a write command of a durable client is executed: returns
+ * C_ERR if there is no room left in the PB for it, so that it is refused
+ * rather than executed without being durable. */
+int pbDurableCheck(client *c) {
+    size_t len = 16;
+    int j;
 
-    if (error) {
-        addReplyError(c, "Add PB List in PM failed!");
-        return;
+    /* Without AOF the commands are not logged in the PB. */
+    if (!server.persistent || server.aof_state == AOF_OFF) return C_ERR;
+    /* Same size as in the AOF format, at worst. */
+    for (j = 0; j < c->argc; j++)
+        len += stringObjectLen(c->argv[j]) + 32;
+    return pmemPBHasRoom(len, pmemPBShard(c->cmd, c->db->id, c->argv,
+                                          c->argc)) ? C_OK : C_ERR;
+}
+
+/* Called before a command of a durable client is executed. */
+void pbDurableBegin(client *c, pbDurableState *st) {
+    st->errors = server.stat_pb_append_errors;
+    st->bufpos = c->bufpos;
+    st->sentlen = c->sentlen;
+    st->nodes = listLength(c->reply);
+    st->taillen = 0;
+    if (st->nodes) {
+        robj *tail = listNodeValue(listLast(c->reply));
+
+        if (tail->encoding == OBJ_ENCODING_RAW) st->taillen = sdslen(tail->ptr);
     }
-    addReply(c, shared.ok);
 }
 
-void switchPBListCommand(client *c) {
-    int error = 0;
+/* Drop the reply added by the command since pbDurableBegin(). If part of
+ * the output was written meanwhile, by processEventsWhileBlocked(), the
+ * reply can't be told apart from the previous ones: the client is closed
+ * without it instead. */
+static void pbDropReply(client *c, pbDurableState *st) {
+    listIter li;
+    listNode *ln;
 
-    TX_BEGIN(server.pm_pool) {
-        pmemSwitchDoubleBuffer();
-    } TX_ONABORT {
-        error = 1;
-    } TX_END
+    if (c->sentlen != st->sentlen || listLength(c->reply) < st->nodes ||
+        (st->nodes == 0 && c->bufpos < st->bufpos))
+    {
+        c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+        return;
+    }
+    while (listLength(c->reply) > st->nodes)
+        listDelNode(c->reply,listLast(c->reply));
+    if (st->nodes) {
+        robj *tail = listNodeValue(listLast(c->reply));
 
-    if (error) {
-        addReplyError(c, "Switch PB in PM failed!");
+        /* Appending to the object made it private to the client. */
+        if (tail->encoding == OBJ_ENCODING_RAW &&
+            sdslen(tail->ptr) > st->taillen)
+            sdsIncrLen(tail->ptr,(int)st->taillen-(int)sdslen(tail->ptr));
+    }
+    c->bufpos = st->bufpos;
+    c->reply_bytes = 0;
+    listRewind(c->reply,&li);
+    while ((ln = listNext(&li)) != NULL)
+        c->reply_bytes += getStringObjectSdsUsedMemory(listNodeValue(ln));
+}
+
+/* Called after a command of a durable client was executed. The command was
+ * checked by pbDurableCheck(), but its record may still not fit, for
+ * instance when a script propagates more than its arguments. The commands
+ * are in the AOF buffer then, even in drain mode, so the write is made
+ * durable by fsyncing the AOF, as with appendfsync always. If even that
+ * fails the reply is replaced by -PBFULL: the write is applied, but not
+ * acknowledged. */
+void pbDurableCommit(client *c, pbDurableState *st) {
+    pmemCommitPBBatch();
+    if (server.stat_pb_append_errors == st->errors) return;
+
+    if (pmemPBForceSync() == C_OK) {
+        server.stat_pb_durable_fallbacks++;
         return;
     }
-    addReply(c, shared.ok);
+    serverLog(LL_WARNING,"Can't persist the write of a durable client in the "
+        "persistent buffer nor in the AOF: replying with an error.");
+    pbDropReply(c,st);
+    addReply(c,shared.pbfullerr);
 }
 
-void clearCurrentPBListCommand(client *c) {
-    int error = 0;
+/* pb-max-memory: called before a write command is executed when the records
+ * not fsynced in the AOF exceed the limit. Returns C_OK if the command can
+ * be executed, C_ERR if it was refused or the client was blocked. */
+int pbMaxMemoryCheck(client *c) {
+    mstime_t latency;
 
-    TX_BEGIN(server.pm_pool) {
-        pmemClearPBList(getCurrentHead());
-    } TX_ONABORT {
-        error = 1;
-    } TX_END
+    if (!pmemPBOverLimit()) return C_OK;
+    switch(server.pb_max_memory_policy) {
+    case PB_MAXMEMORY_FSYNC:
+        latencyStartMonitor(latency);
+        pmemPBForceSync();
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("pb-full",latency);
+        return C_OK;
+    case PB_MAXMEMORY_REJECT:
+        pmemPBRequestFsync();
+        server.stat_pb_rejected_writes++;
+        flagTransaction(c);
+        addReply(c,shared.pbfullerr);
+        return C_ERR;
+    default:
+        /* The commands queued in MULTI are throttled with EXEC. */
+        if (c->flags & CLIENT_MULTI) return C_OK;
+        pmemPBRequestFsync();
+        server.stat_pb_throttled_writes++;
+        c->bpop.timeout = 0;
+        c->bpop.pb_since = mstime();
+        listAddNodeTail(server.pb_throttled_clients,c);
+        blockClient(c,BLOCKED_PB);
+        return C_ERR;
+    }
+}
 
-    if (error) {
-        addReplyError(c, "Clear current PB in PM failed!");
-        return;
+/* Called before sleeping: unblock the clients throttled by pb-max-memory
+ * when the records are back under the limit, or when they waited for
+ * PB_THROTTLE_MAX_MS, making room synchronously. */
+void pbReleaseThrottledClients(void) {
+    client *c = listNodeValue(listFirst(server.pb_throttled_clients));
+
+    if (pmemPBOverLimit()) {
+        if (mstime() - c->bpop.pb_since < PB_THROTTLE_MAX_MS) return;
+        pmemPBForceSync();
+    }
+    while (listLength(server.pb_throttled_clients)) {
+        c = listNodeValue(listFirst(server.pb_throttled_clients));
+        unblockClient(c);
+    }
+}
+
+void unblockClientThrottledByPB(client *c) {
+    listNode *ln = listSearchKey(server.pb_throttled_clients,c);
+
+    serverAssert(ln != NULL);
+    listDelNode(server.pb_throttled_clients,ln);
+    latencyAddSampleIfNeeded("pb-full",mstime()-c->bpop.pb_since);
+}
+
+void pbCheckpointCommand(client *c) {
+    if (!server.persistent || server.aof_state == AOF_OFF) {
+        addReplyError(c,"Checkpoints need the persistent buffer and the AOF");
+    } else if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) {
+        addReplyError(c,"Background save or AOF rewrite already in progress");
+    } else if (server.pb_in_unit) {
+        addReplyError(c,"Checkpoints can't be taken inside MULTI");
+    } else if (pmemCheckpointBackground() == C_OK) {
+        addReplyStatus(c,"Checkpoint started");
+    } else {
+        addReplyError(c,"Can't take a checkpoint, check the server logs");
     }
-    addReply(c, shared.ok);
 }
 #endif
@@ -88,15 +88,17 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
     }
 #if defined(USE_PMDK) && !defined(USE_PB)
     if (server.persistent) {
-        int error = 0;
+        volatile int error = 0;
 
         /* Copy value from RAM to PM - create RedisObject and sds(value) */
+        server.stat_pm_tx_started++;
         TX_BEGIN(server.pm_pool) {
             newVal = dupStringObjectPM(val);
             /* Set key in PM - create DictEntry and sds(key) linked to RedisObject with value
              * Don't increment value "ref counter" as in normal process. */
             setKeyPM(c->db,key,newVal);
         } TX_ONABORT {
+            server.stat_pm_tx_aborted++;
             error = 1;
         } TX_END
 
@@ -0,0 +1,316 @@
+#!/usr/bin/env tclsh8.5
+# Crash recovery of the persistent buffer: correctness and time.
+#
+# For every size and persist point, a server is filled with --keys keys,
+# then --size more writes are appended to the persistent buffer. The
+# persist point is armed with DEBUG PB-FAULT and the writes go on until the
+# server kills itself there. The server is then restarted, the time it
+# takes to replay the persistent buffer is measured, and the keyspace is
+# checked against the writes that were acknowledged before the crash: all
+# of them must be there, and nothing that was never sent. Writes sent but
+# not acknowledged may be there or not.
+#
+# The "replay" point crashes the server while it replays the persistent
+# buffer at startup, after a plain SIGKILL: it is then restarted once more.
+# Only the records not in the AOF are replayed, so it needs --truncate-aof.
+# A point that is not hit within --max-writes writes is reported as such,
+# the server being killed with SIGKILL instead.
+#
+# The rows for a point, ordered by size, are the curve of the recovery
+# time against the size of the persistent buffer. With --truncate-aof the
+# AOF is cut back to its size before the writes to the persistent buffer,
+# as if they were lost with the page cache: they are then all replayed from
+# the persistent buffer instead of the AOF. This requires a log large
+# enough to hold them, since the AOF is never fsynced in this mode.
+#
+# The server must be built with fault injection, from the top level
+# directory:
+#
+#   make USE_PMDK=yes USE_PB=yes PB_FAULT_INJECTION=yes
+#   tclsh tests/pb-recovery.tcl [--csv] [--sizes "10000 100000"] ...
+
+set ::root [file normalize [file join [file dirname [info script]] ..]]
+source $::root/tests/support/redis.tcl
+
+set ::dir /dev/shm/pb-recovery
+set ::port 12140
+set ::pool_size 1gb
+set ::log_size 256mb
+set ::keys 10000
+set ::sizes {1000 10000 100000}
+set ::points {append-record append-tail wrap durable reclaim replay}
+set ::count 1
+set ::value_size 64
+set ::pipeline 64
+set ::max_writes 1000000
+set ::truncate_aof 0
+set ::extra {}
+set ::csv 0
+
+proc usage {} {
+    puts "Usage: pb-recovery.tcl \[options\]"
+    puts "  --dir <path>           Scratch directory, on tmpfs (default $::dir)"
+    puts "  --port <port>          Server port (default $::port)"
+    puts "  --pool-size <size>     PMEM pool size (default $::pool_size)"
+    puts "  --log-size <size>      Persistent buffer log size (default $::log_size)"
+    puts "  --keys <n>             Keys written before the test (default $::keys)"
+    puts "  --sizes <list>         Writes in the PB before the crash (default \"$::sizes\")"
+    puts "  --points <list>        Persist points (default \"$::points\")"
+    puts "  --count <n>            Crash at the nth hit of the point (default $::count)"
+    puts "  --value-size <n>       Value size (default $::value_size)"
+    puts "  --pipeline <n>         Writes sent at once (default $::pipeline)"
+    puts "  --max-writes <n>       Give up on a point after n writes (default $::max_writes)"
+    puts "  --truncate-aof         Lose the AOF writes made after the first keys"
+    puts "  --server-args <args>   Extra server options, e.g. \"--pb-group-commit no\""
+    puts "  --csv                  Output in CSV format"
+    exit 1
+}
+
+for {set j 0} {$j < [llength $argv]} {incr j} {
+    set opt [lindex $argv $j]
+    set arg [lindex $argv [expr {$j+1}]]
+    switch -- $opt {
+        --dir {set ::dir $arg; incr j}
+        --port {set ::port $arg; incr j}
+        --pool-size {set ::pool_size $arg; incr j}
+        --log-size {set ::log_size $arg; incr j}
+        --keys {set ::keys $arg; incr j}
+        --sizes {set ::sizes $arg; incr j}
+        --points {set ::points $arg; incr j}
+        --count {set ::count $arg; incr j}
+        --value-size {set ::value_size $arg; incr j}
+        --pipeline {set ::pipeline $arg; incr j}
+        --max-writes {set ::max_writes $arg; incr j}
+        --truncate-aof {set ::truncate_aof 1}
+        --server-args {set ::extra $arg; incr j}
+        --csv {set ::csv 1}
+        default usage
+    }
+}
+
+set ::server $::root/src/redis-server
+set ::pad [string repeat x $::value_size]
+foreach libdir {deps/pmdk/src/nondebug deps/pmdk/src/debug} {
+    if {[file isdirectory $::root/$libdir]} {
+        if {[info exists ::env(LD_LIBRARY_PATH)]} {
+            set ::env(LD_LIBRARY_PATH) "$::root/$libdir:$::env(LD_LIBRARY_PATH)"
+        } else {
+            set ::env(LD_LIBRARY_PATH) $::root/$libdir
+        }
+    }
+}
+
+proc server_args {} {
+    set args [list --port $::port --bind 127.0.0.1 \
+        --dir $::dir --logfile $::dir/redis.log \
+        --daemonize no --loglevel notice --verbosity-pb-only no \
+        --save "" --appendonly yes --appendfilename appendonly.aof \
+        --auto-aof-rewrite-percentage 0 \
+        --pmfile $::dir/pb.pm $::pool_size --pb-log-size $::log_size]
+    if {$::truncate_aof} {lappend args --appendfsync no}
+    concat $args $::extra
+}
+
+proc alive {pid} {
+    if {[catch {open /proc/$pid/stat} fd]} {return 0}
+    set state [lindex [read $fd] 2]
+    close $fd
+    expr {$state ne "Z"}
+}
+
+# Wait for the server to exit and release the port.
+proc wait_exit {pid} {
+    while {[alive $pid] ||
+           ![catch {close [socket 127.0.0.1 $::port]}]} {after 10}
+}
+
+# Start the server and wait for it to be done loading. Returns the pid, a
+# client and the time in milliseconds, or raises an error if the server
+# exits in the meantime.
+proc start_server {args} {
+    set pid [exec $::server {*}$args >& /dev/null &]
+    set start [clock milliseconds]
+    while 1 {
+        if {![alive $pid]} {
+            wait_exit $pid
+            error "server exited"
+        }
+        if {![catch {
+            set r [redis 127.0.0.1 $::port]
+            set loading [info_field [$r info persistence] loading]
+        }]} {
+            if {$loading eq "0"} break
+            $r close
+        }
+        after 10
+    }
+    list $pid $r [expr {[clock milliseconds] - $start}]
+}
+
+proc kill_server {pid r} {
+    catch {$r close}
+    catch {exec kill -9 $pid}
+    wait_exit $pid
+}
+
+proc info_field {info field} {
+    if {[regexp "\r\n$field:(\[^\r\n\]*)" "\r\n$info" -> value]} {
+        return $value
+    }
+    return 0
+}
+
+proc resp {args} {
+    set cmd "*[llength $args]\r\n"
+    foreach a $args {append cmd "$[string length $a]\r\n$a\r\n"}
+    return $cmd
+}
+
+proc value {prefix i} {return "$prefix$i:$::pad"}
+
+# Send SET w:<n> for n from 'first' on, 'pipeline' writes at a time, until
+# 'count' writes are acknowledged or the connection is lost. Returns the
+# number of writes acknowledged and sent.
+proc write_range {r first count} {
+    set acked 0
+    set sent 0
+    while {$acked < $count} {
+        set n [expr {min($::pipeline, $count-$acked)}]
+        set buf {}
+        for {set j 0} {$j < $n} {incr j} {
+            set id [expr {$first+$acked+$j}]
+            append buf [resp set w:$id [value w $id]]
+        }
+        if {[catch {$r write $buf; $r flush}]} break
+        incr sent $n
+        for {set j 0} {$j < $n} {incr j} {
+            if {[catch {$r read} reply] || $reply ne "OK"} {
+                return [list $acked $sent]
+            }
+            incr acked
+        }
+    }
+    list $acked $sent
+}
+
+# Check the keyspace: the 'keys' keys, the writes before 'acked', and the
+# ones up to 'sent' if present. Returns the number of errors.
+proc verify {r acked sent} {
+    set errors 0
+    foreach {prefix first last optional} [list k 0 $::keys 0 \
+                                                w 0 $acked 0 \
+                                                w $acked $sent 1] {
+        for {set i $first} {$i < $last} {incr i 1000} {
+            set names {}
+            set top [expr {min($i+1000, $last)}]
+            for {set j $i} {$j < $top} {incr j} {lappend names $prefix:$j}
+            set j $i
+            foreach v [$r mget {*}$names] {
+                if {$v ne [value $prefix $j] && !($optional && $v eq {})} {
+                    incr errors
+                }
+                incr j
+            }
+        }
+    }
+    set dbsize [$r dbsize]
+    if {$dbsize < $::keys+$acked || $dbsize > $::keys+$sent} {incr errors}
+    return $errors
+}
+
+# Lines of the server log written from 'offset' on.
+proc log_since {offset} {
+    set fd [open $::dir/redis.log]
+    seek $fd $offset
+    set log [read $fd]
+    close $fd
+    return $log
+}
+
+proc report {fields} {
+    if {$::csv} {
+        puts [join $fields ","]
+    } else {
+        puts [format "%-14s %8s %9s %10s %9s %11s %10s %11s %6s" {*}$fields]
+    }
+}
+
+report {point writes pb_mb records replay_mb replay_ms restart_ms
+        crashed status}
+set failures 0
+foreach size $::sizes {
+    foreach point $::points {
+        file delete -force $::dir
+        file mkdir $::dir
+        set args [server_args]
+        lassign [start_server {*}$args] pid r
+        set buf {}
+        for {set i 0} {$i < $::keys} {incr i} {
+            append buf [resp set k:$i [value k $i]]
+        }
+        $r write $buf
+        $r flush
+        for {set i 0} {$i < $::keys} {incr i} {$r read}
+        set aof_size [info_field [$r info persistence] aof_current_size]
+        $r close
+
+        set r [redis 127.0.0.1 $::port 1]
+        lassign [write_range $r 0 $size] acked sent
+        $r debug pb-fault off
+        if {[catch {$r read} err]} {
+            puts "The server must be built with PB_FAULT_INJECTION=yes: $err"
+            kill_server $pid $r
+            exit 1
+        }
+        $r info
+        set info [$r read]
+        set pb_used [info_field $info pb_log_used]
+
+        # Crash at the persist point, or kill the server right away when
+        # the point is hit at startup.
+        set crashed yes
+        if {$point ne "replay"} {
+            $r debug pb-fault $point $::count
+            $r read
+            lassign [write_range $r $size $::max_writes] more more_sent
+            incr acked $more
+            set sent [expr {$size + $more_sent}]
+            if {$more == $::max_writes} {set crashed no}
+        }
+        kill_server $pid $r
+        if {$::truncate_aof} {
+            set fd [open $::dir/appendonly.aof r+]
+            chan truncate $fd $aof_size
+            close $fd
+        }
+        if {$point eq "replay"} {
+            if {[catch {start_server {*}$args --pb-fault-inject replay \
+                                    $::count} res]} {
+                set crashed yes
+            } else {
+                kill_server {*}[lrange $res 0 1]
+                set crashed no
+            }
+        }
+
+        set offset [file size $::dir/redis.log]
+        lassign [start_server {*}$args] pid r ms
+        set log [log_since $offset]
+        set records 0
+        set replay_mb 0
+        set replay_ms 0
+        if {[regexp {replayed: ([0-9]+) records, ([0-9]+) bytes in ([0-9.]+) seconds} \
+                $log -> records bytes secs]} {
+            set replay_mb [format %.1f [expr {$bytes/1048576.0}]]
+            set replay_ms [expr {round($secs*1000)}]
+        }
+        set errors [verify $r $acked $sent]
+        kill_server $pid $r
+        if {$errors} {incr failures}
+        report [list $point $acked [format %.1f [expr {$pb_used/1048576.0}]] \
+            $records $replay_mb $replay_ms $ms $crashed \
+            [expr {$errors ? "FAIL($errors)" : "OK"}]]
+    }
+}
+file delete -force $::dir
+exit [expr {$failures != 0}]
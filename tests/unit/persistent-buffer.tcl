@@ -0,0 +1,440 @@
+# The persistent buffer only exists when the server is built with USE_PB:
+# its configuration options are unknown otherwise.
+start_server {} {
+    set ::pb_enabled [llength [r config get pb-group-commit]]
+}
+
+proc pb_pipeline {count} {
+    set buf {}
+    for {set j 0} {$j < $count} {incr j} {
+        append buf [formatCommand set pipeline:$j $j]
+    }
+    r write $buf
+    r flush
+    for {set j 0} {$j < $count} {incr j} {
+        r read
+    }
+}
+
+proc pb_stripe_used {n} {
+    regexp "pb_stripe_$n:used=(\\d+)" [r info persistentbuffer] - used
+    set used
+}
+
+# Run 'load' and kill the server before the AOF is fsynced, then truncate
+# the AOF to its size before 'load' and restart: the writes can only be
+# recovered from the persistent buffer.
+proc pb_test_recovery {name overrides load} {
+    set overrides [concat $overrides appendonly yes appendfsync no]
+    start_server [list overrides $overrides] {
+        set aof_size [s aof_current_size]
+        eval $load
+        set digest [r debug digest]
+        exec kill -9 [srv 0 pid]
+    }
+    set fp [open [file join [dict get $overrides dir] appendonly.aof] r+]
+    chan truncate $fp $aof_size
+    close $fp
+    start_server [list overrides $overrides] {
+        test $name {
+            assert_match {*Persistent buffer replayed: [1-9]*} \
+                [exec cat [srv 0 stdout]]
+            r debug digest
+        } $digest
+    }
+}
+
+if {$::pb_enabled} {
+set server_path [tmpdir server.pb]
+set pb_overrides [list dir $server_path pmfile {pb.pm 32mb} \
+                      pb-log-size 1mb appendonly yes]
+
+tags {"pb"} {
+    start_server [list overrides $pb_overrides] {
+        test {CLIENT DURABLE ON sets the D flag} {
+            assert_equal OK [r client durable on]
+            assert_match {*flags=D*} [r client list]
+            r set foo bar
+        } {OK}
+
+        test {CLIENT DURABLE refuses a write that can't fit in the PB} {
+            assert_error {PBFULL*} {r set big [string repeat x 2000000]}
+            r exists big
+        } {0}
+
+        test {CLIENT DURABLE OFF clears the D flag} {
+            r client durable off
+            assert {![string match {*flags=D*} [r client list]]}
+            r set big [string repeat x 2000000]
+            r strlen big
+        } {2000000}
+
+        test {CLIENT DURABLE needs the AOF} {
+            r config set appendonly no
+            catch {r client durable on} e
+            r config set appendonly yes
+            waitForBgrewriteaof r
+            set e
+        } {*need the persistent buffer and the AOF*}
+    }
+
+    start_server [list overrides [concat $pb_overrides pb-group-commit-size 4]] {
+        test {pb-group-commit-size splits the batches} {
+            r config resetstat
+            pb_pipeline 20
+            set max [s pb_max_batch_size]
+            assert {$max >= 1 && $max <= 4}
+        }
+    }
+
+    start_server [list overrides $pb_overrides] {
+        test {Group commit persists a pipeline in a single record} {
+            r config resetstat
+            pb_pipeline 20
+            assert {[s pb_max_batch_size] > 4}
+            assert {[s pb_records_appended] < [s pb_commands_logged]}
+        }
+    }
+
+    start_server [list overrides $pb_overrides] {
+        test {PBCHECKPOINT is refused inside MULTI} {
+            r multi
+            r pbcheckpoint
+            catch {r exec} e
+            set e
+        } {*inside MULTI*}
+
+        test {PBCHECKPOINT takes a checkpoint in the background} {
+            r flushall
+            createComplexDataset r 1000
+            assert_equal {Checkpoint started} [r pbcheckpoint]
+            wait_for_condition 50 100 {
+                [s pb_checkpoint_in_progress] == 0
+            } else {
+                fail "The checkpoint didn't terminate"
+            }
+            s pb_last_checkpoint_status
+        } {ok}
+
+        createComplexDataset r 1000
+        set digest [r debug digest]
+        exec kill -9 [srv 0 pid]
+    }
+
+    start_server [list overrides $pb_overrides] {
+        test {The dataset is recovered after PBCHECKPOINT and a crash} {
+            wait_for_condition 50 100 {
+                [s loading] eq 0
+            } else {
+                fail "Loading didn't terminate"
+            }
+            set fp [open [srv 0 stdout]]
+            set log [read $fp]
+            close $fp
+            assert_match {*DB loaded from the PB checkpoint*} $log
+            r debug digest
+        } $digest
+    }
+
+    start_server [list overrides $pb_overrides] {
+        test {CONFIG SET and GET of the PB options} {
+            r config set pb-group-commit-size 4
+            r config set pb-reclaim-interval 100
+            r config set pb-max-memory-policy reject
+            r config set pm-profile pcm
+            list [r config get pb-group-commit-size] \
+                 [r config get pb-reclaim-interval] \
+                 [r config get pb-max-memory-policy] \
+                 [r config get pm-profile]
+        } {{pb-group-commit-size 4} {pb-reclaim-interval 100} {pb-max-memory-policy reject} {pm-profile pcm}}
+
+        test {CONFIG SET of a PM timing makes the profile custom} {
+            r config set pm-granularity 128
+            r config get pm-profile
+        } {pm-profile custom}
+
+        test {CONFIG SET refuses invalid PB options} {
+            assert_error {*Invalid argument*} {r config set pm-granularity 100}
+            assert_error {*Invalid argument*} {r config set pb-group-commit-size -1}
+            assert_error {*Invalid argument*} {r config set pb-max-memory-policy foo}
+            r config get pb-max-memory-policy
+        } {pb-max-memory-policy reject}
+
+        test {CONFIG REWRITE of the PB options} {
+            r config rewrite
+            set fp [open [srv 0 config_file]]
+            set content [read $fp]
+            close $fp
+            assert_match "*\npb-group-commit-size 4\n*" $content
+            assert_match "*\npb-reclaim-interval 100\n*" $content
+            assert_match "*\npb-max-memory-policy reject\n*" $content
+            assert_match "*\npm-granularity 128\n*" $content
+            r config set pb-max-memory-policy fsync
+        } {OK}
+
+        test {CONFIG SET pb-group-commit-size applies to the next batches} {
+            r config set pb-group-commit-size 2
+            r config resetstat
+            pb_pipeline 20
+            s pb_max_batch_size
+        } {2}
+    }
+
+    set drain_overrides [list dir [tmpdir server.pb-drain] \
+                             pmfile {pb.pm 32mb} pb-log-size 1mb \
+                             appendonly yes pb-aof-drain yes]
+
+    start_server [list overrides $drain_overrides] {
+        test {Drain mode: a write that can't fit in the PB goes to the AOF} {
+            r set before 1
+            r set big [string repeat x 2000000]
+            r set after 2
+            assert_equal 1 [s pb_append_errors]
+            s pb_aof_drain_pending
+        } {0}
+        exec kill -9 [srv 0 pid]
+    }
+
+    start_server [list overrides $drain_overrides] {
+        test {Drain mode: the write is recovered from the AOF after a crash} {
+            list [r get before] [r strlen big] [r get after]
+        } {1 2000000 2}
+    }
+
+    start_server [list overrides [concat $drain_overrides \
+                                     dir [tmpdir server.pb-durable]]] {
+        test {CLIENT DURABLE: a script too large for the PB fsyncs the AOF} {
+            r client durable on
+            r eval {
+                redis.replicate_commands()
+                for i=1,300 do
+                    redis.call('set','key:'..i,string.rep('x',5000))
+                end
+                return 1
+            } 0
+            assert_equal 1 [s pb_durable_fallbacks]
+            assert_equal PONG [r ping]
+            r client durable off
+            r dbsize
+        } {300}
+    }
+
+    set shard_path [tmpdir server.pb-shard]
+    start_server [list overrides [list dir $shard_path \
+                                     pmfile {pb0.pm 32mb pb1.pm 16mb} \
+                                     appendonly yes pb-stripe-policy shard]] {
+        test {pb-stripe-policy shard: the records of DB n go to pool n % 2} {
+            r select 1
+            r set foo bar
+            r select 3
+            r incr counter
+            assert_equal 0 [pb_stripe_used 0]
+            set used1 [pb_stripe_used 1]
+            assert {$used1 > 0}
+            r select 2
+            r set foo bar
+            assert {[pb_stripe_used 0] > 0}
+            assert_equal $used1 [pb_stripe_used 1]
+            s pb_shard_fallbacks
+        } {0}
+
+        test {pb-stripe-policy shard: a record too large for its pool goes to another one} {
+            r select 1
+            r set big [string repeat x 5000000]
+            assert_equal 0 [s pb_append_errors]
+            s pb_shard_fallbacks
+        } {1}
+    }
+
+    set binary_overrides [list dir [tmpdir server.pb-binary] \
+                              pmfile {pb.pm 32mb} pb-record-encoding binary]
+
+    start_server [list overrides [concat $binary_overrides appendonly yes]] {
+        test {pb-record-encoding binary: records are smaller than the AOF} {
+            for {set j 0} {$j < 100} {incr j} {
+                r incrby counter:$j 1000000
+                r set key:$j $j
+            }
+            assert_equal binary [s pb_record_encoding]
+            assert {[s pb_payload_aof_ratio] < 1}
+        }
+    }
+
+    pb_test_recovery {pb-record-encoding binary: writes replayed after a crash} \
+        $binary_overrides {
+            createComplexDataset r 1000
+            r set crlf "a\r\nb"
+            r incrby counter -12345678901
+        }
+
+    set stripes_overrides [list dir [tmpdir server.pb-stripes] \
+                               pmfile {pb0.pm 16mb pb1.pm 16mb}]
+
+    start_server [list overrides [concat $stripes_overrides appendonly yes]] {
+        test {Striped PB: records go to the pools in turn} {
+            for {set j 0} {$j < 10} {incr j} {
+                r set key:$j $j
+            }
+            assert_equal 2 [s pb_stripes_active]
+            assert {[pb_stripe_used 0] > 0 && [pb_stripe_used 1] > 0}
+            s pb_stripe_policy
+        } {round-robin}
+    }
+
+    pb_test_recovery {Striped PB: the pools are replayed in order after a crash} \
+        $stripes_overrides {
+            for {set j 0} {$j < 100} {incr j} {
+                r incr counter
+                r append log $j,
+            }
+            createComplexDataset r 1000
+        }
+
+    set dax_path [tmpdir server.pb-dax]
+    set dax_aof [file join $dax_path appendonly.aof]
+    set dax_overrides [list dir $dax_path pmfile {pb.pm 32mb} \
+                           appendonly yes aof-dax yes aof-dax-prealloc 1mb]
+
+    start_server [list overrides $dax_overrides] {
+        test {aof-dax: the AOF is mapped and preallocated} {
+            createComplexDataset r 1000
+            assert_equal 1 [s aof_dax]
+            assert {[file size $dax_aof] >= 1048576}
+            expr {[file size $dax_aof] > [s aof_current_size]}
+        } {1}
+        set digest [r debug digest]
+        exec kill -9 [srv 0 pid]
+    }
+
+    start_server [list overrides $dax_overrides] {
+        test {aof-dax: the AOF is trimmed to its logical size after a crash} {
+            r debug digest
+        } $digest
+        r set after-crash 1
+        set digest [r debug digest]
+        set aof_size [s aof_current_size]
+    }
+
+    test {aof-dax: a clean shutdown leaves a standard AOF} {
+        list [file size $dax_aof] [file exists $dax_aof.dax]
+    } [list $aof_size 0]
+
+    start_server [list overrides [concat $dax_overrides aof-dax no]] {
+        test {aof-dax: the AOF loads without aof-dax} {
+            r debug digest
+        } $digest
+    }
+
+    set lzf_overrides [list dir [tmpdir server.pb-lzf] \
+                           pmfile {pb.pm 32mb} pb-compress-threshold 1kb]
+
+    start_server [list overrides [concat $lzf_overrides appendonly yes]] {
+        test {pb-compress-threshold: large records are compressed} {
+            r set small [string repeat abc 100]
+            assert_equal 0 [s pb_compressed_records]
+            r set large [string repeat abc 2000]
+            assert_equal 1 [s pb_compressed_records]
+            assert {[s pb_compressed_saved_bytes] > 4000}
+            r set random [randstring 5000 5000 binary]
+            s pb_compressed_records
+        } {1}
+    }
+
+    pb_test_recovery {pb-compress-threshold: compressed records replayed after a crash} \
+        $lzf_overrides {
+            for {set j 0} {$j < 20} {incr j} {
+                r set large:$j [string repeat "value $j " 1000]
+                r append large:$j [randstring 2000 2000 alpha]
+            }
+            createComplexDataset r 1000
+        }
+
+    set backlog_overrides [list dir [tmpdir server.pb-backlog] \
+                               pmfile {pb.pm 32mb} appendonly yes \
+                               repl-backlog-pmem yes]
+
+    start_server [list overrides $backlog_overrides] {
+        start_server {} {
+            test {repl-backlog-pmem: the backlog is allocated in PMEM} {
+                r slaveof [srv -1 host] [srv -1 port]
+                wait_for_condition 50 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Replication not started"
+                }
+                r -1 set foo bar
+                s -1 repl_backlog_pmem
+            } {1}
+        }
+        r set foo2 bar
+        set backlog_runid [s run_id]
+        set backlog_offset [s master_repl_offset]
+        catch {r shutdown}
+    }
+
+    start_server [list overrides $backlog_overrides] {
+        # The PINGs of replicationCron() may have moved the offset since.
+        test {repl-backlog-pmem: the backlog survives a clean restart} {
+            assert_match "*Replication backlog restored from PMEM: run id $backlog_runid, offset $backlog_offset,*" \
+                [exec cat [srv 0 stdout]]
+            assert {[s master_repl_offset] >= $backlog_offset}
+            list [s run_id] [s repl_backlog_active]
+        } [list $backlog_runid 1]
+
+        test {repl-backlog-pmem: a slave continues with a partial resync} {
+            set rd [redis [srv 0 host] [srv 0 port]]
+            set reply [$rd psync $backlog_runid [expr {$backlog_offset+1}]]
+            $rd close
+            list $reply [s sync_partial_ok]
+        } {CONTINUE 1}
+    }
+
+    set tier_overrides [list dir [tmpdir server.pb-tier] \
+                            pmfile {pb.pm 32mb} pm-tier-idle-time 1]
+
+    start_server [list overrides [concat $tier_overrides appendonly yes]] {
+        test {pm-tier-idle-time: idle values are demoted to the pool} {
+            for {set j 0} {$j < 100} {incr j} {
+                r set tier:$j [string repeat "value $j " 20]
+            }
+            r set short abc
+            wait_for_condition 100 100 {
+                [s pm_tier_cold_keys] == 100
+            } else {
+                fail "Idle values not demoted"
+            }
+            assert {[s pm_tier_cold_bytes] >= 100*64}
+            list [s pm_tier_demotions] [s pm_tier_errors]
+        } {100 0}
+
+        test {pm-tier-idle-time: a cold value is promoted on access} {
+            set digest [r debug digest]
+            assert_equal [string repeat "value 7 " 20] [r get tier:7]
+            assert_equal $digest [r debug digest]
+            r append tier:8 tail
+            assert_equal "[string repeat {value 8 } 20]tail" [r get tier:8]
+            list [s pm_tier_promotions] [s pm_tier_cold_keys]
+        } {2 98}
+
+        test {pm-tier-idle-time 0 stops the demotions} {
+            r config set pm-tier-idle-time 0
+            r set tier:new [string repeat x 100]
+            after 2500
+            s pm_tier_demotions
+        } {100}
+    }
+
+    pb_test_recovery {pm-tier-idle-time: cold values rebuilt after a crash} \
+        $tier_overrides {
+            for {set j 0} {$j < 100} {incr j} {
+                r set tier:$j [randstring 64 200 alpha]
+            }
+            wait_for_condition 100 100 {
+                [s pm_tier_cold_keys] > 0
+            } else {
+                fail "Idle values not demoted"
+            }
+            r set tier:0 hot
+        }
+}
+}
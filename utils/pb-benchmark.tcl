@@ -0,0 +1,231 @@
+#!/usr/bin/env tclsh8.5
+# Compare the AOF fsync policies against the persistent buffer.
+#
+# Every configuration is started in turn with its data in a scratch
+# directory, tmpfs by default, so no NVDIMM is needed: the PMEM latency and
+# bandwidth are emulated by the server as set by the pm-* options of the
+# config file. For each configuration the SET throughput is measured over a
+# sweep of pipeline depths and value sizes, then the server is killed with
+# SIGKILL right after a write burst and the time it takes to come back is
+# measured.
+#
+# Run it from the top level directory after building with USE_PB=yes:
+#
+#   tclsh utils/pb-benchmark.tcl [--csv] [--dir /dev/shm/pb-bench] ...
+
+set ::root [file normalize [file join [file dirname [info script]] ..]]
+source $::root/tests/support/redis.tcl
+
+set ::dir /dev/shm/pb-bench
+set ::port 12130
+set ::requests 100000
+set ::clients 50
+set ::pipelines {1 16 64}
+set ::sizes {16 256 4096}
+set ::pool_size 1gb
+set ::recovery_keys 200000
+set ::csv 0
+set ::only {}
+
+# Name, config file, extra options. The persistent buffer configurations
+# also get a pool file in the scratch directory. The AOF ones run with the
+# defaults, since redis.conf enables the pool too.
+set ::configs {
+    {aof-always {} {--appendfsync always} 0}
+    {aof-everysec {} {--appendfsync everysec} 0}
+    {pb pbredis.conf {} 1}
+    {pb-dram dram-pbredis.conf {} 1}
+    {pb-pcm pcm-pbredis.conf {} 1}
+    {pb-3dxpoint-mm 3dxpoint-mm-pbredis.conf {} 1}
+    {pb-3dxpoint-sm 3dxpoint-sm-pbredis.conf {} 1}
+}
+
+proc usage {} {
+    puts "Usage: pb-benchmark.tcl \[options\]"
+    puts "  --dir <path>           Scratch directory, on tmpfs (default $::dir)"
+    puts "  --port <port>          Server port (default $::port)"
+    puts "  --requests <n>         Requests per run (default $::requests)"
+    puts "  --clients <n>          Parallel clients (default $::clients)"
+    puts "  --pipelines <list>     Pipeline depths (default \"$::pipelines\")"
+    puts "  --sizes <list>         Value sizes (default \"$::sizes\")"
+    puts "  --pool-size <size>     PMEM pool size (default $::pool_size)"
+    puts "  --recovery-keys <n>    Keys written before the kill (default $::recovery_keys)"
+    puts "  --only <list>          Run only the named configurations"
+    puts "  --csv                  Output in CSV format"
+    exit 1
+}
+
+for {set j 0} {$j < [llength $argv]} {incr j} {
+    set opt [lindex $argv $j]
+    set arg [lindex $argv [expr {$j+1}]]
+    switch -- $opt {
+        --dir {set ::dir $arg; incr j}
+        --port {set ::port $arg; incr j}
+        --requests {set ::requests $arg; incr j}
+        --clients {set ::clients $arg; incr j}
+        --pipelines {set ::pipelines $arg; incr j}
+        --sizes {set ::sizes $arg; incr j}
+        --pool-size {set ::pool_size $arg; incr j}
+        --recovery-keys {set ::recovery_keys $arg; incr j}
+        --only {set ::only $arg; incr j}
+        --csv {set ::csv 1}
+        default usage
+    }
+}
+
+set ::server $::root/src/redis-server
+set ::benchmark $::root/src/redis-benchmark
+foreach libdir {deps/pmdk/src/nondebug deps/pmdk/src/debug} {
+    if {[file isdirectory $::root/$libdir]} {
+        if {[info exists ::env(LD_LIBRARY_PATH)]} {
+            set ::env(LD_LIBRARY_PATH) "$::root/$libdir:$::env(LD_LIBRARY_PATH)"
+        } else {
+            set ::env(LD_LIBRARY_PATH) $::root/$libdir
+        }
+    }
+}
+
+proc server_args {conf extra pb} {
+    set args {}
+    if {$conf ne {}} {lappend args $::root/$conf}
+    lappend args --port $::port --bind 127.0.0.1 \
+        --dir $::dir --logfile $::dir/redis.log --pidfile $::dir/redis.pid \
+        --daemonize no --loglevel notice --verbosity-pb-only no \
+        --save "" --appendonly yes \
+        --appendfilename appendonly.aof --auto-aof-rewrite-percentage 0
+    if {$pb} {lappend args --pmfile $::dir/pb.pm $::pool_size}
+    concat $args $extra
+}
+
+proc start_server {args} {
+    set pid [exec $::server {*}$args >& /dev/null &]
+    set start [clock milliseconds]
+    # Wait for the server to accept commands, including the load time.
+    while 1 {
+        if {![alive $pid]} {
+            error "server exited, see $::dir/redis.log"
+        }
+        if {![catch {
+            set r [redis 127.0.0.1 $::port]
+            set loading [info_field [$r info persistence] loading]
+        }]} {
+            if {$loading eq "0"} break
+            $r close
+        }
+        after 10
+    }
+    list $pid $r [expr {[clock milliseconds] - $start}]
+}
+
+proc alive {pid} {
+    if {[catch {open /proc/$pid/stat} fd]} {return 0}
+    set state [lindex [read $fd] 2]
+    close $fd
+    expr {$state ne "Z"}
+}
+
+proc stop_server {pid r} {
+    catch {$r close}
+    catch {exec kill -9 $pid}
+    # Wait for all the threads to exit and release the port.
+    while {[alive $pid] ||
+           ![catch {close [socket 127.0.0.1 $::port]}]} {after 10}
+}
+
+proc info_field {info field} {
+    if {[regexp "\r\n$field:(\[^\r\n\]*)" "\r\n$info" -> value]} {
+        return $value
+    }
+    return 0
+}
+
+# Returns throughput and the 50th, 99th and 99.9th latency percentiles, in
+# milliseconds, from the redis-benchmark latency distribution.
+proc run_benchmark {pipeline size} {
+    set out [exec $::benchmark -p $::port -t set -n $::requests \
+        -c $::clients -P $pipeline -d $size -r 1000000 2>@1]
+    set rps 0
+    set pct {}
+    foreach line [split $out "\n"] {
+        if {[regexp {^([0-9.]+)% <= ([0-9]+) milliseconds} $line -> p ms]} {
+            lappend pct $p $ms
+        } elseif {[regexp {^([0-9.]+) requests per second} $line -> v]} {
+            set rps $v
+        }
+    }
+    set res [list $rps]
+    foreach want {50 99 99.9} {
+        set found n/a
+        foreach {p ms} $pct {
+            if {$p >= $want} {set found $ms; break}
+        }
+        lappend res $found
+    }
+    return $res
+}
+
+proc report {fields} {
+    if {$::csv} {
+        puts [join $fields ","]
+    } else {
+        puts [format "%-15s %5s %6s %12s %6s %6s %6s %10s %10s %10s %10s %10s" \
+            {*}$fields]
+    }
+}
+
+proc report_recovery {fields} {
+    if {$::csv} {
+        puts [join $fields ","]
+    } else {
+        puts [format "%-15s %10s %10s %10s %12s %14s" {*}$fields]
+    }
+}
+
+proc mb {bytes} {format %.1f [expr {$bytes/1048576.0}]}
+
+set recovery {}
+report {config pipe size ops/s p50ms p99ms p999ms pb_p50ns pb_p99ns
+        pb_p999ns pmem_mb aof_mb}
+foreach cfg $::configs {
+    lassign $cfg name conf extra pb
+    if {$::only ne {} && [lsearch -exact $::only $name] == -1} continue
+    file delete -force $::dir
+    file mkdir $::dir
+    set args [server_args $conf $extra $pb]
+    lassign [start_server {*}$args] pid r
+
+    foreach pipeline $::pipelines {
+        foreach size $::sizes {
+            $r config resetstat
+            set aof_before [info_field [$r info persistence] aof_current_size]
+            lassign [run_benchmark $pipeline $size] rps p50 p99 p999
+            set info [$r info]
+            set aof [expr {[info_field $info aof_current_size]-$aof_before}]
+            report [list $name $pipeline $size $rps $p50 $p99 $p999 \
+                [info_field $info pb_append_latency_p50_ns] \
+                [info_field $info pb_append_latency_p99_ns] \
+                [info_field $info pb_append_latency_p999_ns] \
+                [mb [info_field $info pb_persisted_bytes]] [mb $aof]]
+        }
+    }
+
+    # Kill the server right after a write burst, so that the tail of the
+    # writes is only in the persistent buffer, or lost with the plain AOF.
+    $r flushall
+    exec $::benchmark -p $::port -t set -n $::recovery_keys -c $::clients \
+        -P 16 -d 256 -r $::recovery_keys -q >& /dev/null
+    $r set pb-benchmark-last 1
+    set keys [$r dbsize]
+    set aof_size [info_field [$r info persistence] aof_current_size]
+    stop_server $pid $r
+    lassign [start_server {*}$args] pid r ms
+    lappend recovery [list $name $keys [$r dbsize] \
+        [expr {[$r exists pb-benchmark-last] ? "yes" : "no"}] $ms \
+        [mb $aof_size]]
+    stop_server $pid $r
+}
+
+puts ""
+report_recovery {config keys recovered last_write recovery_ms aof_mb}
+foreach row $recovery {report_recovery $row}
+file delete -force $::dir